@@ -0,0 +1,55 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+    #include <nmmintrin.h>
+#endif
+
+#include "crc.h"
+
+#define CRC32C_POLY 0x82f63b78 // Reversed.
+
+typedef u32 (*Crc_Fn) (u32, u8 *, u64);
+
+static u32 table [256];
+
+static u32 crc32c_table (u32 crc, u8 *data, u64 count) {
+    for (u64 i = 0; i < count; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42 (u32 crc, u8 *data, u64 count) {
+    u64 crc64 = crc;
+
+    for (; count >= 8; count -= 8, data += 8) {
+        u64 chunk;
+        memcpy(&chunk, data, 8);
+        crc64 = _mm_crc32_u64(crc64, chunk);
+    }
+
+    crc = (u32)crc64;
+    for (; count; --count) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+static Crc_Fn pick_implementation (void) {
+    #if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2")) return crc32c_sse42;
+    #endif
+
+    for (u32 i = 0; i < 256; ++i) {
+        u32 crc = i;
+        for (u32 bit = 0; bit < 8; ++bit) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : (crc >> 1);
+        table[i] = crc;
+    }
+
+    return crc32c_table;
+}
+
+u32 crc32c (u8 *data, u64 count) {
+    static Crc_Fn fn;
+    if (! fn) fn = pick_implementation();
+    return ~fn(~0u, data, count);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+
+// =============================================================================
+// CRC-32C (Castagnoli). On x86-64 CPUs with SSE4.2 the crc32
+// instruction is used. Otherwise we fall back to a lookup table.
+// =============================================================================
+u32 crc32c (u8 *data, u64 count);
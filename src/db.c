@@ -77,20 +77,64 @@ Db_Row *db_query_next (Db_Query *query) {
     return run_next(query->runner);
 }
 
+// Modified pages are cached by the pager and only written
+// back once the whole query text has been run.
 Db_Result db_run (Database *db, String text, DString *report) {
     mem_arena_clear(db->mem_query);
-    return db_run_query(db, text, (Mem*)db->mem_query, report, false);
+    Db_Result result = db_run_query(db, text, (Mem*)db->mem_query, report, false);
+    bengine_flush(db->engine);
+    return result;
+}
+
+void db_set_cache_size (Database *db, u64 bytes) {
+    u64 pages = bytes / bengine_get_page_size(db->engine);
+    bengine_set_cache_size(db->engine, (u32)MIN(pages, UINT32_MAX));
+}
+
+void db_set_cache_pages (Database *db, u32 pages) {
+    bengine_set_cache_size(db->engine, pages);
+}
+
+// A pinned table is loaded into the page cache and stays there
+// unless the cache has nothing else left to evict. Pins are not
+// saved in the db file. Returns DB_FAIL if there is no such table.
+Db_Result db_pin_table (Database *db, String table, bool pin) {
+    return typer_pin_table(db->typer, table, pin) ? DB_OK : DB_FAIL;
+}
+
+Db_Cache_Stats db_get_cache_stats (Database *db) {
+    Pager_Stats stats = bengine_get_cache_stats(db->engine);
+    return (Db_Cache_Stats){ .hits = stats.hits, .misses = stats.misses, .evictions = stats.evictions, .dirty_evictions = stats.dirty_evictions };
+}
+
+Db_Sync_Stats db_get_sync_stats (Database *db) {
+    Fs_Sync_Stats stats;
+    fs_get_sync_stats(db->fs, &stats);
+    return (Db_Sync_Stats){ .count = stats.count, .total_ns = stats.total_ns, .max_ns = stats.max_ns };
 }
 
 void db_close (Database *db) {
     Mem_Clib *mem_clib = db->mem_clib;
 
+    bengine_close(db->engine);
+
     fs_destroy(db->fs);
     mem_track_destroy(db->mem);
     mem_clib_destroy(mem_clib);
 }
 
-Db_Result db_init (Database **out_db, String db_file_path, Mem *mem) {
+// The options can be NULL in which case defaults are used.
+// Returns DB_FAIL if the options don't go together (see
+// Db_Options) or the db file is corrupt or too big. If the
+// path is ":memory:" the db is kept in memory only and is gone
+// once it gets closed. Each such db_init() makes a new one.
+Db_Result db_init (Database **out_db, String db_file_path, Mem *mem, Db_Options *options) {
+    Db_Options defaults = {0};
+    if (! options) options = &defaults;
+    if (options->page_size && !pager_is_valid_page_size(options->page_size)) return DB_FAIL;
+    if (options->compression && options->page_size && (options->page_size <= 4*KB)) return DB_FAIL;
+    if (options->clean_ahead && options->wal) return DB_FAIL;
+
     Mem_Clib *mem_clib   = NULL;
     Mem_Track *mem_track = NULL;
 
@@ -103,12 +147,52 @@ Db_Result db_init (Database **out_db, String db_file_path, Mem *mem) {
 
     Database *db = MEM_ALLOC(mem_track, sizeof(Database));
 
+    Pager_Options pager_options = {
+        .mmap             = options->mmap,
+        .page_size        = options->page_size,
+        .cache_size       = options->cache_pages,
+        .cache_size_bytes = options->cache_bytes,
+        .cache_policy     = (options->cache_policy == DB_CACHE_LRU) ? PAGER_CACHE_LRU : PAGER_CACHE_2Q,
+        .extent_size      = options->extent_size,
+        .wal              = options->wal,
+        .sync             = (options->durability == DB_DURABILITY_OFF)  ? PAGER_SYNC_OFF :
+                            (options->durability == DB_DURABILITY_FULL) ? PAGER_SYNC_FULL :
+                                                                          PAGER_SYNC_NORMAL,
+        .checksums        = options->checksums,
+        .verify           = (options->verify == DB_VERIFY_FIRST_LOAD) ? PAGER_VERIFY_FIRST_LOAD :
+                            (options->verify == DB_VERIFY_SAMPLED)    ? PAGER_VERIFY_SAMPLED :
+                                                                        PAGER_VERIFY_ALWAYS,
+        .compression      = options->compression,
+        .warm_up          = options->warm_up,
+        .clean_ahead      = options->clean_ahead,
+        .clean_ahead_rate = options->clean_ahead_rate,
+    };
+
+    // A db in memory doesn't outlive the process, so there is
+    // nothing to sync and nothing to warm the cache up from.
+    if (fs_is_memory_path(db_file_path)) {
+        pager_options.sync    = PAGER_SYNC_OFF;
+        pager_options.warm_up = false;
+    }
+
     db->mem       = mem_track;
     db->mem_clib  = mem_clib;
     db->mem_query = mem_arena_new((Mem*)db->mem, 1*MB);
     db->fs        = fs_new((Mem*)db->mem);
+
+    // Before the engine, so that the warm up already reads
+    // through io_uring.
+    if (options->io_uring) fs_async_init(db->fs);
+
     db->typer     = typer_new(db, (Mem*)db->mem);
-    db->engine    = bengine_new(db->fs, (Mem*)db->mem, db_file_path);
+    db->engine    = bengine_new(db->fs, (Mem*)db->mem, db_file_path, &pager_options);
+
+    if (! db->engine) {
+        fs_destroy(db->fs);
+        mem_track_destroy(db->mem);
+        mem_clib_destroy(mem_clib);
+        return DB_FAIL;
+    }
 
     typer_init_catalog(db->typer, bengine_db_is_empty(db->engine));
 
@@ -25,13 +25,116 @@ typedef struct {
     Array(Db_Value) values;
 } Db_Row;
 
+typedef enum {
+    DB_CACHE_2Q,  // Scan resistant. This is the default.
+    DB_CACHE_LRU,
+} Db_Cache_Policy;
+
+typedef enum {
+    DB_DURABILITY_NORMAL, // Sync at checkpoints. This is the default.
+    DB_DURABILITY_OFF,    // Never sync. A crash can lose or corrupt data.
+    DB_DURABILITY_FULL,   // Sync the wal at every commit.
+} Db_Durability;
+
+typedef enum {
+    DB_VERIFY_ALWAYS,     // Check the checksum every time a page is loaded. This is the default.
+    DB_VERIFY_FIRST_LOAD, // Only the first time a page is loaded after db_init().
+    DB_VERIFY_SAMPLED,    // Every 16th page load.
+} Db_Verify;
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 dirty_evictions;
+} Db_Cache_Stats;
+
+typedef struct {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+} Db_Sync_Stats;
+
+typedef struct {
+    bool mmap; // Read pages straight out of a memory mapping of the db file.
+
+    // Do page I/O through io_uring so that prefetches and flushes
+    // can have many requests in flight. If io_uring is not
+    // available, then blocking I/O is used as usual.
+    bool io_uring;
+
+    // Page size for newly created db files. Must be a power of two
+    // between 512 and 32KB. Existing files keep their page size.
+    u32 page_size;
+
+    // Capacity of the page cache either as a page count or in bytes.
+    // If both are set the page count wins.
+    u32 cache_pages;
+    u64 cache_bytes;
+
+    Db_Cache_Policy cache_policy;
+
+    // The db file grows in extents of at least this many bytes
+    // which are preallocated on disk. Compressed files grow by the
+    // same steps but aren't preallocated. (0 = 1MB)
+    u64 extent_size;
+
+    // Append modified pages to a write-ahead log (the db file path
+    // plus "-wal") and copy them into the db file at checkpoints.
+    // Each db_run() or transaction is one commit. Without this a
+    // transaction still goes through the log, which is checkpointed
+    // at the commit, so that the commit is atomic.
+    bool wal;
+
+    // When the files get synced. In wal mode a checkpoint copies
+    // the log into the db file. Without the wal each db_run() is
+    // written into the db file right away and each transaction
+    // is checkpointed at the commit. Both count as a checkpoint,
+    // so normal and full behave the same.
+    Db_Durability durability;
+
+    // Store a CRC-32C at the end of every page of a newly created
+    // db file. Existing files keep the setting they were created
+    // with. A page with a bad checksum aborts the process.
+    bool checksums;
+    Db_Verify verify;
+
+    // Compress the pages of a newly created db file on disk. This
+    // saves disk space and I/O at the cost of CPU time on every
+    // read and write of the file. The pages in the cache stay
+    // uncompressed. Existing files keep their setting. The page
+    // size must be bigger than 4KB, since a compressed page only
+    // saves space in whole 4KB blocks.
+    bool compression;
+
+    // On close the ids of the cached pages are written to a file
+    // (the db file path plus "-hot"). On the next open they are
+    // loaded back into the cache before the first query runs.
+    bool warm_up;
+
+    // Dirty pages that are close to being evicted are written back
+    // ahead of time by a background thread, so that evictions
+    // rarely have to write. This is the percentage of the cache
+    // that is kept clean (capped at a few dozen pages), and the
+    // max bytes per second spent on it. Can't be combined with the
+    // wal. Has no effect during a transaction or on compressed
+    // files. (0 = off/unlimited)
+    u32 clean_ahead;
+    u64 clean_ahead_rate;
+} Db_Options;
+
 typedef struct Database Database;
 typedef struct Db_Query Db_Query;
 
-Db_Result db_init        (Database **, String db_file_path, Mem *);
-void      db_close       (Database *);
-Db_Result db_run         (Database *, String query, DString *report);
-Db_Result db_query_init  (Db_Query **, Database *, String select_statement);
-void      db_query_close (Db_Query *);
-Db_Row   *db_query_next  (Db_Query *);
+Db_Result      db_init            (Database **, String db_file_path, Mem *, Db_Options *);
+void           db_close           (Database *);
+void           db_set_cache_size  (Database *, u64 bytes);
+void           db_set_cache_pages (Database *, u32 pages);
+Db_Result      db_pin_table       (Database *, String table, bool pin);
+Db_Cache_Stats db_get_cache_stats (Database *);
+Db_Sync_Stats  db_get_sync_stats  (Database *);
+Db_Result      db_run             (Database *, String query, DString *report);
+Db_Result      db_query_init      (Db_Query **, Database *, String select_statement);
+void           db_query_close     (Db_Query *);
+Db_Row        *db_query_next      (Db_Query *);
 
@@ -4,6 +4,10 @@
 
 #include <string.h>
 
+#if defined(__x86_64__)
+    #include <immintrin.h>
+#endif
+
 #include "pager.h"
 #include "report.h"
 #include "engine.h"
@@ -16,23 +20,59 @@
 // a u32 and the pager reserves one page for itself.
 #define MAX_BTREE_HEIGHT 32
 
+// Once a cursor has moved to the next leaf this many times in
+// a row the scan is considered sequential and the pager gets
+// asked to prefetch up to READ_AHEAD_PAGES siblings at a time.
+#define READ_AHEAD_TRIGGER 2
+#define READ_AHEAD_PAGES   32
+
+// The share of each page that bloader_new() fills by default.
+// Inserts in key order leave pages nearly full too, because a
+// full node first rotates cells into it's left sibling, so the
+// loader fills pages all the way and btree_append() leaves the
+// same tree behind as bcursor_insert() would.
+#define BULK_LOAD_FILL_PERCENT 100
+
 // Node header byte layout:
 //   flags:               2
 //   cell_count:          2
 //   cell_area:           2
 //   cell_area_logical:   2
 //   rightmost_child:     4
+//   prefix_len:          2 (only with F_NODE_PREFIXED)
+//   prefix:              prefix_len
 #define NODE_HEADER_SIZE 12
 
+// The size of the entries of the key array of dense nodes, and
+// of the int keys that go into it. See F_NODE_DENSE.
+#define DENSE_KEY_SIZE 8
+
+// Nodes of trees with normalized keys of variable size store the
+// common prefix of their keys once in the header, and each cell
+// only has the rest of it's key. The prefix of a node is derived
+// from the keys that bound it in the parent (it's fences), so
+// every key that can ever be inserted into the node has it.
+//
+// Nodes of trees with int keys are dense: the keys sit in a
+// sorted array right after the header, followed by the array of
+// cell offsets, so a lookup searches contiguous memory. The cell
+// area only has the child ids or the values. The size of a cell
+// still counts it's key, so the space accounting is the same for
+// both layouts.
 typedef struct {
-    #define F_NODE_IS_LEAF FLAG(0)
-    #define F_NODE_IS_FREE FLAG(1)
+    #define F_NODE_IS_LEAF    FLAG(0)
+    #define F_NODE_IS_FREE    FLAG(1)
+    #define F_NODE_NORMALIZED FLAG(2) // Set on every node of a tree with normalized keys.
+    #define F_NODE_PREFIXED   FLAG(3) // Set on every node of a tree with prefix compression.
+    #define F_NODE_DENSE      FLAG(4) // Set on every node of a tree with dense int keys.
+    #define F_NODE_FORMAT     (F_NODE_NORMALIZED | F_NODE_PREFIXED | F_NODE_DENSE)
 
     u16 flags;
     u16 cell_count;
     u16 cell_area;
     u16 cell_area_logical;
     Page_Id rightmost_child;
+    u16 prefix_len;
 
     Page_Ref *page;
 } Node;
@@ -40,6 +80,7 @@ typedef struct {
 struct BCursor {
     #define F_CURSOR_SKIP_NEXT           FLAG(0)
     #define F_CURSOR_DELETE_NODE_ON_EXIT FLAG(1)
+    #define F_CURSOR_READ_ONLY           FLAG(2) // Pages are not made mutable (and thus not dirtied).
 
     u16 flags;
     BTree *tree;
@@ -47,22 +88,51 @@ struct BCursor {
     u8    path_len;
     u16   path_cells[MAX_BTREE_HEIGHT];
     Node *path_nodes[MAX_BTREE_HEIGHT];
+
+    struct {
+        u32 leaf_steps; // Consecutive moves to the next leaf.
+        Page_Id parent; // The children of this node up to end have been prefetched.
+        u32 end;
+    } read_ahead;
 };
 
 struct BTree {
     BType *type;
     Page_Id root;
     BEngine *engine;
+    bool prefixed; // See F_NODE_PREFIXED.
+    bool dense; // See F_NODE_DENSE.
+    Pager_Priority priority; // Of the leaves. Inner nodes are at least PAGER_PRIORITY_HIGH.
 };
 
 struct BEngine {
     Mem *mem;
-    Mem_Arena *key_saver;
+    Mem_Arena *key_saver; // For copies of keys. Cleared at the end of each modification.
+    Mem_Arena *key_encoder; // For ukeys that get normalized before a lookup.
     Files *fs;
     Pager *pager;
     u16 page_size; // Doesn't include header.
     u16 full_page_size; // Includes header.
     u8 *scratch_page;
+    BLoader *appender; // See btree_append().
+};
+
+// Builds a tree bottom up. Each level has one open node that
+// cells are appended to. Once it's full it gets closed: a key
+// goes up into the level above as the separator and the node is
+// never touched again.
+struct BLoader {
+    BTree *tree;
+    u16 format; // The F_NODE_FORMAT flags of the tree.
+    u16 budget; // Bytes of a page to fill.
+    u8  height;
+
+    struct {
+        Node *node;
+        u8 *low; // Full key. The separator of the previous node on this level.
+        bool has_low;
+        bool no_prefix; // See bloader_finish().
+    } levels[MAX_BTREE_HEIGHT];
 };
 
 static u16 cursor_idx (BCursor *);
@@ -73,9 +143,14 @@ static Node *cursor_node (BCursor *);
 static void cursor_remove (BCursor *);
 static u8 *node_get_cell (Node *, u16);
 static bool cursor_goto_next_node (BCursor *);
-static BType *get_btype_for_table (Type_Table *);
+static void end_appends (BEngine *);
+static BType *get_btype_for_table (Type_Table *, bool normalized);
+static u8 *node_get_cell_idx_ptr (Node *, u16);
 static void node_ensure_cell_space (BCursor *, u16);
 static void node_add_cell_pointer (Node *, u16, u16);
+static void node_remove_cell_pointers (Node *, u16, u16);
+
+#define INT_KEY_SIGN_BIT (1ull << 63)
 
 #define KEY(PTR) ((Key){ PTR })
 #define VAL(PTR) ((Val){ PTR })
@@ -105,7 +180,7 @@ static void node_add_cell_pointer (Node *, u16, u16);
     for (u8 *CELL; (void)CELL, _(ONCE);)\
     for (u16 CELL_IDX; _(ONCE);)\
     for (DEF(Node*, CELL_NODE, node); _(ONCE);)\
-    for (Array_View_u16 CELL_ARRAY = { .count = CELL_NODE->cell_count, .data = (char*)(CELL_NODE->page->buf + NODE_HEADER_SIZE) }; _(ONCE);)\
+    for (Array_View_u16 CELL_ARRAY = { .count = CELL_NODE->cell_count, .data = (char*)node_get_cell_idx_ptr(CELL_NODE, 0) }; _(ONCE);)\
     for (; _(ONCE); _(ONCE)=0)\
     iter\
         if (CELL_IDX = (u16)ARRAY_IDX,\
@@ -128,10 +203,17 @@ static Key cell_get_key (u8 *cell, Node *node) {
 
 static Val cell_get_val (BTree *tree, u8 *cell, Node *node) {
     ASSERT(node_is_leaf(node));
+    if (node->flags & F_NODE_DENSE) return VAL(cell);
     return VAL(cell + tree->type->sizeof_key(KEY(cell)));
 }
 
 static u16 cell_get_size (BTree *tree, u8 *cell, Node *node) {
+    if (node->flags & F_NODE_DENSE) {
+        return node_is_inner(node) ?
+               (u16)(DENSE_KEY_SIZE + 4) :
+               (u16)(DENSE_KEY_SIZE + tree->type->sizeof_val(VAL(cell)));
+    }
+
     Key key      = cell_get_key(cell, node);
     u16 key_size = tree->type->sizeof_key(key);
 
@@ -155,6 +237,7 @@ static void node_serialize_header (Node *node) {
     write_u16_le(buf + 4, node->cell_area);
     write_u16_le(buf + 6, node->cell_area_logical);
     write_u32_le(buf + 8, node->rightmost_child);
+    if (node->flags & F_NODE_PREFIXED) write_u16_le(buf + 12, node->prefix_len);
 }
 
 static void node_deserialize_header (Node *node, Page_Ref *page) {
@@ -165,14 +248,25 @@ static void node_deserialize_header (Node *node, Page_Ref *page) {
     node->cell_area         = read_u16_le(buf + 4);
     node->cell_area_logical = read_u16_le(buf + 6);
     node->rightmost_child   = read_u32_le(buf + 8);
+    node->prefix_len        = (node->flags & F_NODE_PREFIXED) ? read_u16_le(buf + 12) : 0;
+}
+
+static u16 node_get_header_size (Node *node) {
+    return (node->flags & F_NODE_PREFIXED) ? NODE_HEADER_SIZE + 2 + node->prefix_len : NODE_HEADER_SIZE;
 }
 
+static u8 *node_get_prefix (Node *node) {
+    return node->page->buf + NODE_HEADER_SIZE + 2;
+}
+
+// The key format of the node is kept.
 static void node_reset (BEngine *engine, Node *node) {
-    node->flags             = 0;
+    node->flags            &= F_NODE_FORMAT;
     node->cell_count        = 0;
     node->cell_area         = engine->full_page_size;
     node->cell_area_logical = engine->full_page_size;
     node->rightmost_child   = 0;
+    node->prefix_len        = 0;
 }
 
 static Node *node_from_page (BEngine *engine, Page_Ref *page) {
@@ -182,10 +276,22 @@ static Node *node_from_page (BEngine *engine, Page_Ref *page) {
     return node;
 }
 
-static Node *node_from_page_id (BEngine *engine, Page_Id page_id) {
-    Page_Ref *page = pager_get_page_mutable(engine->pager, page_id);
+// Every lookup descends through the inner nodes, so they are
+// kept in the cache ahead of the leaves. The priority is set
+// on each get because the pager forgets it on eviction.
+static Node *node_from_page_id (BCursor *cursor, Page_Id page_id) {
+    BEngine *engine = cursor->tree->engine;
+    Page_Ref *page  = (cursor->flags & F_CURSOR_READ_ONLY) ?
+                      pager_get_page(engine->pager, page_id) :
+                      pager_get_page_mutable(engine->pager, page_id);
     ASSERT(page);
-    return node_from_page(engine, page);
+
+    Node *node = node_from_page(engine, page);
+    Pager_Priority priority = cursor->tree->priority;
+    if (node_is_inner(node) && (priority < PAGER_PRIORITY_HIGH)) priority = PAGER_PRIORITY_HIGH;
+    pager_set_priority(engine->pager, page, priority);
+
+    return node;
 }
 
 static Node *node_new (BEngine *engine, u16 flags) {
@@ -210,16 +316,16 @@ static void node_delete (BEngine *engine, Node *node) {
     ASSERT(success);
 }
 
-static Node *node_get_child (BEngine *engine, Node *node, u16 idx) {
+static Node *node_get_child (BCursor *cursor, Node *node, u16 idx) {
     ASSERT(idx <= node->cell_count);
     ASSERT(node_is_inner(node));
 
     if (idx < node->cell_count) {
         Page_Id page = cell_get_child(node_get_cell(node, idx));
-        return node_from_page_id(engine, page);
+        return node_from_page_id(cursor, page);
     }
 
-    return node_from_page_id(engine, node->rightmost_child);
+    return node_from_page_id(cursor, node->rightmost_child);
 }
 
 static void node_copy (BEngine *engine, Node *to, Node *from) {
@@ -229,8 +335,16 @@ static void node_copy (BEngine *engine, Node *to, Node *from) {
     memcpy(to->page->buf, from->page->buf, engine->full_page_size);
 }
 
+// The bytes of each cell that are kept next to it's offset
+// instead of in the cell area.
+static u16 node_get_slot_key_size (Node *node) {
+    return (node->flags & F_NODE_DENSE) ? DENSE_KEY_SIZE : 0;
+}
+
+// In dense nodes the array of cell offsets comes after the keys,
+// so it moves whenever the cell count changes.
 static u8 *node_get_cell_idx_ptr (Node *node, u16 idx) {
-    return &node->page->buf[NODE_HEADER_SIZE + 2*idx];
+    return &node->page->buf[node_get_header_size(node) + node_get_slot_key_size(node)*node->cell_count + 2*idx];
 }
 
 static u8 *node_get_cell (Node *node, u16 idx) {
@@ -239,12 +353,32 @@ static u8 *node_get_cell (Node *node, u16 idx) {
     return node->page->buf + read_u16_le(idx_ptr);
 }
 
+static u8 *node_get_dense_keys (Node *node) {
+    ASSERT(node->flags & F_NODE_DENSE);
+    return node->page->buf + NODE_HEADER_SIZE;
+}
+
+// The key of the cell at the given index as it's stored in the
+// node, so without the prefix.
+static Key node_get_key (Node *node, u16 idx) {
+    if (node->flags & F_NODE_DENSE) {
+        ASSERT(idx < node->cell_count);
+        return KEY(node_get_dense_keys(node) + DENSE_KEY_SIZE*idx);
+    }
+
+    return cell_get_key(node_get_cell(node, idx), node);
+}
+
+static u16 node_get_slots_size (Node *node) {
+    return (2 + node_get_slot_key_size(node)) * node->cell_count;
+}
+
 static u16 node_get_free_space (Node *node) {
-    return node->cell_area - NODE_HEADER_SIZE - 2*node->cell_count;
+    return node->cell_area - node_get_header_size(node) - node_get_slots_size(node);
 }
 
 static u16 node_get_logical_free_space (Node *node) {
-    return node->cell_area_logical - NODE_HEADER_SIZE - 2*node->cell_count;
+    return node->cell_area_logical - node_get_header_size(node) - node_get_slots_size(node);
 }
 
 static bool node_can_fit_cell (Node *node, u16 cell_size) {
@@ -257,23 +391,182 @@ static bool node_can_fit_cell (Node *node, u16 cell_size) {
     // TODO: We should add many more integrity checks here.
     static void CHECK (BTree *tree, Node *node) {
         u16 offset = tree->engine->full_page_size;
-        cell_iter (node) offset -= cell_get_size(tree, CELL, node);
+        cell_iter (node) offset -= cell_get_size(tree, CELL, node) - node_get_slot_key_size(node);
         ASSERT(offset == node->cell_area_logical);
+        ASSERT(!(node->flags & F_NODE_NORMALIZED) == !tree->type->normalized);
+        ASSERT(!(node->flags & F_NODE_PREFIXED) == !tree->prefixed);
+        ASSERT(!(node->flags & F_NODE_DENSE) == !tree->dense);
     }
 #endif
 
+// The functions below deal with full keys: keys with the
+// prefix of the node they come from put back in front. Only
+// trees with prefix compression have keys that need this, and
+// those keys are a u32 byte count followed by the bytes.
+static u8 *key_get_bytes (Key key, u32 *out_len) {
+    *out_len = read_u32_le(key.ptr);
+    return (u8*)key.ptr + 4;
+}
+
+static u32 get_common_prefix_len (Key a, Key b) {
+    u32 a_len; u8 *a_bytes = key_get_bytes(a, &a_len);
+    u32 b_len; u8 *b_bytes = key_get_bytes(b, &b_len);
+    u32 max = MIN(a_len, b_len);
+    u32 result = 0;
+    while (result < max && a_bytes[result] == b_bytes[result]) result++;
+    return result;
+}
+
+// Returns a copy of the full key of the cell at the given index
+// in the key_saver.
+static Key node_load_key (BTree *tree, Node *node, u16 idx) {
+    BEngine *engine = tree->engine;
+    Key key         = node_get_key(node, idx);
+    u32 key_size    = tree->type->sizeof_key(key);
+    u8 *result      = MEM_ALLOC((Mem*)engine->key_saver, key_size + node->prefix_len);
+
+    if (node->prefix_len) {
+        write_u32_le(result, key_size - 4 + node->prefix_len);
+        memcpy(result + 4, node_get_prefix(node), node->prefix_len);
+        memcpy(result + 4 + node->prefix_len, (u8*)key.ptr + 4, key_size - 4);
+    } else {
+        memcpy(result, key.ptr, key_size);
+    }
+
+    return KEY(result);
+}
+
+// The size of a full key once it's stored in the node.
+static u16 node_sizeof_key (BTree *tree, Node *node, Key key) {
+    return (u16)(tree->type->sizeof_key(key) - node->prefix_len);
+}
+
+// Stores a full key, which must start with the prefix of the
+// node, at the given position: in one of it's cells, or in the
+// key array if the node is dense. See node_get_key().
+static void node_write_key (BTree *tree, Node *node, u8 *to, Key key) {
+    if (node->prefix_len) {
+        u32 len; u8 *bytes = key_get_bytes(key, &len);
+        ASSERT(len >= node->prefix_len && !memcmp(bytes, node_get_prefix(node), node->prefix_len));
+        write_u32_le(to, len - node->prefix_len);
+        memcpy(to + 4, bytes + node->prefix_len, len - node->prefix_len);
+    } else {
+        memcpy(to, key.ptr, tree->type->sizeof_key(key));
+    }
+}
+
+// Copies a cell of the node "from" to "to" and rebases it's key
+// from the prefix of "from" onto the first to_len bytes of it.
+// Returns the new size of the cell.
+static u16 cell_copy (BTree *tree, Node *from, u8 *cell, u8 *to, u16 to_len) {
+    u16 size     = cell_get_size(tree, cell, from);
+    u16 from_len = from->prefix_len;
+
+    if (from_len == to_len) {
+        memcpy(to, cell, size);
+        return size;
+    }
+
+    u32 offset   = node_is_inner(from) ? 4 : 0; // Inner cells start with the child id.
+    u8 *key      = cell + offset;
+    u32 key_len  = read_u32_le(key);
+    u32 rest     = size - offset - 4 - key_len; // The value of leaf cells.
+    u16 new_size = (u16)(size + from_len - to_len);
+
+    memcpy(to, cell, offset);
+    write_u32_le(to + offset, key_len + from_len - to_len);
+
+    if (to_len < from_len) {
+        memcpy(to + offset + 4, node_get_prefix(from) + to_len, from_len - to_len);
+        memcpy(to + offset + 4 + from_len - to_len, key + 4, key_len + rest);
+    } else {
+        memcpy(to + offset + 4, key + 4 + (to_len - from_len), key_len - (to_len - from_len) + rest);
+    }
+
+    return new_size;
+}
+
+// Rewrites every cell of the node for a new prefix. The caller
+// makes sure that all keys of the node start with the prefix
+// and that the node has room for the cells that grow.
+static void node_set_prefix (BTree *tree, Node *node, u8 *prefix, u16 len) {
+    BEngine *engine = tree->engine;
+    u8 *scratch     = engine->scratch_page;
+    u16 header_size = NODE_HEADER_SIZE + 2 + len;
+    u16 offset      = engine->full_page_size;
+
+    ASSERT(node->flags & F_NODE_PREFIXED);
+    if (len == node->prefix_len) return;
+
+    cell_iter (node) {
+        offset -= cell_get_size(tree, CELL, node) + node->prefix_len - len;
+        cell_copy(tree, node, CELL, scratch + offset, len);
+        write_u16_le(scratch + header_size + 2*CELL_IDX, offset);
+    }
+
+    ASSERT(header_size + 2*node->cell_count <= offset);
+    memcpy(scratch + NODE_HEADER_SIZE + 2, prefix, len);
+
+    u8 *buf = node->page->buf;
+    memcpy(buf + NODE_HEADER_SIZE + 2, scratch + NODE_HEADER_SIZE + 2, len + 2*node->cell_count);
+    memcpy(buf + offset, scratch + offset, engine->full_page_size - offset);
+
+    node->prefix_len        = len;
+    node->cell_area         = offset;
+    node->cell_area_logical = offset;
+
+    CHECK(tree, node);
+}
+
+// The shortest key that is greater than or equal to the left key
+// and less than the right one. The result is in the key_saver.
+static Key get_separator (BTree *tree, Key left, Key right) {
+    u32 right_len; u8 *right_bytes = key_get_bytes(right, &right_len);
+    u32 len = get_common_prefix_len(left, right) + 1;
+
+    if (len >= right_len) return left;
+
+    u8 *result = MEM_ALLOC((Mem*)tree->engine->key_saver, 4 + len);
+    write_u32_le(result, len);
+    memcpy(result + 4, right_bytes, len);
+    return KEY(result);
+}
+
+// Returns a copy of the prefix of the node as a full key.
+static Key node_load_prefix (BTree *tree, Node *node) {
+    u8 *result = MEM_ALLOC((Mem*)tree->engine->key_saver, 4 + node->prefix_len);
+    write_u32_le(result, node->prefix_len);
+    memcpy(result + 4, node_get_prefix(node), node->prefix_len);
+    return KEY(result);
+}
+
+// The length of the prefix that every key routed into the child
+// at the given index of the parent has. That's the common prefix
+// of the keys on either side of the child. The leftmost and the
+// rightmost child are bounded on one side by the fence of the
+// parent, which we don't know, so there we use it's prefix.
+static u16 get_child_prefix_len (BTree *tree, Node *parent, u16 idx) {
+    Key prefix = node_load_prefix(tree, parent);
+    Key low    = idx ? node_load_key(tree, parent, idx - 1) : prefix;
+    Key high   = (idx < parent->cell_count) ? node_load_key(tree, parent, idx) : prefix;
+    return (u16)get_common_prefix_len(low, high);
+}
+
 // TODO: If someone holds a pointer to a cell inside the node,
 // then we cannot defragment it since it would invalidate the
 // pointer. So we have to either implement some ref counting
 // or "be careful"...
 static void node_defragment (BTree *tree, Node *node) {
-    if (node->cell_count == 0) return;
+    if (node->cell_count == 0) {
+        node->cell_area = node->cell_area_logical;
+        return;
+    }
 
     BEngine *engine = tree->engine;
     u16 offset = engine->full_page_size;
 
     cell_iter (node) {
-        u16 cell_size = cell_get_size(tree, CELL, node);
+        u16 cell_size = cell_get_size(tree, CELL, node) - node_get_slot_key_size(node);
         offset -= cell_size;
         memcpy(engine->scratch_page + offset, CELL, cell_size);
         write_u16_le((u8*)CELL_IDX_PTR, offset);
@@ -291,12 +584,17 @@ static void node_shrink_cell (Node *node, u8 *cell, u16 by) {
     node->cell_area_logical += by;
 }
 
+// The size is that of the whole cell. In dense nodes the cell
+// area only gives the part after the key, and the key goes into
+// the key array along with the cell pointer.
+//
 // TODO: Add a cell free list.
 static u8 *node_alloc_cell (BTree *tree, Node *node, u16 size) {
     ASSERT(node_can_fit_cell(node, size));
 
     if ((size + 2) > node_get_free_space(node)) node_defragment(tree, node);
 
+    size -= node_get_slot_key_size(node);
     node->cell_area -= size;
     node->cell_area_logical -= size;
     u8 *result = node->page->buf + node->cell_area;
@@ -311,6 +609,7 @@ static u8 *node_add_cell (BTree *tree, Node *node, u16 idx, u16 size) {
 }
 
 static void node_free_cell (Node *node, u8 *cell, u16 size) {
+    size -= node_get_slot_key_size(node);
     node->cell_area_logical += size;
     if (cell == (node->page->buf + node->cell_area)) node->cell_area += size;
 }
@@ -318,41 +617,78 @@ static void node_free_cell (Node *node, u8 *cell, u16 size) {
 static void node_delete_cell (BTree *tree, Node *node, u16 idx) {
     u8 *cell = node_get_cell(node, idx);
     node_free_cell(node, cell, cell_get_size(tree, cell, node));
+    node_remove_cell_pointers(node, idx, 1);
 
+    CHECK(tree, node);
+}
+
+// Drops the offsets (and keys) of n cells starting at idx. The
+// cells themselves must have been freed already.
+static void node_remove_cell_pointers (Node *node, u16 idx, u16 n) {
+    ASSERT(idx + n <= node->cell_count);
+
+    u16 count   = node->cell_count;
     u8 *idx_ptr = node_get_cell_idx_ptr(node, idx);
-    memmove(idx_ptr, idx_ptr+2, 2*(node->cell_count - idx - 1));
-    node->cell_count--;
 
-    CHECK(tree, node);
+    if (node->flags & F_NODE_DENSE) {
+        u8 *keys     = node_get_dense_keys(node);
+        u8 *old_ptrs = node_get_cell_idx_ptr(node, 0);
+        u8 *new_ptrs = old_ptrs - DENSE_KEY_SIZE*n;
+
+        memmove(keys + DENSE_KEY_SIZE*idx, keys + DENSE_KEY_SIZE*(idx + n), DENSE_KEY_SIZE*(count - idx - n));
+        memmove(new_ptrs, old_ptrs, 2*idx);
+        memmove(new_ptrs + 2*idx, idx_ptr + 2*n, 2*(count - idx - n));
+    } else {
+        memmove(idx_ptr, idx_ptr + 2*n, 2*(count - idx - n));
+    }
+
+    node->cell_count -= n;
 }
 
+// The key of a dense node is left unset for the caller to write.
+// The node must have room for the new slot: node_alloc_cell()
+// makes sure of that.
 static void node_add_cell_pointer (Node *node, u16 idx, u16 offset) {
+    u16 count   = node->cell_count;
     u8 *idx_ptr = node_get_cell_idx_ptr(node, idx);
-    memmove(idx_ptr+2, idx_ptr, 2*(node->cell_count - idx));
+
+    if (node->flags & F_NODE_DENSE) {
+        u8 *keys     = node_get_dense_keys(node);
+        u8 *old_ptrs = node_get_cell_idx_ptr(node, 0);
+        u8 *new_ptrs = old_ptrs + DENSE_KEY_SIZE;
+
+        memmove(new_ptrs + 2*(idx + 1), idx_ptr, 2*(count - idx));
+        memmove(new_ptrs, old_ptrs, 2*idx);
+        memmove(keys + DENSE_KEY_SIZE*(idx + 1), keys + DENSE_KEY_SIZE*idx, DENSE_KEY_SIZE*(count - idx));
+        idx_ptr = new_ptrs + 2*idx;
+    } else {
+        memmove(idx_ptr+2, idx_ptr, 2*(count - idx));
+    }
+
     write_u16_le(idx_ptr, offset);
     node->cell_count++;
 }
 
+// The key is a full key.
 static void node_add_inner_cell (BTree *tree, Node *node, u16 idx, Key key, Page_Id child) {
     ASSERT(node_is_inner(node));
 
-    u16 key_size = tree->type->sizeof_key(key);
-    u8 *new_cell = node_alloc_cell(tree, node, 4 + key_size);
+    u16 key_size = node_sizeof_key(tree, node, key);
+    u8 *new_cell = node_add_cell(tree, node, idx, 4 + key_size);
 
     write_u32_le(new_cell, child);
-    memcpy(new_cell + 4, key.ptr, key_size);
-
-    node_add_cell_pointer(node, idx, (u16)(new_cell - node->page->buf));
+    node_write_key(tree, node, node_get_key(node, idx).ptr, key);
 
     CHECK(tree, node);
 }
 
+// The key is a full key.
 static void copy_key_into_inner_cell (BCursor *cursor, Key key) {
     BTree *tree       = cursor->tree;
     Node *node        = cursor_node(cursor);
     u8 *cell          = node_get_cell(node, cursor_idx(cursor));
     u16 cell_size     = cell_get_size(tree, cell, node);
-    u16 key_size      = tree->type->sizeof_key(key);
+    u16 key_size      = node_sizeof_key(tree, node, key);
     u16 new_cell_size = 4 + key_size;
 
     ASSERT(node_is_inner(node));
@@ -363,37 +699,84 @@ static void copy_key_into_inner_cell (BCursor *cursor, Key key) {
         node_ensure_cell_space(cursor, new_cell_size);
         node_add_inner_cell(tree, cursor_node(cursor), cursor_idx(cursor), key, child);
     } else {
-        Key to = cell_get_key(cell, node);
-        memcpy(to.ptr, key.ptr, key_size);
+        node_write_key(tree, node, node_get_key(node, cursor_idx(cursor)).ptr, key);
         if (cell_size > new_cell_size) node->cell_area_logical += (cell_size - new_cell_size);
         CHECK(cursor->tree, node);
     }
 }
 
+// Moves n cells starting at from_idx into "to" at to_idx. Both
+// nodes are dense, so there is no prefix to rebase onto, but the
+// offset array of "to" moves with every cell that is added, so
+// unlike the functions below we can't hold on to a pointer into it.
+// The slots are made in one go and the cell area is defragmented
+// up front if needed, so that none of the allocations do it while
+// the slots are not filled in yet.
+static void node_move_dense_cells (BTree *tree, Node *from, u16 from_idx, Node *to, u16 to_idx, u16 n) {
+    ASSERT(from_idx + n <= from->cell_count);
+    ASSERT(to_idx <= to->cell_count);
+
+    u16 bytes = 0;
+    for (u16 i = 0; i < n; ++i) bytes += cell_get_size(tree, node_get_cell(from, from_idx + i), from) + 2;
+
+    ASSERT(bytes <= node_get_logical_free_space(to));
+    if (bytes > node_get_free_space(to)) node_defragment(tree, to);
+
+    for (u16 i = 0; i < n; ++i) node_add_cell_pointer(to, to_idx + i, 0);
+
+    for (u16 i = 0; i < n; ++i) {
+        u8 *cell  = node_get_cell(from, from_idx + i);
+        u16 size  = cell_get_size(tree, cell, from) - DENSE_KEY_SIZE;
+        to->cell_area -= size;
+        to->cell_area_logical -= size;
+
+        memcpy(to->page->buf + to->cell_area, cell, size);
+        write_u16_le(node_get_cell_idx_ptr(to, to_idx + i), to->cell_area);
+        memcpy(node_get_key(to, to_idx + i).ptr, node_get_key(from, from_idx + i).ptr, DENSE_KEY_SIZE);
+
+        node_free_cell(from, cell, size + DENSE_KEY_SIZE);
+    }
+
+    node_remove_cell_pointers(from, from_idx, n);
+
+    CHECK(tree, from);
+    CHECK(tree, to);
+}
+
+// The moved keys get rebased onto the prefix of the node they
+// move into, so they must start with it.
 static void node_move_cells_left (BTree *tree, Node *left, Node *right, u16 n) {
     ASSERT(n <= right->cell_count);
 
     if (n == 0) return;
 
+    if (left->flags & F_NODE_DENSE) {
+        node_move_dense_cells(tree, right, 0, left, left->cell_count, n);
+        return;
+    }
+
     u8 *left_idx_array = node_get_cell_idx_ptr(left, left->cell_count);
 
     cell_iter (right) {
         if (CELL_IDX == n) break;
 
         u16 cell_size = cell_get_size(tree, CELL, right);
-        u8 *left_cell = node_alloc_cell(tree, left, cell_size);
+        u8 *left_cell = node_alloc_cell(tree, left, cell_size + right->prefix_len - left->prefix_len);
 
-        memcpy(left_cell, CELL, cell_size);
+        cell_copy(tree, right, CELL, left_cell, left->prefix_len);
         write_u16_le(left_idx_array, (u16)(left_cell - left->page->buf));
         left_idx_array += 2;
 
+        // The count goes up right away, because the next call to
+        // node_alloc_cell() might defragment the node.
+        left->cell_count++;
+
         node_free_cell(right, CELL, cell_size);
     }
 
     u8 *right_idx_array = node_get_cell_idx_ptr(right, 0);
     memmove(right_idx_array, &right_idx_array[2*n], 2*(right->cell_count - n));
 
-    left->cell_count  += n;
     right->cell_count -= n;
 
     CHECK(tree, left);
@@ -405,14 +788,19 @@ static void node_move_cells_right (BTree *tree, Node *left, Node *right, u16 n)
 
     if (n == 0) return;
 
+    if (left->flags & F_NODE_DENSE) {
+        node_move_dense_cells(tree, left, left->cell_count - n, right, 0, n);
+        return;
+    }
+
     u16 old_right_cell_count = right->cell_count;
     u8 *right_idx = node_get_cell_idx_ptr(right, right->cell_count);
 
     cell_iter_from (left, (left->cell_count - n)) {
         u16 cell_size  = cell_get_size(tree, CELL, left);
-        u8 *right_cell = node_alloc_cell(tree, right, cell_size);
+        u8 *right_cell = node_alloc_cell(tree, right, cell_size + left->prefix_len - right->prefix_len);
 
-        memcpy(right_cell, CELL, cell_size);
+        cell_copy(tree, left, CELL, right_cell, right->prefix_len);
         write_u16_le(right_idx, (u16)(right_cell - right->page->buf));
         right->cell_count++;
         right_idx += 2;
@@ -449,37 +837,65 @@ static void node_move_cells_right (BTree *tree, Node *left, Node *right, u16 n)
     CHECK(tree, right);
 }
 
+// The key that separates the two nodes once n cells have been
+// rotated from one into the other. With leaves it's the last key
+// that stays on the left. With inner nodes it's the key of the
+// cell that goes up into the parent. The result is a full key in
+// the key_saver.
+//
+// Unlike split_node() we don't shorten the separator here since
+// the cursor might be about to insert a key right at the boundary
+// and a shorter separator could send that key to the other node.
+static Key get_rotation_separator (BTree *tree, Node *left, Node *right, u16 n, bool to_left) {
+    Node *from = to_left ? right : left;
+    u16 idx    = to_left ? n - 1 : left->cell_count - n - node_is_leaf(from);
+    return node_load_key(tree, from, idx);
+}
+
+// A rotation moves one of the fences of the receiving node, so
+// the node can only keep the part of it's prefix that is shared
+// with the new separator.
+static u16 get_rotation_prefix_len (Node *to, Key separator) {
+    if (! to->prefix_len) return 0;
+
+    u32 len; u8 *bytes = key_get_bytes(separator, &len);
+    u8 *prefix = node_get_prefix(to);
+    u16 max    = (u16)MIN(to->prefix_len, len);
+    u16 result = 0;
+
+    while (result < max && prefix[result] == bytes[result]) result++;
+    return result;
+}
+
 // This function assumes that the left node has enough room.
 // The cursor must be pointing at the parent of the two nodes.
 //
 // TODO: We should add an optimization to the various cell rotate functions
 // whereby they check whether the cells are all of a fixed size and perform
 // closed-form calculations instead of loops.
-static void node_rotate_cells_left (BCursor *cursor, Node *left, Node *right, u16 n) {
+static void node_rotate_cells_left (BCursor *cursor, Node *left, Node *right, u16 n, Key separator, u16 prefix_len) {
     ASSERT(n);
     ASSERT(n < right->cell_count);
 
     BTree *tree = cursor->tree;
 
+    if (tree->prefixed) node_set_prefix(tree, left, node_get_prefix(left), prefix_len);
+
     if (node_is_inner(left)) {
         Node *parent    = cursor_node(cursor);
-        u8 *parent_cell = node_get_cell(parent, cursor_idx(cursor));
-        Key parent_key = cell_get_key(parent_cell, parent);
+        Key parent_key  = node_load_key(tree, parent, cursor_idx(cursor));
 
         node_add_inner_cell(tree, left, left->cell_count, parent_key, left->rightmost_child);
         node_move_cells_left(tree, left, right, n - 1);
 
         u8 *child_cell = node_get_cell(right, 0);
-        Key child_key = cell_get_key(child_cell, right);
 
-        copy_key_into_inner_cell(cursor, child_key);
+        copy_key_into_inner_cell(cursor, separator);
         left->rightmost_child = cell_get_child(child_cell);
         node_delete_cell(tree, right, 0);
     } else {
         node_move_cells_left(tree, left, right, n);
-        u8 *child_cell = node_get_cell(left, left->cell_count - 1);
-        Key child_key = cell_get_key(child_cell, left);
-        copy_key_into_inner_cell(cursor, child_key);
+        copy_key_into_inner_cell(cursor, separator);
     }
 
     CHECK(tree, left);
@@ -488,61 +904,87 @@ static void node_rotate_cells_left (BCursor *cursor, Node *left, Node *right, u1
 
 // This function assumes that the right node has enough room.
 // The cursor must be pointing at the parent of the two nodes.
-static void node_rotate_cells_right (BCursor *cursor, Node *left, Node *right, u16 n) {
+static void node_rotate_cells_right (BCursor *cursor, Node *left, Node *right, u16 n, Key separator, u16 prefix_len) {
     ASSERT(n);
     ASSERT(n < left->cell_count);
 
     BTree *tree = cursor->tree;
 
+    if (tree->prefixed) node_set_prefix(tree, right, node_get_prefix(right), prefix_len);
+
     if (node_is_inner(left)) {
         Node *parent    = cursor_node(cursor);
-        u8 *parent_cell = node_get_cell(parent, cursor_idx(cursor));
-        Key parent_key = cell_get_key(parent_cell, parent);
+        Key parent_key  = node_load_key(tree, parent, cursor_idx(cursor));
 
         node_add_inner_cell(tree, right, 0, parent_key, left->rightmost_child);
         node_move_cells_right(tree, left, right, n - 1);
 
         u8 *child_cell = node_get_cell(left, left->cell_count - 1);
-        Key child_key = cell_get_key(child_cell, left);
 
-        copy_key_into_inner_cell(cursor, child_key);
+        copy_key_into_inner_cell(cursor, separator);
         left->rightmost_child = cell_get_child(child_cell);
         node_delete_cell(tree, left, left->cell_count - 1);
     } else {
         node_move_cells_right(tree, left, right, n);
-        u8 *child_cell = node_get_cell(left, (left->cell_count ? left->cell_count - 1 : 0));
-        Key child_key = cell_get_key(child_cell, left);
-        copy_key_into_inner_cell(cursor, child_key);
+        copy_key_into_inner_cell(cursor, separator);
     }
 
     CHECK(tree, left);
     CHECK(tree, right);
 }
 
+// The number of bytes that the receiving node needs for a
+// rotation. When inner nodes are rotated, the last cell that
+// leaves one node goes up into the parent and the key of the
+// parent comes down into the other one instead. On top of that
+// the keys get rebased onto the new prefix of the receiver, and
+// if that prefix is shorter, then the cells that were already
+// in the receiver grow. The cursor must be pointing at the parent.
+static s32 get_bytes_received_by_rotation (BCursor *cursor, Node *from, Node *to, u8 *last_cell, u16 cells_to_rotate, u16 bytes_to_rotate, u16 prefix_len) {
+    s32 growth = to->prefix_len - prefix_len;
+    s32 result = bytes_to_rotate + cells_to_rotate * (from->prefix_len - prefix_len) + (to->cell_count - 1) * growth;
+
+    if (node_is_inner(from)) {
+        Node *parent    = cursor_node(cursor);
+        u8 *parent_cell = node_get_cell(parent, cursor_idx(cursor));
+
+        result -= cell_get_size(cursor->tree, last_cell, from) + from->prefix_len - prefix_len;
+        result += cell_get_size(cursor->tree, parent_cell, parent) + parent->prefix_len - prefix_len;
+    }
+
+    return result;
+}
+
 // The cursor must be pointing at the parent of the two nodes.
 static bool node_try_rotate_bytes_left (BCursor *cursor, Node *left, Node *right, u16 min_bytes_to_rotate, u16 min_bytes_to_remain, u16 min_cells_to_remain) {
     ASSERT(min_bytes_to_rotate);
 
+    BTree *tree          = cursor->tree;
     u16 left_free_space  = node_get_logical_free_space(left);
     u16 right_free_space = node_get_logical_free_space(right);
 
     u16 cells_to_rotate = 0;
     u16 bytes_to_rotate = 0;
+    u8 *last_cell       = NULL;
 
     cell_iter (right) {
         cells_to_rotate++;
-        bytes_to_rotate += 2 + cell_get_size(cursor->tree, CELL, right);
+        bytes_to_rotate += 2 + cell_get_size(tree, CELL, right);
+        last_cell = CELL;
         if (bytes_to_rotate >= min_bytes_to_rotate) break;
     }
 
-    if (bytes_to_rotate > left_free_space) return false;
     if (bytes_to_rotate < min_bytes_to_rotate) return false;
     if ((right->cell_count - cells_to_rotate) < min_cells_to_remain) return false;
 
-    u16 bytes_to_remain = cursor->tree->engine->page_size - right_free_space - bytes_to_rotate;
+    u16 bytes_to_remain = tree->engine->page_size - right_free_space - bytes_to_rotate;
     if (bytes_to_remain < min_bytes_to_remain) return false;
 
-    node_rotate_cells_left(cursor, left, right, cells_to_rotate);
+    Key separator  = get_rotation_separator(tree, left, right, cells_to_rotate, true);
+    u16 prefix_len = get_rotation_prefix_len(left, separator);
+    if (get_bytes_received_by_rotation(cursor, right, left, last_cell, cells_to_rotate, bytes_to_rotate, prefix_len) > left_free_space) return false;
+
+    node_rotate_cells_left(cursor, left, right, cells_to_rotate, separator, prefix_len);
     return true;
 }
 
@@ -550,26 +992,32 @@ static bool node_try_rotate_bytes_left (BCursor *cursor, Node *left, Node *right
 static bool node_try_rotate_bytes_right (BCursor *cursor, Node *left, Node *right, u16 min_bytes_to_rotate, u16 min_bytes_to_remain, u16 min_cells_to_remain) {
     ASSERT(min_bytes_to_rotate);
 
+    BTree *tree          = cursor->tree;
     u16 left_free_space  = node_get_logical_free_space(left);
     u16 right_free_space = node_get_logical_free_space(right);
 
     u16 cells_to_rotate = 0;
     u16 bytes_to_rotate = 0;
+    u8 *last_cell       = NULL;
 
     cell_iter_reverse (left) {
         cells_to_rotate++;
-        bytes_to_rotate += 2 + cell_get_size(cursor->tree, CELL, left);
+        bytes_to_rotate += 2 + cell_get_size(tree, CELL, left);
+        last_cell = CELL;
         if (bytes_to_rotate >= min_bytes_to_rotate) break;
     }
 
-    if (bytes_to_rotate > right_free_space) return false;
     if (bytes_to_rotate < min_bytes_to_rotate) return false;
     if ((left->cell_count - cells_to_rotate) < min_cells_to_remain) return false;
 
-    u16 bytes_to_remain = cursor->tree->engine->page_size - left_free_space - bytes_to_rotate;
+    u16 bytes_to_remain = tree->engine->page_size - left_free_space - bytes_to_rotate;
     if (bytes_to_remain < min_bytes_to_remain) return false;
 
-    node_rotate_cells_right(cursor, left, right, cells_to_rotate);
+    Key separator  = get_rotation_separator(tree, left, right, cells_to_rotate, false);
+    u16 prefix_len = get_rotation_prefix_len(right, separator);
+    if (get_bytes_received_by_rotation(cursor, left, right, last_cell, cells_to_rotate, bytes_to_rotate, prefix_len) > right_free_space) return false;
+
+    node_rotate_cells_right(cursor, left, right, cells_to_rotate, separator, prefix_len);
     return true;
 }
 
@@ -595,14 +1043,14 @@ static Node *cursor_try_get_left_sibling (BCursor *cursor) {
     if (cursor->path_len < 2) return NULL;
     Node *parent = cursor->path_nodes[cursor->path_len - 2];
     u16 cell_idx = cursor->path_cells[cursor->path_len - 2];
-    return (cell_idx == 0) ? NULL : node_get_child(cursor->tree->engine, parent, cell_idx - 1);
+    return (cell_idx == 0) ? NULL : node_get_child(cursor, parent, cell_idx - 1);
 }
 
 static Node *cursor_try_get_right_sibling (BCursor *cursor) {
     if (cursor->path_len < 2) return NULL;
     Node *parent = cursor->path_nodes[cursor->path_len - 2];
     u16 cell_idx = cursor->path_cells[cursor->path_len - 2];
-    return (cell_idx == parent->cell_count) ? NULL : node_get_child(cursor->tree->engine, parent, cell_idx + 1);
+    return (cell_idx == parent->cell_count) ? NULL : node_get_child(cursor, parent, cell_idx + 1);
 }
 
 static Node *cursor_pop_get (BCursor *cursor, u16 *out_idx) {
@@ -624,7 +1072,9 @@ static void cursor_pop_unref (BCursor *cursor) {
 }
 
 void bcursor_reset (BCursor *cursor) {
-    cursor->flags = 0;
+    cursor->flags &= F_CURSOR_READ_ONLY;
+    cursor->read_ahead.leaf_steps = 0;
+    cursor->read_ahead.parent = 0;
     while (cursor->path_len) cursor_pop_unref(cursor);
 }
 
@@ -640,12 +1090,12 @@ static bool cursor_goto_next_node (BCursor *cursor) {
     Node *node = cursor_node(cursor);
 
     if (! node) {
-        Node *root = node_from_page_id(engine, cursor->tree->root);
+        Node *root = node_from_page_id(cursor, cursor->tree->root);
         cursor_push(cursor, root, 0);
         return true;
     } else if (node_is_inner(node)) {
         ASSERT(cursor_idx(cursor) < node->cell_count);
-        Node *child = node_get_child(engine, node, cursor_idx(cursor));
+        Node *child = node_get_child(cursor, node, cursor_idx(cursor));
         cursor_push(cursor, child, 0);
         return true;
     } else {
@@ -664,7 +1114,7 @@ static bool cursor_goto_next_node (BCursor *cursor) {
 
             if (cell_idx <= node->cell_count) {
                 cursor->path_cells[cursor->path_len - 1] = cell_idx;
-                Node *child = node_get_child(engine, node, cell_idx);
+                Node *child = node_get_child(cursor, node, cell_idx);
                 cursor_push(cursor, child, 0);
                 return true;
             }
@@ -678,7 +1128,7 @@ static void cursor_goto_leftmost_leaf (BCursor *cursor) {
     while (1) {
         Node *node = cursor_node(cursor);
         if (node_is_leaf(node)) break;
-        Node *child = node_get_child(cursor->tree->engine, node, cursor_idx(cursor));
+        Node *child = node_get_child(cursor, node, cursor_idx(cursor));
         cursor_push(cursor, child, 0);
     }
 }
@@ -687,12 +1137,41 @@ static void cursor_goto_rightmost_leaf (BCursor *cursor) {
     while (1) {
         Node *node = cursor_node(cursor);
         if (node_is_leaf(node)) break;
-        Node *child = node_get_child(cursor->tree->engine, node, cursor_idx(cursor));
+        Node *child = node_get_child(cursor, node, cursor_idx(cursor));
         u16 idx = child->cell_count - node_is_leaf(child);
         cursor_push(cursor, child, idx);
     }
 }
 
+// The node on top of the cursor is the parent of the leaf
+// the cursor is about to step into. If the scan looks
+// sequential, then prefetch the next few children. We start
+// the next batch once the cursor is halfway through the
+// current one so that the reads overlap with the scan.
+static void cursor_read_ahead (BCursor *cursor) {
+    if (++cursor->read_ahead.leaf_steps < READ_AHEAD_TRIGGER) return;
+
+    Node *parent   = cursor_node(cursor);
+    u32 idx        = cursor_idx(cursor);
+    u32 last       = MIN(idx + READ_AHEAD_PAGES, (u32)parent->cell_count + 1);
+    bool same_node = (cursor->read_ahead.parent == parent->page->id);
+
+    if (same_node && (cursor->read_ahead.end >= idx + READ_AHEAD_PAGES/2)) return;
+
+    u32 from = same_node ? MAX(idx, cursor->read_ahead.end) : idx;
+    if (from >= last) return;
+
+    Page_Id ids[READ_AHEAD_PAGES];
+    u32 count = 0;
+    for (u32 i = from; i < last; ++i) {
+        ids[count++] = (i < parent->cell_count) ? cell_get_child(node_get_cell(parent, (u16)i)) : parent->rightmost_child;
+    }
+
+    pager_prefetch(cursor->tree->engine->pager, ids, count);
+    cursor->read_ahead.parent = parent->page->id;
+    cursor->read_ahead.end    = last;
+}
+
 bool bcursor_goto_next (BCursor *cursor) {
     Node *node = cursor_node(cursor);
 
@@ -708,13 +1187,14 @@ bool bcursor_goto_next (BCursor *cursor) {
         cursor_next_cell(cursor);
         return true;
     } else {
-        while (1) {
+        for (bool from_leaf = true;; from_leaf = false) {
             cursor_pop_unref(cursor);
 
             if (cursor->path_len == 0) {
                 return false;
             } else if (cursor_idx(cursor) < cursor_node(cursor)->cell_count) {
                 cursor_next_cell(cursor);
+                if (from_leaf) cursor_read_ahead(cursor);
                 cursor_goto_leftmost_leaf(cursor);
                 if (cursor_node(cursor)->cell_count) return true;
             }
@@ -755,62 +1235,266 @@ bool bcursor_goto_prev (BCursor *cursor) {
 bool bcursor_goto_first (BCursor *cursor) {
     bcursor_reset(cursor);
 
-    BTree *tree     = cursor->tree;
-    BEngine *engine = tree->engine;
-    Node *node      = node_from_page_id(engine, tree->root);
+    BTree *tree = cursor->tree;
+    Node *node  = node_from_page_id(cursor, tree->root);
 
     while (1) {
         cursor_push(cursor, node, 0);
         if (node_is_leaf(node)) break;
-        node = node_get_child(engine, node, 0);
+        node = node_get_child(cursor, node, 0);
     }
 
     return node->cell_count > 0;
 }
 
-#define cursor_goto_key(CURSOR, KEY, KEY_CMP) do{                       \
-    DEF(BCursor *, cursor, CURSOR);                                     \
+// Binary search for the first cell of the node whose key is
+// greater than or equal to KEY. The index of that cell (or the
+// cell_count if there is none) goes into OUT_IDX and the result
+// of comparing KEY with it into OUT_CMP (1 if there is none).
+#define node_search(NODE, KEY, KEY_CMP, OUT_IDX, OUT_CMP) do{          \
+    DEF(Node *, node, NODE);                                            \
     DEF(key, KEY);                                                      \
     DEF(key_cmp, KEY_CMP);                                              \
                                                                         \
-    BTree *tree     = cursor->tree;                                     \
-    BEngine *engine = tree->engine;                                     \
-                                                                        \
-    bcursor_reset(cursor);                                              \
-    Node *node = node_from_page_id(engine, cursor->tree->root);         \
+    u16 lo = 0;                                                         \
+    u16 hi = node->cell_count;                                          \
+    int result = 1;                                                     \
                                                                         \
-    repeat: if (node_is_inner(node)) {                                  \
-        cell_iter (node) {                                              \
-            if (key_cmp(key, cell_get_key(CELL, node)) < 1) {           \
-                cursor_push(cursor, node, CELL_IDX);                    \
-                node = node_from_page_id(engine, cell_get_child(CELL)); \
-                goto repeat;                                            \
-            }                                                           \
-        }                                                               \
+    while (lo < hi) {                                                   \
+        u16 mid = (u16)((lo + hi) / 2);                                 \
+        int cmp  = key_cmp(key, node_get_key(node, mid));               \
                                                                         \
-        cursor_push(cursor, node, node->cell_count);                    \
-        node = node_from_page_id(engine, node->rightmost_child);        \
-        goto repeat;                                                    \
-    } else {                                                            \
-        cell_iter (node) {                                              \
-            int cmp_result = key_cmp(key, cell_get_key(CELL, node));    \
-            if (cmp_result < 1) {                                       \
-                cursor_push(cursor, node, CELL_IDX);                    \
-                return cmp_result == 0;                                 \
-            }                                                           \
+        if (cmp > 0) {                                                  \
+            lo = mid + 1;                                               \
+        } else {                                                        \
+            hi = mid;                                                   \
+            result = cmp;                                               \
         }                                                               \
-                                                                        \
-        cursor_push(cursor, node, node->cell_count);                    \
-        return false;                                                   \
     }                                                                   \
+                                                                        \
+    OUT_IDX = lo;                                                       \
+    OUT_CMP = result;                                                   \
 }while(0)
 
+// Normalized int keys are big endian with the sign bit flipped,
+// so reading them as u64 gives numbers in the order of the keys.
+// The old little endian keys get mapped to the same numbers.
+static u64 int_key_order (u8 *key, bool normalized) {
+    return normalized ? read_u64_be(key) : (read_u64_le(key) ^ INT_KEY_SIGN_BIT);
+}
+
+// The same search for trees with int keys that were created
+// before dense nodes, so every probe goes through the cell
+// pointer array. The loop is branch free: it always runs
+// log2(cell_count) times and the compiler turns the ternary into
+// a conditional move, so there are no mispredicted branches on
+// random keys.
+static u16 node_search_int (Node *node, u64 key, bool normalized, int *out_cmp) {
+    #define KEY_AT(IDX) int_key_order(buf + read_u16_le(ptrs + 2*(IDX)) + offset, normalized)
+
+    u8 *buf    = node->page->buf;
+    u8 *ptrs   = buf + NODE_HEADER_SIZE;
+    u32 offset = node_is_inner(node) ? 4 : 0; // Inner cells start with the child id.
+    u32 count  = node->cell_count;
+    u32 base   = 0;
+
+    if (count) {
+        while (count > 1) {
+            u32 half = count / 2;
+            base   = (KEY_AT(base + half) < key) ? base + half : base;
+            count -= half;
+        }
+
+        if (KEY_AT(base) < key) base++;
+    }
+
+    *out_cmp = (base == node->cell_count) ? 1 : (KEY_AT(base) == key) ? 0 : -1;
+    return (u16)base;
+
+    #undef KEY_AT
+}
+
+// Returns how many of the n keys at the given position of a
+// dense key array are less than the key.
+typedef u32 (*Dense_Count_Fn) (u8 *, u32, u64);
+
+static u32 dense_count_less (u8 *keys, u32 n, u64 key) {
+    u32 result = 0;
+    for (u32 i = 0; i < n; ++i) result += read_u64_be(keys + DENSE_KEY_SIZE*i) < key;
+    return result;
+}
+
+#if defined(__x86_64__)
+// Compares 4 keys at a time. They are byte swapped into numbers
+// and the sign bit is flipped, since AVX2 can only compare signed
+// 64 bit ints. The load can go up to 3 keys past the end of the
+// array, which is still inside the page: the offsets come right
+// after it.
+__attribute__((target("avx2")))
+static u32 dense_count_less_avx2 (u8 *keys, u32 n, u64 key) {
+    __m256i swap   = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    __m256i sign   = _mm256_set1_epi64x((s64)INT_KEY_SIGN_BIT);
+    __m256i target = _mm256_set1_epi64x((s64)(key ^ INT_KEY_SIGN_BIT));
+    u32 result     = 0;
+
+    for (u32 i = 0; i < n; i += 4) {
+        __m256i chunk = _mm256_loadu_si256((__m256i*)(keys + DENSE_KEY_SIZE*i));
+        chunk = _mm256_xor_si256(_mm256_shuffle_epi8(chunk, swap), sign);
+
+        u32 less = (u32)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, chunk)));
+        if (n - i < 4) less &= (1u << (n - i)) - 1;
+        result += (u32)__builtin_popcount(less);
+    }
+
+    return result;
+}
+#endif
+
+static Dense_Count_Fn pick_dense_count_less (void) {
+    #if defined(__x86_64__)
+        if (__builtin_cpu_supports("avx2")) return dense_count_less_avx2;
+    #endif
+
+    return dense_count_less;
+}
+
+// The search for dense nodes. The same branch free loop as in
+// node_search_int() narrows the range down to DENSE_SCAN_KEYS
+// keys, which are then counted in one go. The keys are contiguous,
+// so the last steps touch one or two cache lines.
+#define DENSE_SCAN_KEYS 8
+
+static u16 node_search_dense (Node *node, u64 key, int *out_cmp) {
+    static Dense_Count_Fn count_less;
+    if (! count_less) count_less = pick_dense_count_less();
+
+    u8 *keys  = node_get_dense_keys(node);
+    u32 count = node->cell_count;
+    u32 base  = 0;
+
+    while (count > DENSE_SCAN_KEYS) {
+        u32 half = count / 2;
+        base   = (read_u64_be(keys + DENSE_KEY_SIZE*(base + half)) < key) ? base + half : base;
+        count -= half;
+    }
+
+    if (count) base += count_less(keys + DENSE_KEY_SIZE*base, count, key);
+
+    *out_cmp = (base == node->cell_count) ? 1 : (read_u64_be(keys + DENSE_KEY_SIZE*base) == key) ? 0 : -1;
+    return (u16)base;
+}
+
+// The same search for trees with normalized keys. Every probe
+// is a memcmp() of the raw bytes. The prefix of the node is
+// compared only once.
+static u16 node_search_normalized (Node *node, u8 *key, u32 key_len, u32 key_size, int *out_cmp) {
+    u32 offset = node_is_inner(node) ? 4 : 0;
+    u16 lo     = 0;
+    u16 hi     = node->cell_count;
+    int result = 1;
+
+    if (node->prefix_len) {
+        int cmp = memcmp(key, node_get_prefix(node), MIN(key_len, node->prefix_len));
+        if (cmp == 0 && key_len < node->prefix_len) cmp = -1;
+
+        if (cmp) {
+            *out_cmp = (cmp < 0) ? -1 : 1;
+            return (cmp < 0) ? 0 : node->cell_count;
+        }
+
+        key     += node->prefix_len;
+        key_len -= node->prefix_len;
+    }
+
+    while (lo < hi) {
+        u16 mid  = (u16)((lo + hi) / 2);
+        u8 *cell = node_get_cell(node, mid) + offset;
+        u32 len  = key_size;
+
+        if (! key_size) {
+            len   = read_u32_le(cell);
+            cell += 4;
+        }
+
+        int cmp = memcmp(key, cell, MIN(key_len, len));
+        if (cmp == 0) cmp = (key_len > len) - (key_len < len);
+
+        if (cmp > 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+            result = cmp;
+        }
+    }
+
+    *out_cmp = result;
+    return lo;
+}
+
+// Exactly one of ukey and key is given. For trees with normalized
+// keys other than ints only the key form is accepted.
+static bool cursor_goto_key (BCursor *cursor, UKey ukey, Key key) {
+    BType *type = cursor->tree->type;
+    u64 int_key = 0;
+    u8 *bytes   = NULL;
+    u32 len     = 0;
+
+    if (type->int_keys) {
+        int_key = ukey.ptr ? ((u64)*(s64*)ukey.ptr ^ INT_KEY_SIGN_BIT) : int_key_order(key.ptr, type->normalized);
+    } else if (type->normalized) {
+        ASSERT(key.ptr);
+        bytes = key.ptr;
+        len   = type->key_size;
+        if (! len) { len = read_u32_le(bytes); bytes += 4; }
+    }
+
+    bcursor_reset(cursor);
+    Node *node = node_from_page_id(cursor, cursor->tree->root);
+
+    while (1) {
+        u16 idx; int cmp_result;
+
+        if (cursor->tree->dense) {
+            idx = node_search_dense(node, int_key, &cmp_result);
+        } else if (type->int_keys) {
+            idx = node_search_int(node, int_key, type->normalized, &cmp_result);
+        } else if (type->normalized) {
+            idx = node_search_normalized(node, bytes, len, type->key_size, &cmp_result);
+        } else if (ukey.ptr) {
+            node_search(node, ukey, type->key_cmp, idx, cmp_result);
+        } else {
+            node_search(node, key, type->key_cmp2, idx, cmp_result);
+        }
+
+        cursor_push(cursor, node, idx);
+
+        if (node_is_leaf(node)) return cmp_result == 0;
+
+        Page_Id child = (idx < node->cell_count) ?
+                        cell_get_child(node_get_cell(node, idx)) :
+                        node->rightmost_child;
+        node = node_from_page_id(cursor, child);
+    }
+}
+
 bool bcursor_goto_ukey (BCursor *cursor, UKey key) {
-    cursor_goto_key(cursor, key, cursor->tree->type->key_cmp);
+    BType *type = cursor->tree->type;
+
+    if (type->normalized && !type->int_keys) {
+        Mem_Arena *arena = cursor->tree->engine->key_encoder;
+        Key encoded = KEY(MEM_ALLOC((Mem*)arena, type->sizeof_ukey(key)));
+        type->serialize_key(encoded, key);
+        bool found = cursor_goto_key(cursor, (UKey){0}, encoded);
+        mem_arena_clear(arena);
+        return found;
+    }
+
+    return cursor_goto_key(cursor, key, (Key){0});
 }
 
 bool bcursor_goto_key (BCursor *cursor, Key key) {
-    cursor_goto_key(cursor, key, cursor->tree->type->key_cmp2);
+    return cursor_goto_key(cursor, (UKey){0}, key);
 }
 
 void bcursor_close (BCursor *cursor) {
@@ -819,11 +1503,21 @@ void bcursor_close (BCursor *cursor) {
 }
 
 BCursor *bcursor_new (BTree *tree) {
+    end_appends(tree->engine);
     BCursor *cursor = MEM_ALLOC_Z(tree->engine->mem, sizeof(BCursor));
     cursor->tree = tree;
     return cursor;
 }
 
+// A read only cursor can share pages with other read only
+// cursors and doesn't cause the pages it visits to be written
+// back to disk. It must not be used for modifying the tree.
+BCursor *bcursor_new_read_only (BTree *tree) {
+    BCursor *cursor = bcursor_new(tree);
+    cursor->flags |= F_CURSOR_READ_ONLY;
+    return cursor;
+}
+
 // The cursor will continue pointing at the same cell.
 static void node_ensure_cell_space (BCursor *cursor, u16 cell_size) {
     BEngine *engine = cursor->tree->engine;
@@ -856,12 +1550,19 @@ static void node_ensure_cell_space (BCursor *cursor, u16 cell_size) {
 }
 
 // The cursor will continue pointing at the same cell.
+//
+// In trees with prefix compression the separator of two leaves
+// is shortened to the shortest key that still separates them,
+// and both halves get the longer prefix that their new fences
+// allow. If the cursor is right at the boundary, then the key
+// about to be inserted there is known only to be greater than
+// the last key on the left, so the full key is used instead.
 static void split_node (BCursor *cursor) {
     BTree *tree     = cursor->tree;
     BEngine *engine = tree->engine;
 
     Node *right = cursor_node(cursor);
-    Node *left  = node_new(engine, (right->flags & F_NODE_IS_LEAF));
+    Node *left  = node_new(engine, (right->flags & (F_NODE_IS_LEAF | F_NODE_FORMAT)));
 
     if (cursor->path_len == 1) { // Make a new root:
         Node *new_root = right;
@@ -892,25 +1593,46 @@ static void split_node (BCursor *cursor) {
             n_cells_to_move++;
         }
 
+        // With a long prefix the cells of a full node can add
+        // up to less than half the page.
+        if (n_cells_to_move == right->cell_count) n_cells_to_move--;
+
         // We assert that both nodes will contain some cells.
         // This follows from max cell size being half the page.
         ASSERT(n_cells_to_move != 0);
         ASSERT(n_cells_to_move < right->cell_count);
     }
 
+    Key separator = node_load_key(tree, right, n_cells_to_move - 1);
+    u16 left_len  = 0;
+    u16 right_len = 0;
+
+    if (tree->prefixed && node_is_leaf(right) && cursor_idx(cursor) != n_cells_to_move) {
+        Key next  = node_load_key(tree, right, n_cells_to_move);
+        separator = get_separator(tree, separator, next);
+    }
+
     { // Insert separator key into parent:
         u16 idx; Node *node = cursor_pop_get(cursor, &idx);
 
-        u8 *cell = node_get_cell(right, n_cells_to_move - 1);
-        Key key = cell_get_key(cell, right);
+        node_ensure_cell_space(cursor, 4 + tree->type->sizeof_key(separator));
+        node_add_inner_cell(tree, cursor_node(cursor), cursor_idx(cursor), separator, left->page->id);
 
-        node_ensure_cell_space(cursor, 4 + tree->type->sizeof_key(key));
-        node_add_inner_cell(tree, cursor_node(cursor), cursor_idx(cursor), key, left->page->id);
+        // Both halves keep at least the old prefix. The fences
+        // can give less than that if the parent has a shorter
+        // prefix than the node and the node is at it's edge.
+        if (tree->prefixed) {
+            left_len  = MAX(right->prefix_len, get_child_prefix_len(tree, cursor_node(cursor), cursor_idx(cursor)));
+            right_len = MAX(right->prefix_len, get_child_prefix_len(tree, cursor_node(cursor), cursor_idx(cursor) + 1));
+        }
 
         cursor_push(cursor, node, idx);
     }
 
     { // Move cells:
+        u32 len; u8 *bytes = key_get_bytes(separator, &len);
+        if (tree->prefixed) node_set_prefix(tree, left, bytes, left_len);
+
         node_move_cells_left(tree, left, right, n_cells_to_move);
 
         if (node_is_inner(left)) {
@@ -919,6 +1641,8 @@ static void split_node (BCursor *cursor) {
             node_delete_cell(tree, left, left->cell_count - 1);
         }
 
+        if (tree->prefixed) node_set_prefix(tree, right, bytes, right_len);
+
         CHECK(tree, left);
     }
 
@@ -927,7 +1651,10 @@ static void split_node (BCursor *cursor) {
         cursor->path_nodes[cursor->path_len - 1] = left;
         node_unref(engine, right);
     } else {
+        // The separator that was just added to the parent points at
+        // the left node, so the right one now comes one cell later.
         cursor->path_cells[cursor->path_len - 1] -= n_cells_to_move;
+        cursor->path_cells[cursor->path_len - 2]++;
         node_unref(engine, left);
     }
 }
@@ -955,10 +1682,20 @@ void bcursor_insert (BCursor *cursor, UKey key, Val val) {
     node_ensure_cell_space(cursor, key_size + val_size);
 
     Node *node = cursor_node(cursor);
-    u8 *cell   = node_add_cell(tree, node, cursor_idx(cursor), key_size + val_size);
+    u8 *cell;
+
+    if (tree->prefixed) {
+        Key full = KEY(MEM_ALLOC((Mem*)engine->key_saver, key_size));
+        tree->type->serialize_key(full, key);
+        cell = node_add_cell(tree, node, cursor_idx(cursor), node_sizeof_key(tree, node, full) + val_size);
+        node_write_key(tree, node, node_get_key(node, cursor_idx(cursor)).ptr, full);
+    } else {
+        cell = node_add_cell(tree, node, cursor_idx(cursor), key_size + val_size);
+        tree->type->serialize_key(node_get_key(node, cursor_idx(cursor)), key);
+    }
 
-    tree->type->serialize_key(cell_get_key(cell, node), key);
     memcpy(cell_get_val(tree, cell, node).ptr, val.ptr, val_size);
+    mem_arena_clear(engine->key_saver);
 
     CHECK(tree, node);
 }
@@ -971,14 +1708,26 @@ static bool try_merge_right (BCursor *cursor, Node **left_ptr, Node **right_ptr)
     Node *right     = *right_ptr;
     Node *parent    = cursor_node(cursor);
     u8 *parent_cell = node_get_cell(parent, cursor_idx(cursor));
+    bool is_root    = (cursor->path_len == 1 && parent->cell_count == 1);
+
+    // The merged node covers the ranges of both nodes, so it only
+    // keeps the part of the prefix that they have in common. If it
+    // becomes the root, then it can't have a prefix at all. Cells
+    // grow by the bytes that the prefix loses.
+    u16 prefix_len = 0;
+    if (tree->prefixed && !is_root) prefix_len = (u16)get_common_prefix_len(node_load_prefix(tree, left), node_load_prefix(tree, right));
 
-    u64 bytes_to_move = engine->page_size - node_get_logical_free_space(left);
-    if (node_is_inner(left)) bytes_to_move += 2 + cell_get_size(tree, parent_cell, parent);
+    s64 bytes_to_move = engine->page_size - node_get_logical_free_space(left);
+    bytes_to_move += left->cell_count * (left->prefix_len - prefix_len);
+    bytes_to_move += (right->cell_count - 1) * (right->prefix_len - prefix_len);
+    if (node_is_inner(left)) bytes_to_move += 2 + cell_get_size(tree, parent_cell, parent) + parent->prefix_len - prefix_len;
 
     if (bytes_to_move > node_get_logical_free_space(right)) return false;
 
+    if (tree->prefixed) node_set_prefix(tree, right, node_get_prefix(right), prefix_len);
+
     { // Move cells:
-        Key parent_key = cell_get_key(parent_cell, parent);
+        Key parent_key = node_load_key(tree, parent, cursor_idx(cursor));
         if (node_is_inner(left)) node_add_inner_cell(tree, right, 0, parent_key, left->rightmost_child);
         node_move_cells_right(tree, left, right, left->cell_count);
     }
@@ -989,7 +1738,7 @@ static bool try_merge_right (BCursor *cursor, Node **left_ptr, Node **right_ptr)
     CHECK(tree, right);
     CHECK(tree, parent);
 
-    if (cursor->path_len == 1 && parent->cell_count == 1) {
+    if (is_root) {
         // We must delete the root node.
         node_copy(engine, parent, right);
         node_delete(engine, right);
@@ -1057,9 +1806,7 @@ void bcursor_remove (BCursor *cursor) {
     if (free_space <= engine->page_size / 2) {
         node_delete_cell(tree, node, cursor_idx(cursor));
     } else {
-        Key key = cell_get_key(cell, node);
-        u32 key_size = tree->type->sizeof_key(key);
-        key.ptr = mem_copy((Mem*)engine->key_saver, key.ptr, key_size);
+        Key key = node_load_key(tree, node, cursor_idx(cursor));
         cursor_remove(cursor);
         bcursor_goto_key(cursor, key);
         mem_arena_clear(engine->key_saver);
@@ -1074,7 +1821,7 @@ void bcursor_update (BCursor *cursor, Val new_val) {
     BEngine *engine  = tree->engine;
     Node *node       = cursor_node(cursor);
     u8 *cell         = node_get_cell(node, cursor_idx(cursor));
-    u32 old_val_size = cell_get_size(tree, cell, node);
+    u32 old_val_size = tree->type->sizeof_val(cell_get_val(tree, cell, node));
     u32 new_val_size = tree->type->sizeof_val(new_val);
 
     if (new_val_size == old_val_size) {
@@ -1083,18 +1830,18 @@ void bcursor_update (BCursor *cursor, Val new_val) {
         return;
     }
 
-    Key key = cell_get_key(cell, node);
+    Key key = node_load_key(tree, node, cursor_idx(cursor));
     u32 key_size = tree->type->sizeof_key(key);
-    key.ptr = mem_copy((Mem*)engine->key_saver, key.ptr, key_size);
 
     check_cell_size(engine, key_size, new_val_size);
     node_delete_cell(tree, node, cursor_idx(cursor));
+    node_ensure_cell_space(cursor, key_size + new_val_size);
 
-    u32 new_cell_size = key_size + new_val_size;
-    node_ensure_cell_space(cursor, new_cell_size);
-    u8 *new_cell = node_add_cell(tree, node, cursor_idx(cursor), new_cell_size);
+    // The space might have been made by splitting the node.
+    node = cursor_node(cursor);
+    u8 *new_cell = node_add_cell(tree, node, cursor_idx(cursor), node_sizeof_key(tree, node, key) + new_val_size);
 
-    memcpy(cell_get_key(new_cell, node).ptr, key.ptr, key_size);
+    node_write_key(tree, node, node_get_key(node, cursor_idx(cursor)).ptr, key);
     memcpy(cell_get_val(tree, new_cell, node).ptr, new_val.ptr, new_val_size);
     mem_arena_clear(engine->key_saver);
 
@@ -1107,6 +1854,267 @@ Val bcursor_read (BCursor *cursor) {
     return cell_get_val(cursor->tree, cell, node);
 }
 
+// The order of normalized keys.
+static int normalized_key_cmp (BType *type, Key a, Key b) {
+    if (type->key_size) return memcmp(a.ptr, b.ptr, type->key_size);
+
+    u32 a_len; u8 *a_bytes = key_get_bytes(a, &a_len);
+    u32 b_len; u8 *b_bytes = key_get_bytes(b, &b_len);
+    int result = memcmp(a_bytes, b_bytes, MIN(a_len, b_len));
+    return result ? result : (a_len > b_len) - (a_len < b_len);
+}
+
+// The keys of a node all start with it's low fence up to the
+// first byte where the key and the fence differ. The keys come
+// in order, so that prefix can only get shorter as the node
+// fills up. The first node of a level has no low fence and so
+// no prefix.
+static u16 loader_get_prefix_len (BLoader *loader, u8 level, Key key) {
+    if (! (loader->format & F_NODE_PREFIXED)) return 0;
+    if (! loader->levels[level].has_low || loader->levels[level].no_prefix) return 0;
+    return (u16)get_common_prefix_len(KEY(loader->levels[level].low), key);
+}
+
+// A node is only closed to make room for the next cell, so the
+// open leaf has at least one cell once anything was added.
+static Key loader_get_last_key (BLoader *loader) {
+    Node *leaf = loader->levels[0].node;
+    return node_load_key(loader->tree, leaf, leaf->cell_count - 1);
+}
+
+static Node *loader_open_node (BLoader *loader, u8 level) {
+    BEngine *engine = loader->tree->engine;
+    ASSERT(level < MAX_BTREE_HEIGHT);
+
+    if (! loader->levels[level].low) loader->levels[level].low = MEM_ALLOC(engine->mem, engine->full_page_size);
+    if (level >= loader->height) loader->height = level + 1;
+
+    Node *node = node_new(engine, (level ? 0 : F_NODE_IS_LEAF) | loader->format);
+    loader->levels[level].node = node;
+    return node;
+}
+
+static void loader_add_cell (BLoader *, u8 level, Key key, Val val, Page_Id child);
+
+// The next key is the first one that goes into the node after
+// this one. The separator of two leaves is the shortest key that
+// separates them unless that would cut into the prefix of the
+// node. Inner nodes give their last cell to the level above.
+static void loader_close_node (BLoader *loader, u8 level, Key next) {
+    BTree *tree     = loader->tree;
+    BEngine *engine = tree->engine;
+    Node *node      = loader->levels[level].node;
+    Key separator   = node_load_key(tree, node, node->cell_count - 1);
+
+    if (node_is_leaf(node)) {
+        if ((loader->format & F_NODE_PREFIXED) && get_common_prefix_len(separator, next) >= node->prefix_len) {
+            separator = get_separator(tree, separator, next);
+        }
+    } else {
+        node->rightmost_child = cell_get_child(node_get_cell(node, node->cell_count - 1));
+        node_delete_cell(tree, node, node->cell_count - 1);
+    }
+
+    memcpy(loader->levels[level].low, separator.ptr, tree->type->sizeof_key(separator));
+    loader->levels[level].has_low = true;
+
+    Page_Id id = node->page->id;
+    CHECK(tree, node);
+    node_unref(engine, node);
+    loader_open_node(loader, level);
+
+    loader_add_cell(loader, level + 1, separator, (Val){0}, id);
+}
+
+// The key is a full key. Leaves take the val and inner nodes the child.
+static void loader_add_cell (BLoader *loader, u8 level, Key key, Val val, Page_Id child) {
+    BTree *tree     = loader->tree;
+    BEngine *engine = tree->engine;
+    Node *node      = (level < loader->height) ? loader->levels[level].node : loader_open_node(loader, level);
+    u32 key_size    = tree->type->sizeof_key(key);
+    u16 prefix_len  = loader_get_prefix_len(loader, level, key);
+    u16 min_cells   = level ? 2 : 1; // Inner nodes give one cell away when closed.
+
+    { // Close the node if the cell would take it over budget:
+        s32 growth = node->prefix_len - prefix_len;
+        s32 size   = (level ? 4 : tree->type->sizeof_val(val)) + key_size - prefix_len;
+        s32 used   = engine->full_page_size - node_get_logical_free_space(node) + (node->cell_count - 1) * growth + size + 2;
+
+        if (node->cell_count >= min_cells && used > loader->budget) {
+            loader_close_node(loader, level, key);
+            node       = loader->levels[level].node;
+            prefix_len = loader_get_prefix_len(loader, level, key);
+        }
+    }
+
+    if (loader->format & F_NODE_PREFIXED) {
+        u32 len; u8 *bytes = key_get_bytes(key, &len);
+        node_set_prefix(tree, node, bytes, prefix_len);
+    }
+
+    u16 key_part = node_sizeof_key(tree, node, key);
+    u16 idx      = node->cell_count;
+
+    if (level) {
+        u8 *cell = node_add_cell(tree, node, idx, 4 + key_part);
+        write_u32_le(cell, child);
+        node_write_key(tree, node, node_get_key(node, idx).ptr, key);
+    } else {
+        u32 val_size = tree->type->sizeof_val(val);
+        u8 *cell     = node_add_cell(tree, node, idx, key_part + val_size);
+        node_write_key(tree, node, node_get_key(node, idx).ptr, key);
+        memcpy(cell_get_val(tree, cell, node).ptr, val.ptr, val_size);
+    }
+}
+
+// Bulk loads entries into an empty tree. The entries must be
+// given to bloader_add() in strictly increasing key order, and
+// the tree must not be touched until bloader_finish(). Pages are
+// filled up to fill_percent (0 = default) and each page is filled
+// only once, so it gets written out only once.
+BLoader *bloader_new (BTree *tree, u32 fill_percent) {
+    BEngine *engine = tree->engine;
+    ASSERT(fill_percent <= 100);
+    if (! fill_percent) fill_percent = BULK_LOAD_FILL_PERCENT;
+
+    Page_Ref *page = pager_get_page(engine->pager, tree->root);
+    Node *root     = node_from_page(engine, page);
+    ASSERT(node_is_leaf(root) && root->cell_count == 0);
+    ASSERT(root->flags & F_NODE_NORMALIZED);
+
+    BLoader *loader = MEM_ALLOC_Z(engine->mem, sizeof(BLoader));
+    loader->tree    = tree;
+    loader->format  = root->flags & F_NODE_FORMAT;
+    loader->budget  = (u16)(engine->full_page_size * fill_percent / 100);
+
+    pager_unref_page(engine->pager, page);
+    return loader;
+}
+
+void bloader_add (BLoader *loader, UKey ukey, Val val) {
+    BTree *tree     = loader->tree;
+    BEngine *engine = tree->engine;
+    u32 key_size    = tree->type->sizeof_ukey(ukey);
+
+    check_cell_size(engine, key_size, tree->type->sizeof_val(val));
+
+    Key key = KEY(MEM_ALLOC((Mem*)engine->key_saver, key_size));
+    tree->type->serialize_key(key, ukey);
+
+    #if !defined(RELEASE_BUILD)
+        if (loader->height) ASSERT(normalized_key_cmp(tree->type, loader_get_last_key(loader), key) < 0);
+    #endif
+
+    loader_add_cell(loader, 0, key, val, 0);
+    mem_arena_clear(engine->key_saver);
+}
+
+// The last node of each level is the rightmost one of the tree,
+// so there are no keys that bound it from above and it can't
+// have a prefix. It's cells get added again without one, which
+// might spill them over into new nodes. The node on top is then
+// copied into the root page, so the tree keeps it's root.
+void bloader_finish (BLoader *loader) {
+    BTree *tree     = loader->tree;
+    BEngine *engine = tree->engine;
+    Page_Id child   = 0;
+
+    for (u8 level = 0; level < loader->height; ++level) {
+        Node *node = loader->levels[level].node;
+
+        if (node->prefix_len) {
+            Page_Ref copy_page = { .buf = MEM_ALLOC(engine->mem, engine->full_page_size) };
+            Node copy = *node;
+            copy.page = &copy_page;
+            memcpy(copy_page.buf, node->page->buf, engine->full_page_size);
+
+            node_reset(engine, node);
+            node->flags = copy.flags;
+            loader->levels[level].no_prefix = true;
+
+            cell_iter (&copy) {
+                Key key = node_load_key(tree, &copy, CELL_IDX);
+                if (level) loader_add_cell(loader, level, key, (Val){0}, cell_get_child(CELL));
+                else       loader_add_cell(loader, level, key, cell_get_val(tree, CELL, &copy), 0);
+            }
+
+            MEM_FREE(engine->mem, copy_page.buf, engine->full_page_size);
+            node = loader->levels[level].node;
+        }
+
+        if (level) node->rightmost_child = child;
+        child = node->page->id;
+        CHECK(tree, node);
+
+        if (level == loader->height - 1) {
+            Page_Ref *page = pager_get_page_mutable(engine->pager, tree->root);
+            Node *root     = node_from_page(engine, page);
+            node_copy(engine, root, node);
+            node_delete(engine, node);
+            node_unref(engine, root);
+        } else {
+            node_unref(engine, node);
+        }
+    }
+
+    for (u8 level = 0; level < MAX_BTREE_HEIGHT; ++level) {
+        if (loader->levels[level].low) MEM_FREE(engine->mem, loader->levels[level].low, engine->full_page_size);
+    }
+
+    mem_arena_clear(engine->key_saver);
+    MEM_FREE(engine->mem, loader, sizeof(BLoader));
+}
+
+static void end_appends (BEngine *engine) {
+    if (! engine->appender) return;
+    bloader_finish(engine->appender);
+    engine->appender = NULL;
+}
+
+static bool btree_is_empty (BTree *tree) {
+    BEngine *engine = tree->engine;
+    Page_Ref *page  = pager_get_page(engine->pager, tree->root);
+    Node *root      = node_from_page(engine, page);
+    bool result     = node_is_leaf(root) && root->cell_count == 0;
+    pager_unref_page(engine->pager, page);
+    return result;
+}
+
+// Entries that go into an empty tree in increasing key order are
+// given to a BLoader instead of being inserted one at a time. The
+// run of appends ends once an entry is out of order or something
+// else uses the engine: a new cursor, a flush, or the start or end
+// of a transaction. Returns false if the entry wasn't appended, in
+// which case it has to be inserted with bcursor_insert().
+bool btree_append (BTree *tree, UKey ukey, Val val) {
+    BEngine *engine = tree->engine;
+    BLoader *loader = engine->appender;
+
+    if (loader && loader->tree != tree) {
+        end_appends(engine);
+        loader = NULL;
+    }
+
+    if (! loader && !(tree->type->normalized && btree_is_empty(tree))) return false;
+
+    u32 key_size = tree->type->sizeof_ukey(ukey);
+    check_cell_size(engine, key_size, tree->type->sizeof_val(val));
+
+    Key key = KEY(MEM_ALLOC((Mem*)engine->key_saver, key_size));
+    tree->type->serialize_key(key, ukey);
+
+    if (! loader) {
+        loader = engine->appender = bloader_new(tree, 0);
+    } else if (normalized_key_cmp(tree->type, loader_get_last_key(loader), key) >= 0) {
+        end_appends(engine);
+        return false;
+    }
+
+    loader_add_cell(loader, 0, key, val, 0);
+    mem_arena_clear(engine->key_saver);
+    return true;
+}
+
 void btree_delete (BTree *tree) {
     BCursor *cursor = bcursor_new(tree);
     cursor->flags |= F_CURSOR_DELETE_NODE_ON_EXIT;
@@ -1114,23 +2122,76 @@ void btree_delete (BTree *tree) {
     bcursor_close(cursor);
 }
 
-static BTree *btree_alloc (BEngine *engine, Type_Table *type, Page_Id id) {
-    BTree *tree  = MEM_ALLOC(type->mem, sizeof(BTree));
-    tree->type   = get_btype_for_table(type);
-    tree->engine = engine;
-    tree->root   = id;
+static BTree *btree_alloc (BEngine *engine, Type_Table *type, Page_Id id, u16 format) {
+    BTree *tree    = MEM_ALLOC(type->mem, sizeof(BTree));
+    tree->type     = get_btype_for_table(type, format & F_NODE_NORMALIZED);
+    tree->engine   = engine;
+    tree->root     = id;
+    tree->prefixed = format & F_NODE_PREFIXED;
+    tree->dense    = format & F_NODE_DENSE;
+    tree->priority = PAGER_PRIORITY_NORMAL;
     return tree;
 }
 
+// Every node of the tree is visited, so a tree with a raised
+// priority ends up in the cache entirely.
+void btree_set_priority (BTree *tree, Pager_Priority priority) {
+    tree->priority = priority;
+    BCursor *cursor = bcursor_new_read_only(tree);
+    while (cursor_goto_next_node(cursor));
+    bcursor_close(cursor);
+}
+
+BTree_Stats btree_get_stats (BTree *tree) {
+    BEngine *engine    = tree->engine;
+    BTree_Stats result = {0};
+    u64 used           = 0;
+
+    BCursor *cursor = bcursor_new_read_only(tree);
+    while (cursor_goto_next_node(cursor)) {
+        Node *node = cursor_node(cursor);
+        used += engine->full_page_size - node_get_logical_free_space(node);
+        result.height = MAX(result.height, cursor->path_len);
+
+        if (node_is_leaf(node)) {
+            result.leaves++;
+            result.entries += node->cell_count;
+        } else {
+            result.inner_nodes++;
+        }
+    }
+    bcursor_close(cursor);
+
+    result.fill_factor = (double)used / (double)((result.inner_nodes + result.leaves) * engine->full_page_size);
+    return result;
+}
+
+// Trees created before keys were normalized, prefixes were
+// compressed or int keys got dense nodes keep their old format.
+// The root tells which format the tree uses.
 BTree *btree_load (BEngine *engine, Type_Table *type, s64 tag) {
-    return btree_alloc(engine, type, (Page_Id)tag);
+    Page_Ref *page = pager_get_page(engine->pager, (Page_Id)tag);
+    ASSERT(page);
+    u16 format = node_from_page(engine, page)->flags & F_NODE_FORMAT;
+    pager_unref_page(engine->pager, page);
+    return btree_alloc(engine, type, (Page_Id)tag, format);
 }
 
+// Only keys of variable size get prefix compression. Fixed size
+// keys are too short to have a prefix worth storing. Int keys get
+// dense nodes.
 BTree *btree_new (BEngine *engine, Type_Table *type) {
-    Node *root = node_new(engine, F_NODE_IS_LEAF);
+    BType *btype = get_btype_for_table(type, true);
+    u16 format   = F_NODE_NORMALIZED;
+
+    if (btype->key_size == 0) format |= F_NODE_PREFIXED;
+    if (btype->int_keys) format |= F_NODE_DENSE;
+    ASSERT(!(format & F_NODE_DENSE) || btype->key_size == DENSE_KEY_SIZE);
+
+    Node *root = node_new(engine, F_NODE_IS_LEAF | format);
     Page_Id root_id = root->page->id;
     node_unref(engine, root);
-    return btree_alloc(engine, type, root_id);
+    return btree_alloc(engine, type, root_id, format);
 }
 
 void btree_print (BTree *tree) {
@@ -1148,7 +2209,7 @@ void btree_print (BTree *tree) {
     fs_overwrite_file(engine->fs, file, ds_to_str(&nodes));
     ds_clear(&nodes);
 
-    BCursor *cursor = bcursor_new(tree);
+    BCursor *cursor = bcursor_new_read_only(tree);
     while (cursor_goto_next_node(cursor)) {
         Node *node = cursor_node(cursor);
         ds_add_fmt(&nodes, "\n    subgraph \"cluster_%i\" { style=filled\n", node->page->id);
@@ -1160,7 +2221,7 @@ void btree_print (BTree *tree) {
                 Page_Id child = cell_get_child(CELL);
                 ds_add_fmt(&nodes, "        \"ptr_%i_%i\"\n", node->page->id, CELL_IDX);
                 ds_add_fmt(&nodes, "        \"cell_%i_%i\" [label=<", node->page->id, CELL_IDX);
-                tree->type->key_print(&nodes, cell_get_key(CELL, node));
+                tree->type->key_print(&nodes, node_load_key(tree, node, CELL_IDX));
                 ds_add_cstr(&nodes, ">]\n");
                 ds_add_fmt(&edges, "    \"ptr_%i_%i\" -> \"node_%i\" [lhead=\"cluster_%i\"];\n", node->page->id, CELL_IDX, child, child);
             }
@@ -1175,7 +2236,7 @@ void btree_print (BTree *tree) {
         } else {
             cell_iter_reverse (node) {
                 ds_add_fmt(&nodes, "        \"cell_%i_%i\" [label=<", node->page->id, CELL_IDX);
-                tree->type->key_print(&nodes, cell_get_key(CELL, node));
+                tree->type->key_print(&nodes, node_load_key(tree, node, CELL_IDX));
                 ds_add_cstr(&nodes, ">]\n");
             }
 
@@ -1195,15 +2256,21 @@ void btree_print (BTree *tree) {
     ds_free(&edges);
     fs_close_file(engine->fs, file);
     bcursor_close(cursor);
+    mem_arena_clear(engine->key_saver);
 }
 
-BEngine *bengine_new (Files *fs, Mem *mem, String db_file_path) {
+// Returns NULL if the db file cannot be opened.
+BEngine *bengine_new (Files *fs, Mem *mem, String db_file_path, Pager_Options *options) {
+    Pager *pager = pager_new(fs, mem, db_file_path, options);
+    if (! pager) return NULL;
+
     BEngine *engine = MEM_ALLOC_Z(mem, sizeof(BEngine));
 
     engine->fs             = fs;
     engine->mem            = mem;
     engine->key_saver      = mem_arena_new(mem, 512);
-    engine->pager          = pager_new(fs, mem, db_file_path);
+    engine->key_encoder    = mem_arena_new(mem, 512);
+    engine->pager          = pager;
     engine->full_page_size = pager_get_page_size(engine->pager);
     engine->page_size      = engine->full_page_size - NODE_HEADER_SIZE;
     engine->scratch_page   = MEM_ALLOC(mem, engine->full_page_size);
@@ -1211,12 +2278,36 @@ BEngine *bengine_new (Files *fs, Mem *mem, String db_file_path) {
     ASSERT((engine->page_size % 2) == 0);
 
     pager_init_user_buffers(engine->pager, sizeof(Node));
+    pager_warm_up(engine->pager);
 
     return engine;
 }
 
+void bengine_flush (BEngine *engine) {
+    end_appends(engine);
+    pager_flush(engine->pager);
+}
+
+bool bengine_begin (BEngine *engine) {
+    end_appends(engine);
+    return pager_begin(engine->pager);
+}
+
+bool bengine_commit (BEngine *engine) {
+    end_appends(engine);
+    return pager_commit(engine->pager);
+}
+
+bool bengine_rollback (BEngine *engine) {
+    end_appends(engine);
+    return pager_rollback(engine->pager);
+}
+
 void bengine_close (BEngine *engine) {
+    end_appends(engine);
+    pager_close(engine->pager);
     mem_arena_destroy(engine->key_saver);
+    mem_arena_destroy(engine->key_encoder);
     MEM_FREE(engine->mem, engine->scratch_page, engine->full_page_size);
     MEM_FREE(engine->mem, engine, sizeof(BEngine));
 }
@@ -1230,6 +2321,18 @@ bool bengine_db_is_empty (BEngine *engine) {
     return pager_file_is_empty(engine->pager);
 }
 
+u32 bengine_get_page_size (BEngine *engine) {
+    return engine->full_page_size;
+}
+
+void bengine_set_cache_size (BEngine *engine, u32 page_count) {
+    pager_set_cache_size(engine->pager, page_count);
+}
+
+Pager_Stats bengine_get_cache_stats (BEngine *engine) {
+    return pager_get_stats(engine->pager);
+}
+
 // =============================================================================
 // Engine specific type functions.
 // =============================================================================
@@ -1256,18 +2359,65 @@ void str_serialize_key  (Key key, UKey ukey)   { String *str = (String*)ukey.ptr
 int  str_key_cmp        (UKey ukey, Key key)   { String K1 = *(String*)ukey.ptr; String K2 = { .count = read_u32_le(key.ptr), .data = (char*)key.ptr + 4 }; return strncmp(K1.data, K2.data, MIN(K1.count, K2.count)); }
 int  str_key_cmp2       (Key key1, Key key2)   { String K1 = { .count = read_u32_le(key1.ptr), .data = (char*)key1.ptr + 4 }; String K2 = { .count = read_u32_le(key2.ptr), .data = (char*)key2.ptr + 4 }; return strncmp(K1.data, K2.data, MIN(K1.count, K2.count)); }
 
-BType btype_int  = { int_key_cmp, int_key_print, int_sizeof_key, int_sizeof_ukey, int_serialize_key, sizeof_val, int_key_cmp2 };
-BType btype_bool = { bool_key_cmp, bool_key_print, bool_sizeof_key, bool_sizeof_ukey, bool_serialize_key, sizeof_val, bool_key_cmp2 };
-BType btype_str  = { str_key_cmp, str_key_print, str_sizeof_key, str_sizeof_ukey, str_serialize_key, sizeof_val, str_key_cmp2 };
+// Normalized keys. Ints are big endian with the sign bit flipped
+// and bools are a single byte. Strings have a u32 byte count and
+// then the bytes with each 0x00 escaped as 0x00 0xff followed by
+// the terminator 0x00 0x01. The terminator sorts a string before
+// all the strings it's a prefix of, and it keeps the encoding
+// order preserving when keys are concatenated.
+void int_norm_key_print     (DString *ds, Key key) { ds_add_fmt(ds, "%li", (s64)(read_u64_be(key.ptr) ^ INT_KEY_SIGN_BIT)); }
+void int_norm_serialize_key (Key key, UKey ukey)   { write_u64_be(key.ptr, (u64)*(s64*)ukey.ptr ^ INT_KEY_SIGN_BIT); }
+
+u32 str_norm_sizeof_ukey (UKey ukey) {
+    String *str = (String*)ukey.ptr;
+    u32 result  = 4 + str->count + 2;
+    for (u32 i = 0; i < str->count; ++i) result += (str->data[i] == 0);
+    return result;
+}
+
+void str_norm_serialize_key (Key key, UKey ukey) {
+    String *str = (String*)ukey.ptr;
+    u8 *out     = (u8*)key.ptr + 4;
+
+    for (u32 i = 0; i < str->count; ++i) {
+        u8 byte = (u8)str->data[i];
+        *out++ = byte;
+        if (byte == 0) *out++ = 0xff;
+    }
+
+    *out++ = 0x00;
+    *out++ = 0x01;
+    write_u32_le(key.ptr, (u32)(out - (u8*)key.ptr - 4));
+}
+
+// Separators in trees with prefix compression can be cut off
+// anywhere, so the terminator might be missing.
+void str_norm_key_print (DString *ds, Key key) {
+    u8 *bytes = (u8*)key.ptr + 4;
+    u32 count = read_u32_le(key.ptr);
+
+    for (u32 i = 0; i < count; ++i) {
+        if (bytes[i] != 0) ds_add_fmt(ds, "%c", bytes[i]);
+        else if (i + 1 < count && bytes[i + 1] == 0x01) break;
+        else { ds_add_cstr(ds, "\\0"); i++; }
+    }
+}
+
+BType btype_int       = { int_key_cmp, int_key_print, int_sizeof_key, int_sizeof_ukey, int_serialize_key, sizeof_val, int_key_cmp2, false, 0, true };
+BType btype_bool      = { bool_key_cmp, bool_key_print, bool_sizeof_key, bool_sizeof_ukey, bool_serialize_key, sizeof_val, bool_key_cmp2, false, 0, false };
+BType btype_str       = { str_key_cmp, str_key_print, str_sizeof_key, str_sizeof_ukey, str_serialize_key, sizeof_val, str_key_cmp2, false, 0, false };
+BType btype_int_norm  = { NULL, int_norm_key_print, int_sizeof_key, int_sizeof_ukey, int_norm_serialize_key, sizeof_val, NULL, true, 8, true };
+BType btype_bool_norm = { NULL, bool_key_print, bool_sizeof_key, bool_sizeof_ukey, bool_serialize_key, sizeof_val, NULL, true, 1, false };
+BType btype_str_norm  = { NULL, str_norm_key_print, str_sizeof_key, str_norm_sizeof_ukey, str_norm_serialize_key, sizeof_val, NULL, true, 0, false };
 
-static BType *get_btype_for_table (Type_Table *table) {
+static BType *get_btype_for_table (Type_Table *table, bool normalized) {
     Array_Type_Column *col_types = &array_get_first(&table->row->scopes)->cols;
     Type *prim_key = array_get(col_types, table->prim_key_col)->field;
 
     switch (prim_key->tag) {
-    case TYPE_INT:  return &btype_int;
-    case TYPE_TEXT: return &btype_str;
-    case TYPE_BOOL: return &btype_bool;
+    case TYPE_INT:  return normalized ? &btype_int_norm : &btype_int;
+    case TYPE_TEXT: return normalized ? &btype_str_norm : &btype_str;
+    case TYPE_BOOL: return normalized ? &btype_bool_norm : &btype_bool;
     default:        unreachable;
     }
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "files.h"
+#include "pager.h"
 #include "typer.h"
 #include "string.h"
 #include "common.h"
@@ -10,6 +11,7 @@ typedef struct BEngine BEngine;
 typedef struct BTree   BTree;
 typedef struct BType   BType;
 typedef struct BCursor BCursor;
+typedef struct BLoader BLoader;
 
 typedef struct { void *ptr; } Key;
 typedef struct { void *ptr; } Val;
@@ -23,27 +25,63 @@ struct BType {
     void (*serialize_key) (Key, UKey);
     u32  (*sizeof_val)    (Val);
     int  (*key_cmp2)      (Key, Key);
+
+    // Normalized keys are encoded so that their byte order is
+    // the order of the keys, and lookups compare them with a
+    // plain memcmp(). Such a key is key_size bytes long or, if
+    // key_size is 0, a u32 byte count followed by the bytes.
+    // The key_cmp functions are not used in that case.
+    bool normalized;
+    u8   key_size;
+
+    // The keys are s64. Lookups in such trees read the keys
+    // straight out of the cells instead of going through the
+    // functions above.
+    bool int_keys;
 };
 
-BEngine *bengine_new         (Files *, Mem *, String db_file_path);
-void     bengine_close       (BEngine *);
-bool     bengine_db_is_empty (BEngine *);
-s64      bengine_get_tag     (Type_Table *);
-
-BTree   *btree_new           (BEngine *, Type_Table *);
-BTree   *btree_load          (BEngine *, Type_Table *, s64);
-void     btree_delete        (BTree *);
-void     btree_print         (BTree *);
-
-BCursor *bcursor_new         (BTree *);
-void     bcursor_close       (BCursor *);
-void     bcursor_reset       (BCursor *);
-Val      bcursor_read        (BCursor *);
-void     bcursor_insert      (BCursor *, UKey, Val);
-void     bcursor_update      (BCursor *, Val);
-void     bcursor_remove      (BCursor *);
-bool     bcursor_goto_ukey   (BCursor *, UKey);
-bool     bcursor_goto_key    (BCursor *, Key);
-bool     bcursor_goto_next   (BCursor *);
-bool     bcursor_goto_prev   (BCursor *);
-bool     bcursor_goto_first  (BCursor *);
+typedef struct {
+    u32 height;
+    u64 inner_nodes;
+    u64 leaves;
+    u64 entries;
+    double fill_factor; // Average share of a page that is in use.
+} BTree_Stats;
+
+BEngine    *bengine_new             (Files *, Mem *, String db_file_path, Pager_Options *);
+void        bengine_close           (BEngine *);
+void        bengine_flush           (BEngine *);
+bool        bengine_begin           (BEngine *);
+bool        bengine_commit          (BEngine *);
+bool        bengine_rollback        (BEngine *);
+bool        bengine_db_is_empty     (BEngine *);
+u32         bengine_get_page_size   (BEngine *);
+void        bengine_set_cache_size  (BEngine *, u32 page_count);
+Pager_Stats bengine_get_cache_stats (BEngine *);
+s64         bengine_get_tag         (Type_Table *);
+
+BTree      *btree_new              (BEngine *, Type_Table *);
+BTree      *btree_load             (BEngine *, Type_Table *, s64);
+bool        btree_append           (BTree *, UKey, Val);
+void        btree_delete           (BTree *);
+void        btree_print            (BTree *);
+void        btree_set_priority     (BTree *, Pager_Priority);
+BTree_Stats btree_get_stats        (BTree *);
+
+BLoader    *bloader_new            (BTree *, u32 fill_percent);
+void        bloader_add            (BLoader *, UKey, Val);
+void        bloader_finish         (BLoader *);
+
+BCursor    *bcursor_new            (BTree *);
+BCursor    *bcursor_new_read_only  (BTree *);
+void        bcursor_close          (BCursor *);
+void        bcursor_reset          (BCursor *);
+Val         bcursor_read           (BCursor *);
+void        bcursor_insert         (BCursor *, UKey, Val);
+void        bcursor_update         (BCursor *, Val);
+void        bcursor_remove         (BCursor *);
+bool        bcursor_goto_ukey      (BCursor *, UKey);
+bool        bcursor_goto_key       (BCursor *, Key);
+bool        bcursor_goto_next      (BCursor *);
+bool        bcursor_goto_prev      (BCursor *);
+bool        bcursor_goto_first     (BCursor *);
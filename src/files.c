@@ -1,18 +1,58 @@
+#include <time.h>
+#include <errno.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/falloc.h>
 
 #include "files.h"
 #include "array.h"
+#include "uring.h"
 #include "report.h"
 #include "string.h"
 
+#define MAX_WRITEV_PAGES 64
+#define ASYNC_QUEUE_DEPTH 64
+#define MEMORY_PATH_PREFIX ":memory:"
+
+// A File is a raw file descriptor. All reads and writes are
+// positional (pread/pwrite) so there is no shared file offset
+// and each page transfer is a single syscall.
 typedef struct {
     String path;
-    FILE *handle;
+    int fd;
 } File_Info;
 
+typedef struct {
+    File file;
+    bool write;
+    u8 *buf;
+    u32 amount;
+    u64 offset;
+    void *tag;
+} Async_Request;
+
 struct Files {
     Mem *mem;
     Array(File_Info) files;
+
+    // Async I/O is only available if fs_async_init() managed
+    // to set up an io_uring instance. Requests live in a fixed
+    // pool, so at most ASYNC_QUEUE_DEPTH can be in flight. If a
+    // new request doesn't fit, we reap a completion to make room
+    // and stash its tag in the done array for fs_async_wait().
+    struct {
+        Uring *ring;
+        Async_Request *requests;
+        Array(Async_Request*) free;
+        Array(void*) done;
+    } async;
+
+    Fs_Sync_Stats syncs;
 };
 
 static Noreturn error (Files *fs) {
@@ -26,20 +66,30 @@ static String save_path (Files *fs, String str) {
     return ds_to_str(&ds);
 }
 
-static void seek (Files *fs, File file, u64 offset) {
-    // TODO: We cannot offset with a u64...
-    if (fseek((FILE*)file, (long)offset, SEEK_SET)) error(fs);
+static void write_all (Files *fs, File file, u8 *buf, u64 amount, u64 offset) {
+    while (amount) {
+        ssize_t n = pwrite((int)file, buf, amount, (off_t)offset);
+        if (n <= 0) error(fs);
+        buf    += n;
+        amount -= (u64)n;
+        offset += (u64)n;
+    }
 }
 
-static void seek_end (Files *fs, File file) {
-    if (fseek((FILE*)file, 0, SEEK_END)) error(fs);
+static void read_all (Files *fs, File file, u8 *buf, u64 amount, u64 offset) {
+    while (amount) {
+        ssize_t n = pread((int)file, buf, amount, (off_t)offset);
+        if (n <= 0) error(fs); // Reading past the end of file is an error too.
+        buf    += n;
+        amount -= (u64)n;
+        offset += (u64)n;
+    }
 }
 
 u64 fs_get_file_size (Files *fs, File file) {
-    seek_end(fs, file);
-    long result = ftell((FILE*)file);
-    if (result < 0) error(fs);
-    return (u64)result;
+    struct stat info;
+    if (fstat((int)file, &info)) error(fs);
+    return (u64)info.st_size;
 }
 
 Files *fs_new (Mem *mem) {
@@ -50,8 +100,16 @@ Files *fs_new (Mem *mem) {
 }
 
 void fs_destroy (Files *fs) {
+    if (fs->async.ring) {
+        while (fs_async_wait(fs));
+        uring_destroy(fs->async.ring);
+        MEM_FREE(fs->mem, fs->async.requests, ASYNC_QUEUE_DEPTH * sizeof(Async_Request));
+        array_free(&fs->async.free);
+        array_free(&fs->async.done);
+    }
+
     array_iter (it, fs->files) {
-        fclose(it.handle);
+        close(it.fd);
         MEM_FREE(fs->mem, it.path.data, it.path.count + 1);
     }
 
@@ -59,27 +117,45 @@ void fs_destroy (Files *fs) {
     MEM_FREE(fs->mem, fs, sizeof(Files));
 }
 
+bool fs_is_memory_path (String path) {
+    String prefix = str(MEMORY_PATH_PREFIX);
+    return (path.count >= prefix.count) && !memcmp(path.data, prefix.data, prefix.count);
+}
+
+// If the file doesn't exist it will be created. A path that
+// starts with ":memory:" opens a new anonymous file that only
+// lives in memory (a memfd) and is gone once it's closed. It
+// supports the same calls as a file on disk, so the rest of
+// this module doesn't have to tell them apart.
 File fs_open_file (Files *fs, String path) {
     path = save_path(fs, path);
 
-    FILE *file = fopen(path.data, "r+b");
+    int fd = fs_is_memory_path(path) ?
+             (int)syscall(SYS_memfd_create, path.data, 0) :
+             open(path.data, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) error(fs);
 
-    if (! file) {
-        // If the file doesn't exist try to make one.
-        file = fopen(path.data, "w+b");
-        if (! file) error(fs);
+    array_add(&fs->files, ((File_Info){ .path = path, .fd = fd }));
 
-        // Switch again to r+b mode...
-        fclose(file);
-        file = fopen(path.data, "r+b");
-        if (! file) error(fs);
-    }
-
-    setbuf(file, NULL); // Disable buffering.
+    return (File)fd;
+}
 
-    array_add(&fs->files, ((File_Info){ .path = path, .handle = file }));
+// A file in memory never exists before it's opened.
+bool fs_file_exists (Files *fs, String path) {
+    if (fs_is_memory_path(path)) return false;
+    path = save_path(fs, path);
+    struct stat info;
+    bool exists = !stat(path.data, &info);
+    MEM_FREE(fs->mem, path.data, path.count + 1);
+    return exists;
+}
 
-    return (File)file;
+// A file that doesn't exist is not an error.
+void fs_delete_file (Files *fs, String path) {
+    if (fs_is_memory_path(path)) return;
+    path = save_path(fs, path);
+    if (unlink(path.data) && (errno != ENOENT)) error(fs);
+    MEM_FREE(fs->mem, path.data, path.count + 1);
 }
 
 void fs_create_file (Files *fs, String path) {
@@ -87,15 +163,15 @@ void fs_create_file (Files *fs, String path) {
 }
 
 String fs_get_file_path (Files *fs, File file) {
-    array_iter (it, fs->files) if (it.handle == (FILE*)file) return it.path;
+    array_iter (it, fs->files) if (it.fd == (int)file) return it.path;
     unreachable;
 }
 
 void fs_close_file (Files *fs, File file) {
-    fclose((FILE*)file);
+    close((int)file);
 
     array_iter (it, fs->files) {
-        if (it.handle == (FILE*)file) {
+        if (it.fd == (int)file) {
             MEM_FREE(fs->mem, it.path.data, it.path.count + 1);
             array_remove_fast(&fs->files, ARRAY_IDX);
             break;
@@ -104,45 +180,217 @@ void fs_close_file (Files *fs, File file) {
 }
 
 void fs_append_to_file (Files *fs, File file, String payload) {
-    seek_end(fs, file);
-    size_t n_written = fwrite(payload.data, 1, payload.count, (FILE*)file);
-    if (n_written != payload.count) error(fs);
+    write_all(fs, file, (u8*)payload.data, payload.count, fs_get_file_size(fs, file));
 }
 
 void fs_write_to_file (Files *fs, File file, String payload, u64 offset) {
-    seek(fs, file, offset);
-    size_t n_written = fwrite(payload.data, 1, payload.count, (FILE*)file);
-    if (n_written != payload.count) error(fs);
+    write_all(fs, file, (u8*)payload.data, payload.count, offset);
 }
 
-void fs_overwrite_file (Files *fs, File file, String payload) {
-    { // Truncate the file to zero length:
-        String path = fs_get_file_path(fs, file);
-        FILE *F = fopen(path.data, "w+");
-        if (! F) error(fs);
-        fclose(F);
+// Write @page_count buffers of @page_size bytes each to
+// consecutive locations in the file starting at @offset.
+void fs_writev_pages (Files *fs, File file, u64 offset, u8 **pages, u32 page_count, u32 page_size) {
+    struct iovec iov[MAX_WRITEV_PAGES];
+
+    while (page_count) {
+        u32 batch = MIN(page_count, MAX_WRITEV_PAGES);
+        for (u32 i = 0; i < batch; ++i) iov[i] = (struct iovec){ .iov_base = pages[i], .iov_len = page_size };
+
+        ssize_t n = pwritev((int)file, iov, (int)batch, (off_t)offset);
+        if (n <= 0) error(fs);
+
+        u32 pages_written = (u32)((u64)n / page_size);
+        u32 remainder     = (u32)((u64)n % page_size);
+
+        // Finish a partially written page on the slow path.
+        if (remainder) {
+            write_all(fs, file, pages[pages_written] + remainder, page_size - remainder, offset + (u64)n);
+            pages_written++;
+        }
+
+        pages      += pages_written;
+        page_count -= pages_written;
+        offset     += (u64)pages_written * page_size;
+    }
+}
+
+// Map @size bytes of the file read only. The size may go
+// past the end of the file in order to reserve room for
+// growth, but touching the part beyond the end is an error.
+u8 *fs_map_file (Files *fs, File file, u64 size) {
+    void *result = mmap(NULL, size, PROT_READ, MAP_SHARED, (int)file, 0);
+    if (result == MAP_FAILED) error(fs);
+    return result;
+}
+
+void fs_unmap_file (Files *fs, u8 *base, u64 size) {
+    if (munmap(base, size)) error(fs);
+}
+
+// Make sure that the disk blocks for the given range are
+// allocated. The file size grows if the range goes past it.
+void fs_preallocate (Files *fs, File file, u64 offset, u64 amount) {
+    if (posix_fallocate((int)file, (off_t)offset, (off_t)amount)) error(fs);
+}
+
+// Grow the file to the given size without allocating disk
+// blocks for the new range, which reads as zeros. A file that
+// is already as big is left alone.
+void fs_extend_file (Files *fs, File file, u64 size) {
+    if (fs_get_file_size(fs, file) >= size) return;
+    if (ftruncate((int)file, (off_t)size)) error(fs);
+}
+
+// Release the disk blocks backing the given range. The range
+// reads as zeros afterwards and the file size doesn't change.
+// This is only a hint, so filesystems that don't support it
+// are silently ignored.
+void fs_punch_hole (Files *fs, File file, u64 offset, u64 amount) {
+    syscall(SYS_fallocate, (int)file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)amount);
+}
+
+static u64 now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+// Block until the data written to the file so far is on
+// stable storage.
+void fs_sync (Files *fs, File file) {
+    u64 start = now_ns();
+    if (fdatasync((int)file)) error(fs);
+    u64 elapsed = now_ns() - start;
+
+    fs->syncs.count++;
+    fs->syncs.total_ns += elapsed;
+    fs->syncs.max_ns = MAX(fs->syncs.max_ns, elapsed);
+}
+
+void fs_get_sync_stats (Files *fs, Fs_Sync_Stats *out) {
+    *out = fs->syncs;
+}
+
+// Tell the kernel that we are about to read the given range
+// so it can start reading it into the page cache in the
+// background. This is only a hint, so failures are ignored.
+void fs_prefetch (Files *fs, File file, u64 offset, u64 amount) {
+    posix_fadvise((int)file, (off_t)offset, (off_t)amount, POSIX_FADV_WILLNEED);
+}
+
+// Returns false if async I/O is not supported on this system
+// in which case the fs_async_* functions must not be used.
+bool fs_async_init (Files *fs) {
+    if (fs->async.ring) return true;
+
+    fs->async.ring = uring_new(fs->mem, ASYNC_QUEUE_DEPTH);
+    if (! fs->async.ring) return false;
+
+    fs->async.requests = MEM_ALLOC_Z(fs->mem, ASYNC_QUEUE_DEPTH * sizeof(Async_Request));
+    array_init(&fs->async.free, fs->mem);
+    array_init(&fs->async.done, fs->mem);
+    for (u32 i = 0; i < ASYNC_QUEUE_DEPTH; ++i) array_add(&fs->async.free, &fs->async.requests[i]);
+
+    return true;
+}
+
+bool fs_async_enabled (Files *fs) {
+    return fs->async.ring != NULL;
+}
+
+// Short transfers are finished off with blocking I/O.
+static void *async_complete (Files *fs, Async_Request *req, s32 result) {
+    if (result < 0) error(fs);
+    if (result == 0 && req->amount) error(fs);
+
+    u32 done = (u32)result;
+
+    if (done < req->amount) {
+        if (req->write) write_all(fs, req->file, req->buf + done, req->amount - done, req->offset + done);
+        else            read_all(fs, req->file, req->buf + done, req->amount - done, req->offset + done);
+    }
+
+    array_add(&fs->async.free, req);
+    return req->tag;
+}
+
+static void *async_reap (Files *fs) {
+    u64 user_data;
+    s32 result;
+    uring_wait(fs->async.ring, &user_data, &result);
+    return async_complete(fs, (Async_Request*)(uintptr_t)user_data, result);
+}
+
+static void async_queue (Files *fs, Async_Request request) {
+    if (! fs->async.free.count) array_add(&fs->async.done, async_reap(fs));
+
+    Async_Request *req = array_get_last(&fs->async.free);
+    fs->async.free.count--;
+    *req = request;
+
+    bool queued = req->write ?
+                  uring_queue_write(fs->async.ring, (int)req->file, req->buf, req->amount, req->offset, (u64)(uintptr_t)req) :
+                  uring_queue_read(fs->async.ring, (int)req->file, req->buf, req->amount, req->offset, (u64)(uintptr_t)req);
+    ASSERT(queued);
+}
+
+// The request is only queued. It gets submitted to the kernel
+// on fs_async_submit() or fs_async_wait(). The buffer must
+// stay alive until the tag is returned by fs_async_wait().
+void fs_async_read (Files *fs, File file, u64 offset, u32 amount, u8 *out, void *tag) {
+    async_queue(fs, (Async_Request){ .file = file, .write = false, .buf = out, .amount = amount, .offset = offset, .tag = tag });
+}
+
+void fs_async_write (Files *fs, File file, u64 offset, u32 amount, u8 *buf, void *tag) {
+    async_queue(fs, (Async_Request){ .file = file, .write = true, .buf = buf, .amount = amount, .offset = offset, .tag = tag });
+}
+
+void fs_async_submit (Files *fs) {
+    uring_submit(fs->async.ring);
+}
+
+// Block until one of the requests completes and return it's
+// tag. Returns NULL if there are no requests in flight.
+void *fs_async_wait (Files *fs) {
+    if (fs->async.done.count) {
+        void *tag = array_get_last(&fs->async.done);
+        fs->async.done.count--;
+        return tag;
     }
 
+    if (! uring_in_flight(fs->async.ring)) return NULL;
+    return async_reap(fs);
+}
+
+// Like fs_async_wait() but returns NULL instead of blocking
+// if none of the requests in flight has completed yet.
+void *fs_async_poll (Files *fs) {
+    if (fs->async.done.count) return fs_async_wait(fs);
+
+    u64 user_data;
+    s32 result;
+    if (! uring_peek(fs->async.ring, &user_data, &result)) return NULL;
+    return async_complete(fs, (Async_Request*)(uintptr_t)user_data, result);
+}
+
+void fs_overwrite_file (Files *fs, File file, String payload) {
+    if (ftruncate((int)file, 0)) error(fs);
     fs_append_to_file(fs, file, payload);
 }
 
 void fs_read_from_file (Files *fs, File file, u64 offset, u32 amount, u8 *out) {
-    seek(fs, file, offset);
-    size_t n_read = fread(out, 1, amount, (FILE*)file);
-    if (n_read != amount) error(fs);
+    read_all(fs, file, out, amount, offset);
 }
 
 String fs_read_from_file_mem (Files *fs, File file, u64 offset, u32 amount, Mem *mem) {
     char *buf = MEM_ALLOC(mem, amount);
-    seek(fs, file, offset);
-    size_t n_read = fread(buf, 1, amount, (FILE*)file);
-    if (n_read != amount) error(fs);
+    read_all(fs, file, (u8*)buf, amount, offset);
     return (String){ buf, amount };
 }
 
 String fs_read_entire_file (Files *fs, File file, Mem *mem) {
     u64 size = fs_get_file_size(fs, file);
-    if (size > UINT32_MAX) error(fs); // TODO: Not clear why we do this.
+    if (size > UINT32_MAX) error(fs); // A String can hold at most UINT32_MAX bytes.
     return fs_read_from_file_mem(fs, file, 0, (u32)size, mem);
 }
 
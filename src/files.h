@@ -7,17 +7,42 @@
 typedef intptr_t File;
 typedef struct Files Files;
 
+typedef struct {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+} Fs_Sync_Stats;
+
 Files *fs_new                  (Mem *);
 void   fs_destroy              (Files *);
 File   fs_open_file            (Files *, String path);
+bool   fs_is_memory_path       (String path);
+bool   fs_file_exists          (Files *, String path);
+void   fs_delete_file          (Files *, String path);
 void   fs_create_file          (Files *, String path);
 void   fs_close_file           (Files *, File);
 String fs_get_file_path        (Files *, File);
 u64    fs_get_file_size        (Files *, File);
 void   fs_append_to_file       (Files *, File, String);
 void   fs_write_to_file        (Files *, File, String, u64 offset);
+void   fs_writev_pages         (Files *, File, u64 offset, u8 **pages, u32 page_count, u32 page_size);
 void   fs_overwrite_file       (Files *, File, String);
 void   fs_read_from_file       (Files *, File, u64 offset, u32 amount, u8 *out);
+void   fs_prefetch             (Files *, File, u64 offset, u64 amount);
+void   fs_preallocate          (Files *, File, u64 offset, u64 amount);
+void   fs_extend_file          (Files *, File, u64 size);
+void   fs_punch_hole           (Files *, File, u64 offset, u64 amount);
+void   fs_sync                 (Files *, File);
+void   fs_get_sync_stats       (Files *, Fs_Sync_Stats *out);
+bool   fs_async_init           (Files *);
+bool   fs_async_enabled        (Files *);
+void   fs_async_read           (Files *, File, u64 offset, u32 amount, u8 *out, void *tag);
+void   fs_async_write          (Files *, File, u64 offset, u32 amount, u8 *buf, void *tag);
+void   fs_async_submit         (Files *);
+void  *fs_async_wait           (Files *);
+void  *fs_async_poll           (Files *);
 String fs_read_from_file_mem   (Files *, File, u64 offset, u32 amount, Mem *);
 String fs_read_entire_file     (Files *, File, Mem *);
 String fs_read_entire_file_p   (Files *, String path, Mem *);
+u8    *fs_map_file             (Files *, File, u64 size);
+void   fs_unmap_file           (Files *, u8 *base, u64 size);
@@ -35,6 +35,7 @@
     X(BOOL, Bool, bool)\
     X(TRUE, True, true)\
     X(FALSE, False, false)\
+    X(BEGIN, Begin, begin)\
     X(CROSS, Cross, cross)\
     X(INNER, Inner, inner)\
     X(TABLE, Table, table)\
@@ -43,6 +44,7 @@
     X(WHERE, Where, where)\
     X(LIMIT, Limit, limit)\
     X(UPDATE, Update, update)\
+    X(COMMIT, Commit, commit)\
     X(OFFSET, Offset, offset)\
     X(HAVING, Having, having)\
     X(CREATE, Create, create)\
@@ -50,7 +52,8 @@
     X(DELETE, Delete, delete)\
     X(SELECT, Select, select)\
     X(EXPLAIN, Explain, explain)\
-    X(PRIMARY, Primary, primary)
+    X(PRIMARY, Primary, primary)\
+    X(ROLLBACK, Rollback, rollback)
 
 // X(tag_value, tag, name)
 //
@@ -0,0 +1,150 @@
+#include <string.h>
+
+#include "lz.h"
+#include "error.h"
+
+#define MIN_MATCH     4
+#define HASH_BITS     12
+#define LAST_LITERALS 5 // The tail of the input is always emitted as literals.
+
+// A block is a sequence of these:
+//
+//   token:         1 (high nibble = literal count, low nibble = match length - MIN_MATCH)
+//   literal count: 0+ (extra bytes of 255 while the nibble is 15)
+//   literals:      *
+//   offset:        2 (distance back to the start of the match)
+//   match length:  0+ (extra bytes of 255 while the nibble is 15)
+//
+// The last sequence has only literals and no offset.
+static u32 read_u32 (u8 *p) {
+    u32 result;
+    memcpy(&result, p, 4);
+    return result;
+}
+
+static u32 hash (u32 sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u8 *write_length (u8 *out, u8 *end, u32 length) {
+    for (; length >= 255; length -= 255) {
+        if (out == end) return 0;
+        *out++ = 255;
+    }
+
+    if (out == end) return 0;
+    *out++ = (u8)length;
+    return out;
+}
+
+static u8 *write_sequence (u8 *out, u8 *end, u8 *literals, u32 literal_count, u32 offset, u32 match_length) {
+    if (out == end) return 0;
+
+    u8 *token = out++;
+    *token = (u8)(MIN(literal_count, 15) << 4);
+
+    if (literal_count >= 15 && !(out = write_length(out, end, literal_count - 15))) return 0;
+    if ((u64)(end - out) < literal_count) return 0;
+    memcpy(out, literals, literal_count);
+    out += literal_count;
+
+    if (! match_length) return out;
+
+    if (end - out < 2) return 0;
+    write_u16_le(out, (u16)offset);
+    out += 2;
+
+    u32 length = match_length - MIN_MATCH;
+    *token |= (u8)MIN(length, 15);
+    if (length >= 15 && !(out = write_length(out, end, length - 15))) return 0;
+
+    return out;
+}
+
+u32 lz_compress (u8 *src, u32 src_size, u8 *dst, u32 dst_capacity) {
+    ASSERT(src_size <= UINT16_MAX + 1);
+
+    u16 table [1 << HASH_BITS] = {0};
+    u8 *out     = dst;
+    u8 *out_end = dst + dst_capacity;
+    u32 anchor  = 0; // Start of the pending literals.
+    u32 pos     = 1;
+
+    if (src_size > MIN_MATCH + LAST_LITERALS) {
+        u32 limit = src_size - MIN_MATCH - LAST_LITERALS;
+
+        while (pos < limit) {
+            u32 sequence  = read_u32(src + pos);
+            u32 slot      = hash(sequence);
+            u32 candidate = table[slot];
+            table[slot]   = (u16)pos;
+
+            if (read_u32(src + candidate) != sequence) {
+                pos++;
+                continue;
+            }
+
+            u32 length = MIN_MATCH;
+            while (pos + length < src_size - LAST_LITERALS && src[candidate + length] == src[pos + length]) length++;
+
+            out = write_sequence(out, out_end, src + anchor, pos - anchor, pos - candidate, length);
+            if (! out) return 0;
+
+            pos   += length;
+            anchor = pos;
+        }
+    }
+
+    out = write_sequence(out, out_end, src + anchor, src_size - anchor, 0, 0);
+    return out ? (u32)(out - dst) : 0;
+}
+
+static bool read_length (u8 **in, u8 *end, u32 *length) {
+    u8 byte;
+
+    do {
+        if (*in == end) return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+bool lz_decompress (u8 *src, u32 src_size, u8 *dst, u32 dst_size) {
+    u8 *in      = src;
+    u8 *in_end  = src + src_size;
+    u8 *out     = dst;
+    u8 *out_end = dst + dst_size;
+
+    while (in < in_end) {
+        u8 token = *in++;
+
+        u32 literal_count = token >> 4;
+        if (literal_count == 15 && !read_length(&in, in_end, &literal_count)) return false;
+        if ((u64)(in_end - in) < literal_count || (u64)(out_end - out) < literal_count) return false;
+        memcpy(out, in, literal_count);
+        in  += literal_count;
+        out += literal_count;
+
+        if (in == in_end) break; // The last sequence has no match.
+
+        if (in_end - in < 2) return false;
+        u32 offset = read_u16_le(in);
+        in += 2;
+
+        u32 length = token & 15;
+        if (length == 15 && !read_length(&in, in_end, &length)) return false;
+        length += MIN_MATCH;
+
+        if (offset == 0 || offset > (u64)(out - dst) || (u64)(out_end - out) < length) return false;
+
+        // The match may overlap the bytes it produces, so it is
+        // copied one byte at a time.
+        u8 *match = out - offset;
+        for (u32 i = 0; i < length; ++i) out[i] = match[i];
+        out += length;
+    }
+
+    return out == out_end;
+}
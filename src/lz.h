@@ -0,0 +1,15 @@
+#pragma once
+
+#include "common.h"
+
+// =============================================================================
+// A small LZ77 codec in the style of LZ4 for blocks of up to
+// 64KB. It trades ratio for speed: there is no entropy coding
+// and the match finder remembers a single position per hash.
+//
+// lz_compress() returns 0 if the result doesn't fit into the
+// dst buffer. lz_decompress() returns false if the input is
+// corrupt or doesn't decompress to exactly dst_size bytes.
+// =============================================================================
+u32  lz_compress   (u8 *src, u32 src_size, u8 *dst, u32 dst_capacity);
+bool lz_decompress (u8 *src, u32 src_size, u8 *dst, u32 dst_size);
@@ -138,3 +138,4 @@ void map_init##S (Map##S *map, Mem *mem) {                                     \
 // Generate common implementations:
 // =============================================================================
 MAP_IMPL(_u32_Ptr, u32, void*, return(K1 == K2), return(K))
+MAP_IMPL(_u32_u32, u32, u32, return(K1 == K2), return(K))
@@ -42,6 +42,7 @@ bool map_get##S      (Map##S *, Key, Val *);
 // Generate common map types:
 // =============================================================================
 MAP_DECL(_u32_Ptr, u32, void*)
+MAP_DECL(_u32_u32, u32, u32)
 
 // =============================================================================
 // The following are map methods that do not have to use the
@@ -50,7 +51,8 @@ MAP_DECL(_u32_Ptr, u32, void*)
 // in the "common.h" header.
 // =============================================================================
 #define MAP_DISPATCH(OP, map, ...) _Generic((map),                             \
-    Map_u32_Ptr *: map_##OP##_u32_Ptr                                          \
+    Map_u32_Ptr *: map_##OP##_u32_Ptr,                                         \
+    Map_u32_u32 *: map_##OP##_u32_u32                                          \
 )(map, __VA_ARGS__)
 
 #define map_init_cap(map, mem, cap) MAP_DISPATCH(init_cap, map, mem, cap)
@@ -1,79 +1,322 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "pager.h"
 #include "array.h"
+#include "wal.h"
+#include "crc.h"
+#include "lz.h"
+#include "writer.h"
 
-#define PAGE_SIZE             8*KB
+#define DEFAULT_PAGE_SIZE     (8*KB)
 #define MIN_PAGE_SIZE         512
-#define CACHE_SIZE            1024
+#define MAX_PAGE_SIZE         (32*KB) // The engine addresses cells within a page with a u16.
+#define DEFAULT_CACHE_SIZE    1024
+#define MIN_CACHE_SIZE        16
+#define MAX_PAGE_COUNT        UINT32_MAX // So the max file size is MAX_PAGE_COUNT * page size.
+#define DEFAULT_EXTENT_SIZE   (1*MB)
+#define EXTENT_GROWTH_PERCENT 1
 #define FILE_HEADER_SIZE      64
 #define FILE_HEADER_TITLE     "My custom database."
+#define FILE_HEADER_MAGIC     0x31444d43 // Marks a header with the fields after free_page.
 #define PSIZE                 (pager->header.page_size)
-#define NEXT_FREE_PAGE_OFFSET (PSIZE - 4)
+#define CHECKSUM_SIZE         4
+#define STORED_HEADER_SIZE    4
+#define STORED_SIZE           (PSIZE - (pager->header.page_compression ? STORED_HEADER_SIZE : 0)) // Bytes of a page that are written to disk.
+#define CHECKSUM_OFFSET       (STORED_SIZE - CHECKSUM_SIZE)
+#define USABLE_SIZE           (STORED_SIZE - (pager->header.page_checksums ? CHECKSUM_SIZE : 0))
+#define CHECKSUM_SAMPLE_RATE  16 // With PAGER_VERIFY_SAMPLED every n-th load is verified.
+#define HOLE_GRANULARITY      (4*KB) // Filesystems free the space of a hole in blocks of this size.
+#define CODEC_NONE            0
+#define CODEC_LZ              1
+#define FILE_FLAG_CHECKSUMS   FLAG(0)
+#define FILE_FLAG_COMPRESSION FLAG(1)
+#define NEXT_FREE_PAGE_OFFSET (PSIZE - 4) // Only used by the legacy free list.
+#define NEXT_BITMAP_OFFSET    (USABLE_SIZE - 4)
+#define BITS_PER_BITMAP       ((USABLE_SIZE - 4) * 8)
+#define CLEAN_AHEAD_BATCH     8 // Max pages the cleaner writes per round.
+#define CLEAN_AHEAD_WINDOW    32 // Max pages the cleaner looks at per list and round.
+#define CLEAN_AHEAD_BACKOFF   1024 // Max evictions between rounds.
+#define MMAP_HEADROOM         (1ull*GB)
+#define WAL_CHECKPOINT_PAGES  1000
+#define MAP_MAX_LOAD_PERCENT  50
+#define WARM_UP_MAGIC         0x544f4850
+#define WARM_UP_HEADER_SIZE   12
 
 typedef struct Page Page;
-typedef Array_View(Page) Array_View_Page;
+typedef struct Ghost Ghost;
 
 struct Page {
     Page_Ref ref; // Keep this the first field.
 
+    // A page with a mutable ref has exactly one ref. Once that
+    // ref is dropped the page stays dirty until it gets written
+    // back to disk either when it's evicted or on pager_flush().
     #define F_PAGE_HAS_MUTABLE_REF FLAG(0)
+    #define F_PAGE_IS_DIRTY        FLAG(1)
+
+    // The ref.buf points into the memory mapping of the db file
+    // rather than into the frame. The mapping is read only, so
+    // the page is copied into the frame once it becomes mutable.
+    #define F_PAGE_IS_MAPPED       FLAG(2)
+
+    // The page is in the cache.lru list (or one of the priority
+    // lists) rather than in the cache.a1in list. With the LRU
+    // policy every page is hot.
+    #define F_PAGE_IS_HOT          FLAG(3)
+
+    // With async I/O prefetched pages are read into unreferenced
+    // cache slots. While the read is in flight the page cannot be
+    // used or evicted. The first hit on a prefetched page doesn't
+    // count as a re-reference for the replacement policy.
+    #define F_PAGE_IS_LOADING      FLAG(4)
+    #define F_PAGE_IS_PREFETCHED   FLAG(5)
+
+    // The cleaner is writing the page back. Like a loading page
+    // it cannot be evicted and it's buffer must not change, so
+    // making it mutable waits for the write to complete.
+    #define F_PAGE_IS_WRITING      FLAG(6)
+
+    // See pager_set_priority(). Such a page is always hot and
+    // lives in the cache.high or cache.pinned list.
+    #define F_PAGE_IS_HIGH         FLAG(7)
+    #define F_PAGE_IS_PINNED       FLAG(8)
 
     u32 flags;
     u32 ref_count;
-    Page *map_next;
+    u8 *frame; // This cache slot's own page buffer. Allocated together with the Page.
     Page *lru_next;
     Page *lru_prev;
 };
 
+// Id of a page recently evicted from the cache.a1in list.
+// An id of 0 marks an unused entry.
+struct Ghost {
+    Page_Id id;
+    Ghost *map_next;
+};
+
 struct Pager {
     Mem *mem;
     Files *fs;
     File db_file;
+    Pager_Sync sync;
+    bool has_unsynced_writes; // The db file was written to since the last sync.
+    bool warm_up; // See pager_warm_up().
+
+    // The file grows in extents that are preallocated on disk.
+    // The db_file_page_count is the logical number of pages in
+    // use and db_file_capacity is the number of pages that fit
+    // in the file. New pages are handed out from the tail.
     u32 db_file_page_count;
+    u32 db_file_capacity;
+    u32 extent_size; // In pages. The file grows by at least this much.
 
     struct {
+        bool is_dirty; // Written back on pager_flush().
         u16 page_size;
 
-        // This is a linked list of free pages. In each page
-        // the Page_Id of the next page in the list is stored
-        // at offset NEXT_FREE_PAGE_OFFSET. The value 0 is used
-        // to indicate that there is no free page available.
+        // Every page except the header page ends with a CRC-32C
+        // of the rest of the page. The engine only gets to see
+        // the USABLE_SIZE bytes in front of it.
+        bool page_checksums;
+
+        // Every page except the header page is compressed when it
+        // gets written into the db file. See page_store().
+        bool page_compression;
+
+        // Older versions kept free pages in a linked list. In
+        // each page the Page_Id of the next page in the list is
+        // stored at offset NEXT_FREE_PAGE_OFFSET. The value 0 is
+        // used to indicate the end of the list. Such a list gets
+        // moved into the bitmap the first time it's needed.
         Page_Id free_page;
+
+        Page_Id first_bitmap;
     } header;
 
+    // Free pages are tracked in a chain of bitmap pages. The
+    // k-th bitmap has one bit for each of the pages in the range
+    // [k*BITS_PER_BITMAP, (k+1)*BITS_PER_BITMAP) and the id of
+    // the next bitmap at NEXT_BITMAP_OFFSET. A set bit means the
+    // page is free. Bitmaps are regular cached pages so updates
+    // are written back lazily like any other page.
     struct {
-        u32 count;
-        u32 capacity;
+        bool is_loaded; // The chain is read on first use.
+        Page_Id lowest_free; // There are no free pages below this id.
+        Array(Page_Id) pages;
+    } bitmap;
 
-        Page **map; // Chained hash table mapping Page_Id to Page*. (length: cache.capacity)
-        Page *pages; // Array of Page. (length: cache.capacity)
-        u8 *raw_pages; // Array of page buffers read from disk. (length: cache.capacity)
-        u8 *user_buffers; // Array of user buffers (1 per page). (length: cache.capacity)
+    // Cache slots are allocated on demand as a single block
+    // holding the Page, the page buffer and the user buffer.
+    // Slots never move, so the capacity can change at runtime
+    // while refs are held. If the capacity is lowered below the
+    // number of referenced slots, they are freed once unrefed.
+    //
+    // With the 2Q policy a page that is not in the cache goes
+    // into the a1in FIFO. When it gets evicted from there its
+    // id is remembered in the ghosts FIFO. Only pages that get
+    // hit again, either while in a1in or while their id is still
+    // a ghost, go into the lru list. That way a single scan over
+    // a big table cannot push the hot inner nodes out of the
+    // cache.
+    struct {
+        Pager_Cache_Policy policy;
+        u32 capacity;
+        u32 a1in_capacity;
+        u32 hot_count; // Number of pages in the lru and priority lists.
+        u32 priority_count; // Number of pages in the priority lists.
         u32 user_buffer_size;
 
-        // This is a sentinel node in the LRU circular doubly linked
-        // list. This node's lru_next is the most recently used (MRU)
-        // page. It's lru_prev is the least recently used (LRU) page.
-        // In case the LRU linked list is empty this node will point
-        // to itself: (lru.lru_next == lru) and (lru.lru_prev == lru).
+        // Open addressing table with linear probing mapping Page_Id
+        // to Page*. The capacity is a power of two that only depends
+        // on the number of pages in the table, and the index comes
+        // from a multiplicative hash (see map_home()). An entry is
+        // just the Page*, so a probe reads the id from the Page,
+        // which a hit has to load anyway. Since the cache can grow
+        // past it's capacity during transactions the table grows on
+        // its own when it gets too full.
+        Page **map; // (length: cache.map_capacity)
+        u32 map_capacity;
+        u32 map_count;
+        u32 map_shift; // 32 - log2(map_capacity)
+
+        Array(Page*) slots; // All allocated cache slots.
+
+        // These are sentinel nodes of circular doubly linked lists.
+        // The sentinel's lru_next is the most recently added page
+        // and it's lru_prev is the next eviction candidate. In case
+        // a list is empty the sentinel points to itself. All pages
+        // are in one of the lists including the referenced ones.
         Page lru;
+        Page a1in;
+
+        // Pages with a raised priority. Both lists are ordered like
+        // the lru list but they're only evicted from once the other
+        // lists have no unreferenced pages left. The high list goes
+        // first once the priority pages take up more than half the
+        // cache, so that normal pages always have room.
+        Page high;
+        Page pinned;
+
+        struct {
+            u32 capacity;
+            u32 head; // Index of the oldest entry in the ring.
+            Ghost *ring;
+            Ghost **map; // Chained hash table mapping Page_Id to Ghost*. (length: ghosts.capacity)
+        } ghosts;
     } cache;
+
+    Pager_Stats stats;
+    u32 writes_in_flight; // Async writes issued by pager_flush() or the cleaner.
+
+    // The dirty pages near the tail of the cache lists are written
+    // back ahead of time by a background thread. That way evictions
+    // find clean victims and the query doesn't wait on the write.
+    // The cleaner is off during transactions and in wal mode, where
+    // evicted pages are appended to the log anyway, and for files
+    // with compressed pages.
+    struct {
+        u32 percent; // Of each list's tail that is kept clean. (0 = off)
+        Array(Page*) batch; // The pages picked in the current round.
+        u64 bytes_per_sec; // (0 = unlimited)
+        u32 countdown; // Evictions until the next round.
+        u32 backoff; // Extra evictions between rounds while the writer gets no cpu.
+        Writer *writer; // Started by the first round.
+    } cleaner;
+
+    struct {
+        Pager_Verify mode;
+        u32 loads; // For PAGER_VERIFY_SAMPLED.
+        Array(u8) verified; // Bit per page for PAGER_VERIFY_FIRST_LOAD.
+    } verify;
+
+    // In wal mode pages are never written into the db file
+    // directly. Evicted and flushed pages are appended to the
+    // log and pager_flush() commits them. The log is copied
+    // into the db file once it holds WAL_CHECKPOINT_PAGES frames.
+    struct {
+        Wal *log;
+        bool has_uncommitted; // Frames appended since the last commit.
+        u8 *scratch; // A page sized buffer.
+    } wal;
+
+    // Page sized buffers used to convert between the stored form
+    // of a page in a compressed db file and the page itself.
+    struct {
+        u8 *stored;
+        u8 *scratch;
+    } compression;
+
+    // A transaction always goes through the log. Without the wal
+    // pager_begin() opens one and the commit checkpoints and deletes
+    // it again, so the commit is atomic either way. During the
+    // transaction pager_flush() does nothing and evicted dirty pages
+    // are appended to the log as uncommitted frames, which keeps the
+    // cache within its capacity. A rollback drops those frames and
+    // the dirty pages. The header fields are saved so that they can
+    // be restored too.
+    struct {
+        bool active;
+        bool owns_log; // The log was opened by pager_begin().
+        u32 page_count;
+        Page_Id free_page;
+        Page_Id first_bitmap;
+    } txn;
+
+    // When the pager is in mmap mode the db file is mapped at
+    // base. We reserve more address space than the size of the
+    // file so that pages appended later are covered too. Only
+    // the part of the mapping that is backed by the file may be
+    // touched, the rest of it raises SIGBUS. Pages beyond the
+    // file or the mapping are read into the cache as usual.
+    struct {
+        u8 *base;
+        u64 size;
+    } mmap;
 };
 
-static void header_default_init (Pager *pager) {
-    pager->header.page_size = PAGE_SIZE;
-}
+static bool reap (Pager *);
+static void extend_file (Pager *, u64 from, u64 to);
 
-static void header_write_to_disk (Pager *pager) {
-    u8 buf[FILE_HEADER_SIZE];
+// A page that is no bigger than one block of the file can't take
+// less space on disk, so small pages are never compressed. See
+// page_compress().
+static void header_default_init (Pager *pager, Pager_Options *options) {
+    pager->header.page_size = options->page_size ? options->page_size : DEFAULT_PAGE_SIZE;
+    pager->header.page_checksums = options->checksums;
+    pager->header.page_compression = options->compression && (pager->header.page_size > HOLE_GRANULARITY);
+}
 
+// Header byte layout:
+//   title:        19
+//   page_size:    2
+//   free_page:    4
+//   magic:        4
+//   page_count:   4
+//   first_bitmap: 4
+//   flags:        4
+//
+// Older versions didn't initialize the bytes after free_page,
+// so the remaining fields are only valid if the magic matches.
+static void header_encode (Pager *pager, u8 *buf) {
+    memset(buf, 0, FILE_HEADER_SIZE);
     memcpy(buf, FILE_HEADER_TITLE, 19);
     write_u16_le(buf + 19, PSIZE);
     write_u32_le(buf + 21, pager->header.free_page);
+    write_u32_le(buf + 25, FILE_HEADER_MAGIC);
+    write_u32_le(buf + 29, pager->db_file_page_count);
+    write_u32_le(buf + 33, pager->header.first_bitmap);
+    write_u32_le(buf + 37, (pager->header.page_checksums ? FILE_FLAG_CHECKSUMS : 0) | (pager->header.page_compression ? FILE_FLAG_COMPRESSION : 0));
+}
 
+static void header_write_to_disk (Pager *pager) {
+    u8 buf[FILE_HEADER_SIZE];
+    header_encode(pager, buf);
     String str = { .data = (char*)buf, .count = FILE_HEADER_SIZE };
     fs_write_to_file(pager->fs, pager->db_file, str, 0);
+    pager->header.is_dirty = false;
+    pager->has_unsynced_writes = true;
 }
 
 static void header_read_from_disk (Pager *pager) {
@@ -82,46 +325,187 @@ static void header_read_from_disk (Pager *pager) {
 
     pager->header.page_size = read_u16_le(buf + 19);
     pager->header.free_page = read_u32_le(buf + 21);
+
+    if (read_u32_le(buf + 25) == FILE_HEADER_MAGIC) {
+        pager->db_file_page_count = read_u32_le(buf + 29);
+        pager->header.first_bitmap = read_u32_le(buf + 33);
+        pager->header.page_checksums = read_u32_le(buf + 37) & FILE_FLAG_CHECKSUMS;
+        pager->header.page_compression = read_u32_le(buf + 37) & FILE_FLAG_COMPRESSION;
+    }
 }
 
-static void init_page_cache (Pager *pager) {
-    pager->cache.capacity     = CACHE_SIZE;
-    pager->cache.raw_pages    = MEM_ALLOC(pager->mem, pager->cache.capacity * PSIZE);
-    pager->cache.pages        = MEM_ALLOC(pager->mem, pager->cache.capacity * sizeof(Page));
-    pager->cache.map          = MEM_ALLOC_Z(pager->mem, pager->cache.capacity * sizeof(void*));
-    pager->cache.lru.lru_next = &pager->cache.lru;
-    pager->cache.lru.lru_prev = &pager->cache.lru;
+bool pager_is_valid_page_size (u32 size) {
+    return (size >= MIN_PAGE_SIZE) && (size <= MAX_PAGE_SIZE) && !(size & (size - 1));
 }
 
-Pager *pager_new (Files *fs, Mem *mem, String db_file_path) {
+static void init_page_cache (Pager *pager, Pager_Options *options) {
+    array_init(&pager->cache.slots, pager->mem);
+    pager->cache.policy = options->cache_policy;
+    pager->cache.lru.lru_next  = &pager->cache.lru;
+    pager->cache.lru.lru_prev  = &pager->cache.lru;
+    pager->cache.a1in.lru_next = &pager->cache.a1in;
+    pager->cache.a1in.lru_prev = &pager->cache.a1in;
+    pager->cache.high.lru_next = &pager->cache.high;
+    pager->cache.high.lru_prev = &pager->cache.high;
+    pager->cache.pinned.lru_next = &pager->cache.pinned;
+    pager->cache.pinned.lru_prev = &pager->cache.pinned;
+
+    u32 capacity = DEFAULT_CACHE_SIZE;
+    if (options->cache_size) capacity = options->cache_size;
+    else if (options->cache_size_bytes) capacity = (u32)MIN(options->cache_size_bytes / PSIZE, UINT32_MAX);
+
+    pager_set_cache_size(pager, capacity);
+}
+
+// Check the header of an existing db file against it's size.
+static bool file_is_valid (Pager *pager, u64 file_size) {
+    if (! pager_is_valid_page_size(PSIZE)) return false;
+    if (file_size % PSIZE) return false;
+    if (file_size / PSIZE > MAX_PAGE_COUNT) return false;
+
+    pager->db_file_capacity = (u32)(file_size / PSIZE);
+    if (! pager->db_file_page_count) pager->db_file_page_count = pager->db_file_capacity;
+
+    return pager->db_file_page_count <= pager->db_file_capacity;
+}
+
+static void wal_init (Pager *pager, String db_file_path) {
+    pager->wal.log     = wal_open(pager->fs, pager->mem, db_file_path, PSIZE, pager->sync != PAGER_SYNC_OFF);
+    pager->wal.scratch = MEM_ALLOC(pager->mem, PSIZE);
+}
+
+static void wal_deinit (Pager *pager) {
+    wal_close(pager->wal.log);
+    MEM_FREE(pager->mem, pager->wal.scratch, PSIZE);
+    pager->wal.log = NULL;
+}
+
+// A log that was only opened for a transaction or to recover
+// one (see pager_begin()) is deleted once it's done, or every
+// later open of the db file would find it and checkpoint it.
+static void wal_deinit_and_delete (Pager *pager) {
+    wal_deinit(pager);
+    wal_delete(pager->fs, pager->mem, fs_get_file_path(pager->fs, pager->db_file));
+}
+
+static bool in_wal (Pager *pager, Page_Id id) {
+    return pager->wal.log && wal_has_page(pager->wal.log, id);
+}
+
+static void compression_init (Pager *pager) {
+    if (! pager->header.page_compression) return;
+    pager->compression.stored  = MEM_ALLOC(pager->mem, PSIZE);
+    pager->compression.scratch = MEM_ALLOC(pager->mem, PSIZE);
+}
+
+static void compression_deinit (Pager *pager) {
+    if (! pager->compression.stored) return;
+    MEM_FREE(pager->mem, pager->compression.stored, PSIZE);
+    MEM_FREE(pager->mem, pager->compression.scratch, PSIZE);
+    pager->compression.stored = NULL;
+}
+
+static void checkpoint (Pager *pager);
+
+// Returns NULL if the db file is corrupt or too big.
+//
+// A log left behind by a crash is checkpointed right away, so
+// the db file is up to date once we get to reading the header.
+// Without the wal such a log comes from a transaction, see
+// pager_begin().
+Pager *pager_new (Files *fs, Mem *mem, String db_file_path, Pager_Options *options) {
     Pager *pager   = MEM_ALLOC_Z(mem, sizeof(Pager));
     pager->mem     = mem;
     pager->fs      = fs;
+    pager->sync    = options->sync;
+    pager->warm_up = options->warm_up;
+    pager->cleaner.percent = MIN(options->clean_ahead, 100);
+    pager->cleaner.bytes_per_sec = options->clean_ahead_rate;
+    array_init(&pager->cleaner.batch, mem);
+    pager->verify.mode = options->verify;
+    array_init(&pager->verify.verified, mem);
     pager->db_file = fs_open_file(fs, db_file_path);
 
     u64 file_size = fs_get_file_size(fs, pager->db_file);
 
     if (file_size < MIN_PAGE_SIZE) { // The db file is uninitialized.
-        header_default_init(pager);
-        init_page_cache(pager);
-        header_write_to_disk(pager);
+        header_default_init(pager, options);
+        compression_init(pager);
+        init_page_cache(pager, options);
         pager->db_file_page_count = 1;
+        pager->db_file_capacity = 1; // The rest of the header page is not used.
+        header_write_to_disk(pager);
+
+        if (options->wal || wal_exists(fs, mem, db_file_path)) {
+            wal_init(pager, db_file_path);
+            wal_reset(pager->wal.log); // A stale log doesn't belong to this file.
+            if (! options->wal) wal_deinit_and_delete(pager);
+        }
     } else {
         header_read_from_disk(pager);
-        init_page_cache(pager);
-        ASSERT(file_size < UINT32_MAX); // TODO: This should be an exception.
-        ASSERT((file_size % PSIZE) == 0); // TODO: This should be an exception.
-        pager->db_file_page_count = (u32)file_size / PSIZE;
+        if (pager_is_valid_page_size(PSIZE)) compression_init(pager);
+
+        if ((options->wal || wal_exists(fs, mem, db_file_path)) && pager_is_valid_page_size(PSIZE)) {
+            wal_init(pager, db_file_path);
+            checkpoint(pager);
+            header_read_from_disk(pager);
+
+            // The preallocated tail of the file may not have
+            // survived the crash, unlike the logged header.
+            u64 size_in_header = (u64)pager->db_file_page_count * PSIZE;
+            if (size_in_header > file_size) extend_file(pager, file_size, size_in_header);
+            file_size = fs_get_file_size(fs, pager->db_file);
+            if (! options->wal) wal_deinit_and_delete(pager);
+        }
+
+        if (! file_is_valid(pager, file_size)) {
+            if (pager->wal.log) wal_deinit(pager);
+            compression_deinit(pager);
+            fs_close_file(fs, pager->db_file);
+            MEM_FREE(mem, pager, sizeof(Pager));
+            return NULL;
+        }
+
+        init_page_cache(pager, options);
+    }
+
+    pager->extent_size = (u32)MAX((options->extent_size ? options->extent_size : DEFAULT_EXTENT_SIZE) / PSIZE, 1);
+
+    if (options->mmap) {
+        pager->mmap.size = (u64)pager->db_file_page_count * PSIZE + MMAP_HEADROOM;
+        pager->mmap.base = fs_map_file(pager->fs, pager->db_file, pager->mmap.size);
     }
 
     return pager;
 }
 
-static void lru_add (Pager *pager, Page *page) {
-    page->lru_next            = pager->cache.lru.lru_next;
-    pager->cache.lru.lru_next = page;
-    page->lru_prev            = &pager->cache.lru;
-    page->lru_next->lru_prev  = page;
+static void warm_up_save (Pager *pager);
+
+// An active transaction is rolled back.
+void pager_close (Pager *pager) {
+    pager_rollback(pager);
+    while (reap(pager));
+    if (pager->cleaner.writer) writer_destroy(pager->cleaner.writer);
+    pager->cleaner.writer = NULL;
+    pager_flush(pager);
+    if (pager->warm_up) warm_up_save(pager);
+
+    if (pager->wal.log) {
+        checkpoint(pager);
+        wal_deinit(pager);
+    }
+
+    compression_deinit(pager);
+
+    if (pager->mmap.base) fs_unmap_file(pager->fs, pager->mmap.base, pager->mmap.size);
+    pager->mmap.base = NULL;
+}
+
+static void lru_add (Page *list, Page *page) {
+    page->lru_next           = list->lru_next;
+    list->lru_next           = page;
+    page->lru_prev           = list;
+    page->lru_next->lru_prev = page;
 }
 
 static void lru_remove (Page *page) {
@@ -129,83 +513,753 @@ static void lru_remove (Page *page) {
     page->lru_next->lru_prev = page->lru_prev;
 }
 
-static void decrement_ref_count (Pager *pager, Page *page) {
-    ASSERT(page->ref_count > 0);
-    page->ref_count--;
-    if (page->ref_count == 0) lru_add(pager, page);
+// Ids are hashed in groups of 8 consecutive ones, which keep
+// their order in the table. The group index is taken from the
+// top bits of a multiplicative (Fibonacci) hash, so the table
+// needs at least 8 entries. Dense ids then fill whole groups,
+// and a scan over consecutive pages reads the table one cache
+// line at a time instead of at a random place for every page.
+static u32 map_home (Pager *pager, Page_Id id) {
+    u32 group = ((id / 8) * 2654435761u) >> (pager->cache.map_shift + 3);
+    return group * 8 + id % 8;
 }
 
-static Page **map_get_slot (Pager *pager, Page_Id id) {
-    return &pager->cache.map[id % pager->cache.capacity];
+static Page *map_get (Pager *pager, Page_Id id) {
+    u32 mask = pager->cache.map_capacity - 1;
+
+    for (u32 idx = map_home(pager, id);; idx = (idx + 1) & mask) {
+        Page *page = pager->cache.map[idx];
+        if (! page) return NULL;
+        if (page->ref.id == id) return page;
+    }
 }
 
-static Page *map_get (Pager *pager, Page_Id id) {
-    Page *slot = *map_get_slot(pager, id);
-    while (slot && slot->ref.id != id) slot = slot->map_next;
-    return slot;
+static void map_insert (Pager *pager, Page *page) {
+    u32 mask = pager->cache.map_capacity - 1;
+    u32 idx  = map_home(pager, page->ref.id);
+    while (pager->cache.map[idx]) idx = (idx + 1) & mask;
+    pager->cache.map[idx] = page;
+    pager->cache.map_count++;
+}
+
+// The capacity is the smallest power of two that keeps the
+// load below MAP_MAX_LOAD_PERCENT with the given page count.
+static void map_resize (Pager *pager, u32 page_count) {
+    u32 capacity = 16;
+    while ((u64)capacity * MAP_MAX_LOAD_PERCENT / 100 <= page_count) capacity *= 2;
+
+    Page **old_map   = pager->cache.map;
+    u32 old_capacity   = pager->cache.map_capacity;
+
+    pager->cache.map          = MEM_ALLOC_Z(pager->mem, capacity * sizeof(Page*));
+    pager->cache.map_capacity = capacity;
+    pager->cache.map_count    = 0;
+    pager->cache.map_shift    = 32 - (u32)__builtin_ctz(capacity);
+
+    for (u32 i = 0; i < old_capacity; ++i) {
+        if (old_map[i]) map_insert(pager, old_map[i]);
+    }
+
+    MEM_FREE(pager->mem, old_map, old_capacity * sizeof(Page*));
 }
 
 static void map_add (Pager *pager, Page *page, Page_Id id) {
-    Page **slot = map_get_slot(pager, id);
-    page->map_next = *slot;
-    *slot = page;
+    ASSERT(id != 0);
+    u32 max_count = (u32)((u64)pager->cache.map_capacity * MAP_MAX_LOAD_PERCENT / 100);
+    if (pager->cache.map_count + 1 > max_count) map_resize(pager, pager->cache.map_count + 1);
+    map_insert(pager, page);
 }
 
+// There are no tombstones. Instead the entries that follow the
+// removed one in it's probe run are shifted back into the hole
+// if that doesn't move them in front of their home index.
 static void map_remove (Pager *pager, Page *page) {
-    Page **slot = map_get_slot(pager, page->ref.id);
-    while (*slot != page) slot = &(*slot)->map_next;
-    *slot = page->map_next;
+    u32 mask = pager->cache.map_capacity - 1;
+    u32 hole = map_home(pager, page->ref.id);
+    while (pager->cache.map[hole] != page) hole = (hole + 1) & mask;
+
+    for (u32 idx = (hole + 1) & mask; pager->cache.map[idx]; idx = (idx + 1) & mask) {
+        u32 home = map_home(pager, pager->cache.map[idx]->ref.id);
+
+        if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+            pager->cache.map[hole] = pager->cache.map[idx];
+            hole = idx;
+        }
+    }
+
+    pager->cache.map[hole] = NULL;
+    pager->cache.map_count--;
+}
+
+static Ghost **ghost_get_slot (Pager *pager, Page_Id id) {
+    return &pager->cache.ghosts.map[id % pager->cache.ghosts.capacity];
+}
+
+// Returns true if the id was a ghost.
+static bool ghost_remove (Pager *pager, Page_Id id) {
+    Ghost **slot = ghost_get_slot(pager, id);
+    while (*slot && (*slot)->id != id) slot = &(*slot)->map_next;
+    if (! *slot) return false;
+
+    Ghost *ghost = *slot;
+    *slot = ghost->map_next;
+    ghost->id = 0;
+    return true;
+}
+
+static void ghost_add (Pager *pager, Page_Id id) {
+    Ghost *ghost = &pager->cache.ghosts.ring[pager->cache.ghosts.head];
+    if (ghost->id) ghost_remove(pager, ghost->id);
+    pager->cache.ghosts.head = (pager->cache.ghosts.head + 1) % pager->cache.ghosts.capacity;
+
+    Ghost **slot = ghost_get_slot(pager, id);
+    ghost->id = id;
+    ghost->map_next = *slot;
+    *slot = ghost;
 }
 
 static u64 page_id_to_file_offset (Pager *pager, Page_Id id) {
-    return id * PSIZE;
+    return (u64)id * PSIZE;
 }
 
-static void page_write_to_disk (Pager *pager, Page *page) {
-    u64 file_offset = page_id_to_file_offset(pager, page->ref.id);
-    String payload = { .data = (char*)page->ref.buf, .count = PSIZE };
+static void checksum_stamp (Pager *pager, u8 *buf) {
+    if (pager->header.page_checksums) write_u32_le(buf + CHECKSUM_OFFSET, crc32c(buf, CHECKSUM_OFFSET));
+}
+
+static bool should_verify (Pager *pager, Page_Id id) {
+    switch (pager->verify.mode) {
+    case PAGER_VERIFY_ALWAYS:
+        return true;
+
+    case PAGER_VERIFY_FIRST_LOAD: {
+        while (pager->verify.verified.count <= id / 8) array_add(&pager->verify.verified, 0);
+        u8 *byte = array_ref(&pager->verify.verified, id / 8);
+        if (*byte & (1 << (id % 8))) return false;
+        *byte |= (u8)(1 << (id % 8));
+        return true;
+    }
+
+    case PAGER_VERIFY_SAMPLED:
+        return (pager->verify.loads++ % CHECKSUM_SAMPLE_RATE) == 0;
+    }
+
+    unreachable;
+}
+
+// Called on every page that was just loaded from the log, the
+// db file or the memory mapping.
+static void checksum_verify (Pager *pager, Page *page) {
+    if (!pager->header.page_checksums || !should_verify(pager, page->ref.id)) return;
+
+    u32 expected = read_u32_le(page->ref.buf + CHECKSUM_OFFSET);
+    if (crc32c(page->ref.buf, CHECKSUM_OFFSET) != expected) panic_fmt("Checksum mismatch on page %u.", page->ref.id);
+}
+
+// The header page is never compressed since it's read
+// before we know whether the file is compressed.
+static bool is_stored_compressed (Pager *pager, Page_Id id) {
+    return pager->header.page_compression && (id != 0);
+}
+
+// Stored form of a page in a compressed db file:
+//   codec:   2
+//   size:    2 (of the data)
+//   data:    size
+//
+// The data is the first STORED_SIZE bytes of the page, either
+// as they are or compressed. A page is only compressed if that
+// frees at least one block of it's slot in the file. Otherwise
+// the time spent on decompressing it would buy nothing. Returns
+// the size of the stored form.
+static u32 page_compress (Pager *pager, u8 *page, u8 *out) {
+    u32 capacity = (PSIZE > HOLE_GRANULARITY) ? PSIZE - HOLE_GRANULARITY - STORED_HEADER_SIZE : 0;
+    u32 size     = capacity ? lz_compress(page, STORED_SIZE, out + STORED_HEADER_SIZE, capacity) : 0;
+
+    if (size) {
+        write_u16_le(out, CODEC_LZ);
+    } else {
+        size = STORED_SIZE;
+        memcpy(out + STORED_HEADER_SIZE, page, size);
+        write_u16_le(out, CODEC_NONE);
+    }
+
+    write_u16_le(out + 2, (u16)size);
+    return STORED_HEADER_SIZE + size;
+}
+
+// The unused tail of a slot that was never written reads as
+// zeros, which is a valid stored form of an all zero page.
+static void page_decompress (Pager *pager, Page_Id id, u8 *stored, u8 *out) {
+    u16 codec = read_u16_le(stored);
+    u16 size  = read_u16_le(stored + 2);
+
+    if (codec == CODEC_NONE) {
+        memcpy(out, stored + STORED_HEADER_SIZE, STORED_SIZE);
+    } else if ((codec != CODEC_LZ) || (size > STORED_SIZE) || !lz_decompress(stored + STORED_HEADER_SIZE, size, out, STORED_SIZE)) {
+        panic_fmt("Page %u cannot be decompressed.", id);
+    }
+
+    memset(out + STORED_SIZE, 0, STORED_HEADER_SIZE);
+}
+
+// In a compressed db file only the blocks of a page's slot
+// that hold the stored form are written. The rest of the slot
+// is punched out of the file so it takes no space on disk and
+// reads of it don't hit the disk either.
+static void page_store (Pager *pager, Page_Id id, u8 *page) {
+    u64 file_offset = page_id_to_file_offset(pager, id);
+    String payload  = { .data = (char*)page, .count = PSIZE };
+
+    if (is_stored_compressed(pager, id)) {
+        payload.data  = (char*)pager->compression.stored;
+        payload.count = page_compress(pager, page, pager->compression.stored);
+    }
+
     fs_write_to_file(pager->fs, pager->db_file, payload, file_offset);
+    pager->has_unsynced_writes = true;
+
+    u32 used = (u32)payload.count + PADDING_TO_ALIGN((u32)payload.count, HOLE_GRANULARITY);
+    if (used < PSIZE) fs_punch_hole(pager->fs, pager->db_file, file_offset + used, PSIZE - used);
+}
+
+static void page_fetch (Pager *pager, Page_Id id, u8 *out) {
+    u64 file_offset = page_id_to_file_offset(pager, id);
+
+    if (is_stored_compressed(pager, id)) {
+        fs_read_from_file(pager->fs, pager->db_file, file_offset, PSIZE, pager->compression.stored);
+        page_decompress(pager, id, pager->compression.stored, out);
+    } else {
+        fs_read_from_file(pager->fs, pager->db_file, file_offset, PSIZE, out);
+    }
+}
+
+static void checkpoint_write_page (void *pager, Page_Id id, u8 *page) {
+    page_store(pager, id, page);
+}
+
+static void checkpoint (Pager *pager) {
+    wal_checkpoint(pager->wal.log, pager->db_file, pager->header.page_compression ? checkpoint_write_page : NULL, pager);
+}
+
+static void page_write_to_disk (Pager *pager, Page *page) {
+    page_store(pager, page->ref.id, page->ref.buf);
 }
 
 static void page_read_from_disk (Pager *pager, Page *page) {
+    if (pager->wal.log && wal_read_page(pager->wal.log, page->ref.id, page->ref.buf)) return;
+    page_fetch(pager, page->ref.id, page->ref.buf);
+}
+
+static void page_write_back (Pager *pager, Page *page) {
+    ASSERT(! (page->flags & F_PAGE_HAS_MUTABLE_REF));
+    checksum_stamp(pager, page->ref.buf);
+
+    if (pager->wal.log) {
+        wal_write_pages(pager->wal.log, &page->ref.id, &page->ref.buf, 1, false);
+        pager->wal.has_uncommitted = true;
+    } else {
+        page_write_to_disk(pager, page);
+    }
+
+    page->flags &= ~F_PAGE_IS_DIRTY;
+}
+
+// In mmap mode we don't copy the page into the cache. The
+// ref just points into the mapping. Evicting such a page is
+// free since the kernel page cache still holds the data. A
+// page with a newer version in the log is read as usual. The
+// pages of a compressed file are decompressed out of the
+// mapping into the cache.
+static void page_load (Pager *pager, Page *page) {
     u64 file_offset = page_id_to_file_offset(pager, page->ref.id);
-    fs_read_from_file(pager->fs, pager->db_file, file_offset, PSIZE, page->ref.buf);
+    bool in_file    = page->ref.id < pager->db_file_capacity;
+
+    if (pager->mmap.base && in_file && (file_offset + PSIZE <= pager->mmap.size) && !in_wal(pager, page->ref.id)) {
+        if (is_stored_compressed(pager, page->ref.id)) {
+            page_decompress(pager, page->ref.id, pager->mmap.base + file_offset, page->ref.buf);
+        } else {
+            page->ref.buf = pager->mmap.base + file_offset;
+            page->flags |= F_PAGE_IS_MAPPED;
+        }
+    } else {
+        page_read_from_disk(pager, page);
+    }
+
+    checksum_verify(pager, page);
+}
+
+static void clear_user_buffer (Pager *pager, void *buf) {
+    if (buf) memset(buf, 0, pager->cache.user_buffer_size);
+}
+
+static size_t slot_size (Pager *pager) {
+    return sizeof(Page) + PSIZE + pager->cache.user_buffer_size;
+}
+
+static Page *slot_new (Pager *pager) {
+    Page *page         = MEM_ALLOC_Z(pager->mem, slot_size(pager));
+    page->frame        = (u8*)(page + 1);
+    page->ref.user_buf = pager->cache.user_buffer_size ? page->frame + PSIZE : NULL;
+    array_add(&pager->cache.slots, page);
+    return page;
+}
+
+// A page that the cleaner's writer thread hasn't gotten to yet
+// is taken back and is dirty again. Returns false if there is
+// no such write or it has started already.
+static bool cancel_write (Pager *pager, Page *page) {
+    if (!(page->flags & F_PAGE_IS_WRITING) || !writer_cancel(pager->cleaner.writer, page)) return false;
+    page->flags = (page->flags & ~F_PAGE_IS_WRITING) | F_PAGE_IS_DIRTY;
+    pager->writes_in_flight--;
+    return true;
+}
+
+// Pages queued by the cleaner are taken back, so a writer that
+// doesn't get the cpu can't keep the tail of the cache pinned.
+// The cleaner then backs off until a write gets done, because
+// queueing more pages would only be wasted work.
+static Page *find_unreferenced (Pager *pager, Page *list) {
+    for (Page *page = list->lru_prev; page != list; page = page->lru_prev) {
+        if (page->ref_count || (page->flags & F_PAGE_IS_LOADING)) continue;
+        if (! (page->flags & F_PAGE_IS_WRITING)) return page;
+
+        if (cancel_write(pager, page)) {
+            pager->cleaner.backoff = MIN(MAX(2 * pager->cleaner.backoff, CLEAN_AHEAD_BATCH), CLEAN_AHEAD_BACKOFF);
+            return page;
+        }
+    }
+
+    return NULL;
+}
+
+static Page *find_victim (Pager *pager) {
+    Page *victim = NULL;
+    u32 cold_count = pager->cache.slots.count - pager->cache.hot_count;
+    if (pager->cache.priority_count > pager->cache.capacity / 2) victim = find_unreferenced(pager, &pager->cache.high);
+    if (!victim && (cold_count > pager->cache.a1in_capacity)) victim = find_unreferenced(pager, &pager->cache.a1in);
+    if (! victim) victim = find_unreferenced(pager, &pager->cache.lru);
+    if (! victim) victim = find_unreferenced(pager, &pager->cache.a1in);
+    if (! victim) victim = find_unreferenced(pager, &pager->cache.high);
+    if (! victim) victim = find_unreferenced(pager, &pager->cache.pinned);
+    return victim;
+}
+
+static void slot_unlink (Pager *pager, Page *page) {
+    ASSERT(page->ref_count == 0);
+    lru_remove(page);
+    map_remove(pager, page);
+    if (page->flags & F_PAGE_IS_HOT) pager->cache.hot_count--;
+    if (page->flags & (F_PAGE_IS_HIGH | F_PAGE_IS_PINNED)) pager->cache.priority_count--;
+}
+
+// Remove an unreferenced page from the cache. The slot
+// can then be freed or reused for another page.
+static void slot_evict (Pager *pager, Page *page) {
+    slot_unlink(pager, page);
+    if (! (page->flags & F_PAGE_IS_HOT)) ghost_add(pager, page->ref.id);
+
+    if (page->flags & F_PAGE_IS_DIRTY) {
+        page_write_back(pager, page);
+        pager->stats.dirty_evictions++;
+    }
+
+    pager->stats.evictions++;
+}
+
+static void slot_free (Pager *pager, Page *page) {
+    slot_evict(pager, page);
+    array_find_remove_fast(&pager->cache.slots, page);
+    MEM_FREE(pager->mem, page, slot_size(pager));
+}
+
+static void shrink_to_capacity (Pager *pager) {
+    while (pager->cache.slots.count > pager->cache.capacity) {
+        Page *page = find_victim(pager);
+        if (! page) break;
+        slot_free(pager, page);
+    }
+}
+
+static void decrement_ref_count (Pager *pager, Page *page) {
+    ASSERT(page->ref_count > 0);
+    page->ref_count--;
+    if (page->ref_count == 0) shrink_to_capacity(pager);
+}
+
+static Page *hot_list (Pager *pager, Page *page) {
+    if (page->flags & F_PAGE_IS_PINNED) return &pager->cache.pinned;
+    if (page->flags & F_PAGE_IS_HIGH)   return &pager->cache.high;
+    return &pager->cache.lru;
+}
+
+// Move a page that got hit to the front of the lru list. A
+// page in the a1in list is only promoted if it was hit while
+// nobody held a ref to it. Repeated gets of a page that is in
+// use by one operation are correlated and don't count.
+static void touch (Pager *pager, Page *page) {
+    if (! (page->flags & F_PAGE_IS_HOT)) {
+        if (page->ref_count > 1) return;
+        page->flags |= F_PAGE_IS_HOT;
+        pager->cache.hot_count++;
+    }
+
+    lru_remove(page);
+    lru_add(hot_list(pager, page), page);
+}
+
+static void finish_request (Pager *pager, Page *page) {
+    if (page->flags & F_PAGE_IS_LOADING) {
+        page->flags &= ~F_PAGE_IS_LOADING;
+
+        if (is_stored_compressed(pager, page->ref.id)) {
+            memcpy(pager->compression.stored, page->frame, PSIZE);
+            page_decompress(pager, page->ref.id, pager->compression.stored, page->frame);
+        }
+
+        checksum_verify(pager, page);
+    } else {
+        ASSERT(pager->writes_in_flight);
+        pager->writes_in_flight--;
+        pager->cleaner.backoff = 0;
+        page->flags &= ~F_PAGE_IS_WRITING;
+    }
+}
+
+// Wait for one async request or cleaner write to complete.
+// Returns false if there are none in flight.
+static bool reap (Pager *pager) {
+    Writer *writer = pager->cleaner.writer;
+    Page *page = writer ? writer_poll(writer) : NULL;
+    if (!page && fs_async_enabled(pager->fs)) page = fs_async_wait(pager->fs);
+    if (!page && writer) page = writer_wait(writer);
+    if (! page) return false;
+    finish_request(pager, page);
+    return true;
+}
+
+// Handle the async requests and cleaner writes that have
+// completed so far without blocking.
+static void reap_completed (Pager *pager) {
+    Page *page;
+    if (pager->cleaner.writer) while (pager->writes_in_flight && (page = writer_poll(pager->cleaner.writer))) finish_request(pager, page);
+    if (fs_async_enabled(pager->fs)) while ((page = fs_async_poll(pager->fs))) finish_request(pager, page);
+}
+
+static void wait_for_io (Pager *pager, Page *page, u32 flags) {
+    while (page->flags & flags) {
+        bool reaped = reap(pager);
+        ASSERT(reaped);
+    }
+}
+
+// A page still in the writer's queue is taken back, otherwise
+// we have to wait for the write.
+static void wait_for_write (Pager *pager, Page *page) {
+    cancel_write(pager, page);
+    wait_for_io(pager, page, F_PAGE_IS_WRITING);
+}
+
+static int cmp_page_ids (const void *a, const void *b) {
+    Page_Id A = (*(Page**)a)->ref.id;
+    Page_Id B = (*(Page**)b)->ref.id;
+    return (A > B) - (A < B);
+}
+
+// Write the pages into the db file in the given order and mark
+// them clean. Runs of consecutive pages are written with one
+// syscall. The stored forms of compressed pages differ in size
+// so each of them is written on it's own.
+static void write_pages (Pager *pager, Page **pages, u32 count) {
+    if (pager->header.page_compression) {
+        for (u32 i = 0; i < count; ++i) {
+            pages[i]->flags &= ~F_PAGE_IS_DIRTY;
+            page_store(pager, pages[i]->ref.id, pages[i]->ref.buf);
+        }
+
+        return;
+    }
+
+    Array(u8*) run;
+    array_init(&run, pager->mem);
+
+    for (u32 i = 0; i < count; ++i) {
+        Page *page = pages[i];
+        array_add(&run, page->ref.buf);
+        page->flags &= ~F_PAGE_IS_DIRTY;
+
+        if ((i == count - 1) || (pages[i + 1]->ref.id != page->ref.id + 1)) {
+            Page_Id first = page->ref.id + 1 - run.count;
+            fs_writev_pages(pager->fs, pager->db_file, page_id_to_file_offset(pager, first), (u8**)run.data, run.count, PSIZE);
+            array_clear(&run);
+        }
+    }
+
+    array_free(&run);
 }
 
-static void clear_user_buffer (Pager *pager, u8 *buf) {
-    memset(buf, 0, pager->cache.user_buffer_size);
+static void clean_list_tail (Pager *pager, Page *list, u32 window) {
+    u32 busy = F_PAGE_HAS_MUTABLE_REF | F_PAGE_IS_LOADING | F_PAGE_IS_WRITING;
+    Page *page = list->lru_prev;
+
+    for (u32 i = 0; (i < window) && (page != list); ++i, page = page->lru_prev) {
+        if (!(page->flags & F_PAGE_IS_DIRTY) || (page->flags & busy)) continue;
+        if (pager->cleaner.batch.count == CLEAN_AHEAD_BATCH) return;
+        array_add(&pager->cleaner.batch, page);
+    }
+}
+
+// Called before every eviction. Every MIN(window/4,
+// CLEAN_AHEAD_BATCH/2) evictions the dirty pages among the
+// last window pages of each list are handed to the writer
+// thread and we go on. The pages stay in the cache but can't
+// be evicted until their write is reaped, and a page that gets
+// changed first is taken back from the writer if it can be.
+//
+// The window is capped at CLEAN_AHEAD_WINDOW pages. Walking the
+// lists is pointer chasing through the cache and a deep window
+// made every round a latency spike. A page passes through the
+// capped window over several rounds, which is enough time to
+// get it written. If the writer is behind (its queue is full
+// or the rate limit holds it back) rounds are skipped, and the
+// evictions write on their own as before.
+//
+// The cleaner never runs while the log is open, which is the
+// case in wal mode and during a transaction. Evicted pages are
+// appended to the log then and there is nothing to clean.
+static void clean_ahead (Pager *pager) {
+    if (!pager->cleaner.percent || pager->wal.log || pager->header.page_compression) return;
+
+    reap_completed(pager);
+    if (pager->writes_in_flight >= WRITER_QUEUE_DEPTH) return; // The writer is behind.
+
+    if (pager->cleaner.countdown) {
+        pager->cleaner.countdown--;
+        return;
+    }
+
+    u32 window = (u32)MAX((u64)pager->cache.capacity * pager->cleaner.percent / 100, 1);
+    window = MIN(window, CLEAN_AHEAD_WINDOW);
+    pager->cleaner.countdown = MAX(MIN(window / 4, CLEAN_AHEAD_BATCH / 2), pager->cleaner.backoff);
+
+    array_clear(&pager->cleaner.batch);
+    clean_list_tail(pager, &pager->cache.a1in, window);
+    clean_list_tail(pager, &pager->cache.lru, window);
+    clean_list_tail(pager, &pager->cache.high, window);
+    clean_list_tail(pager, &pager->cache.pinned, window);
+
+    if (! pager->cleaner.batch.count) return;
+
+    if (! pager->cleaner.writer) {
+        pager->cleaner.writer = writer_new(pager->fs, pager->mem, pager->db_file, pager->cleaner.bytes_per_sec);
+        if (! pager->cleaner.writer) { pager->cleaner.percent = 0; return; }
+    }
+
+    qsort(pager->cleaner.batch.data, pager->cleaner.batch.count, sizeof(Page*), cmp_page_ids);
+
+    array_iter (page, pager->cleaner.batch) {
+        checksum_stamp(pager, page->ref.buf);
+        if (! writer_write(pager->cleaner.writer, page_id_to_file_offset(pager, page->ref.id), page->ref.buf, PSIZE, page)) break;
+        page->flags = (page->flags & ~F_PAGE_IS_DIRTY) | F_PAGE_IS_WRITING;
+        pager->writes_in_flight++;
+        pager->has_unsynced_writes = true;
+    }
+}
+
+// Pages that are being written by the cleaner can only be
+// evicted once the write has completed.
+static Page *find_victim_or_wait (Pager *pager) {
+    Page *victim = find_victim(pager);
+    while (!victim && pager->writes_in_flight && reap(pager)) victim = find_victim(pager);
+    return victim;
 }
 
 static Page *get_empty_cache_slot (Pager *pager, Page_Id id) {
     Page *page = NULL;
 
-    if (pager->cache.count < pager->cache.capacity) {
-        u32 idx            = pager->cache.count++;
-        page               = &pager->cache.pages[idx];
-        page->ref.buf      = &pager->cache.raw_pages[idx * PSIZE];
-        page->ref.user_buf = pager->cache.user_buffers ? &pager->cache.user_buffers[idx * pager->cache.user_buffer_size] : NULL;
+    if (pager->cache.slots.count < pager->cache.capacity) {
+        page = slot_new(pager);
     } else {
-        page = pager->cache.lru.lru_prev;
-        ASSERT(page);
-        ASSERT(page->ref_count == 0);
-        ASSERT(page != &pager->cache.lru); // TODO: LRU is empty. This should either be an exception or return NULL.
-        lru_remove(page);
-        map_remove(pager, page);
-        clear_user_buffer(pager, page->ref.user_buf);
+        clean_ahead(pager);
+        page = find_victim_or_wait(pager);
+
+        if (page) {
+            slot_evict(pager, page);
+            clear_user_buffer(pager, page->ref.user_buf);
+        } else {
+            ASSERT(pager->txn.active); // TODO: All pages are referenced. This should either be an exception or return NULL.
+            page = slot_new(pager);
+        }
     }
 
+    bool hot = ghost_remove(pager, id) || (pager->cache.policy == PAGER_CACHE_LRU);
+
     *page = (Page){
+        .flags        = hot ? F_PAGE_IS_HOT : 0,
         .ref_count    = 1,
         .ref.id       = id,
-        .ref.buf      = page->ref.buf,
+        .ref.buf      = page->frame,
         .ref.user_buf = page->ref.user_buf,
+        .frame        = page->frame,
     };
 
+    if (hot) pager->cache.hot_count++;
+    lru_add(hot ? &pager->cache.lru : &pager->cache.a1in, page);
     map_add(pager, page, id);
 
     return page;
 }
 
+// The pages of a compressed file only keep the blocks of their
+// stored form, page_store() punches out the rest. Preallocating
+// an extent would give the file blocks that are punched out again
+// as soon as its pages are written, and keep the blocks of pages
+// that are never written. So a compressed file grows sparsely and
+// the extent only sets how often it grows.
+static void extend_file (Pager *pager, u64 from, u64 to) {
+    if (pager->header.page_compression) {
+        fs_extend_file(pager->fs, pager->db_file, to);
+    } else {
+        fs_preallocate(pager->fs, pager->db_file, from, to - from);
+    }
+}
+
+// Preallocate room for at least one more page at the end of
+// the file. The file grows by the bigger of the extent size and
+// a percentage of the current size, so that the number of grow
+// operations stays logarithmic for big files.
+static void grow_file (Pager *pager) {
+    u32 growth = MAX(pager->extent_size, pager->db_file_capacity / 100 * EXTENT_GROWTH_PERCENT);
+    u32 new_capacity = (u32)MIN((u64)pager->db_file_capacity + growth, MAX_PAGE_COUNT);
+    if (new_capacity == pager->db_file_page_count) panic_fmt("The db file reached the max size of %u pages.", MAX_PAGE_COUNT);
+
+    u64 from = page_id_to_file_offset(pager, pager->db_file_capacity);
+    u64 to   = page_id_to_file_offset(pager, new_capacity);
+    extend_file(pager, from, to);
+    pager->db_file_capacity = new_capacity;
+}
+
+static Page_Id alloc_from_tail (Pager *pager) {
+    if (pager->db_file_page_count == pager->db_file_capacity) grow_file(pager);
+    pager->header.is_dirty = true;
+    return pager->db_file_page_count++;
+}
+
+// Used while the cache holds no refs to bitmap pages yet, so the
+// next pointers are read straight from the log or the file.
+static Page_Id read_next_pointer (Pager *pager, Page_Id id, u32 offset) {
+    if (pager->wal.log && wal_read_page(pager->wal.log, id, pager->wal.scratch)) return read_u32_le(pager->wal.scratch + offset);
+
+    if (is_stored_compressed(pager, id)) {
+        page_fetch(pager, id, pager->compression.scratch);
+        return read_u32_le(pager->compression.scratch + offset);
+    }
+
+    u8 buf[4];
+    fs_read_from_file(pager->fs, pager->db_file, page_id_to_file_offset(pager, id) + offset, 4, buf);
+    return read_u32_le(buf);
+}
+
+static void bitmap_set (Pager *pager, Page_Id id, bool is_free);
+static bool bitmap_get (Pager *pager, Page_Id id);
+
+static void bitmap_load (Pager *pager) {
+    pager->bitmap.is_loaded = true;
+    array_init(&pager->bitmap.pages, pager->mem);
+
+    for (Page_Id id = pager->header.first_bitmap; id; id = read_next_pointer(pager, id, NEXT_BITMAP_OFFSET)) {
+        array_add(&pager->bitmap.pages, id);
+    }
+
+    // Move the legacy free list into the bitmap. Lists written
+    // by older versions can loop back on themselves, so we stop
+    // at the first page that is already marked free.
+    Page_Id free_page = pager->header.free_page;
+    pager->header.free_page = 0;
+
+    while (free_page && (free_page < pager->db_file_page_count) && !bitmap_get(pager, free_page)) {
+        Page_Id next = read_next_pointer(pager, free_page, NEXT_FREE_PAGE_OFFSET);
+        bitmap_set(pager, free_page, true);
+        free_page = next;
+    }
+}
+
+// Append bitmap pages until the given page is covered. New
+// bitmaps always come from the tail of the file.
+static void bitmap_extend (Pager *pager, Page_Id id) {
+    while (pager->bitmap.pages.count <= id / BITS_PER_BITMAP) {
+        Page_Id bitmap_id = alloc_from_tail(pager);
+        Page *page = get_empty_cache_slot(pager, bitmap_id);
+        memset(page->ref.buf, 0, PSIZE);
+        page->flags |= F_PAGE_IS_DIRTY;
+        decrement_ref_count(pager, page);
+
+        if (pager->bitmap.pages.count) {
+            Page_Ref *prev = pager_get_page_mutable(pager, array_get_last(&pager->bitmap.pages));
+            write_u32_le(prev->buf + NEXT_BITMAP_OFFSET, bitmap_id);
+            pager_unref_page(pager, prev);
+        } else {
+            pager->header.first_bitmap = bitmap_id;
+            pager->header.is_dirty = true;
+        }
+
+        array_add(&pager->bitmap.pages, bitmap_id);
+    }
+}
+
+static void bitmap_set (Pager *pager, Page_Id id, bool is_free) {
+    bitmap_extend(pager, id);
+
+    u32 bit = id % BITS_PER_BITMAP;
+    Page_Ref *ref = pager_get_page_mutable(pager, array_get(&pager->bitmap.pages, id / BITS_PER_BITMAP));
+    ASSERT(ref);
+
+    if (is_free) {
+        ref->buf[bit / 8] |= (u8)(1 << (bit % 8));
+        pager->bitmap.lowest_free = MIN(pager->bitmap.lowest_free, id);
+    } else {
+        ref->buf[bit / 8] &= (u8)~(1 << (bit % 8));
+    }
+
+    pager_unref_page(pager, ref);
+}
+
+static bool bitmap_get (Pager *pager, Page_Id id) {
+    if (pager->bitmap.pages.count <= id / BITS_PER_BITMAP) return false;
+
+    u32 bit = id % BITS_PER_BITMAP;
+    Page_Ref *ref = pager_get_page(pager, array_get(&pager->bitmap.pages, id / BITS_PER_BITMAP));
+    ASSERT(ref);
+    bool result = ref->buf[bit / 8] & (1 << (bit % 8));
+    pager_unref_page(pager, ref);
+
+    return result;
+}
+
+// Returns 0 if there are no free pages.
+static Page_Id bitmap_find_lowest_free (Pager *pager) {
+    u32 bytes_per_bitmap = BITS_PER_BITMAP / 8;
+
+    for (u32 k = pager->bitmap.lowest_free / BITS_PER_BITMAP; k < pager->bitmap.pages.count; ++k) {
+        Page_Ref *ref = pager_get_page(pager, array_get(&pager->bitmap.pages, k));
+        ASSERT(ref);
+
+        u32 from = (k == pager->bitmap.lowest_free / BITS_PER_BITMAP) ? (pager->bitmap.lowest_free % BITS_PER_BITMAP) / 8 : 0;
+
+        for (u32 i = from; i < bytes_per_bitmap; ++i) {
+            u8 byte = ref->buf[i];
+            if (! byte) continue;
+
+            pager_unref_page(pager, ref);
+            return k * BITS_PER_BITMAP + i * 8 + (u32)__builtin_ctz(byte);
+        }
+
+        pager_unref_page(pager, ref);
+    }
+
+    pager->bitmap.lowest_free = (u32)MIN((u64)pager->bitmap.pages.count * BITS_PER_BITMAP, UINT32_MAX);
+    return 0;
+}
+
 // It's the job of the user code to ensure that the page this
 // function returns is not inside the free list of the pager.
 //
@@ -221,11 +1275,19 @@ Page_Ref *pager_get_page (Pager *pager, Page_Id id) {
 
     if (page) {
         if (page->flags & F_PAGE_HAS_MUTABLE_REF) return NULL;
-        if (page->ref_count == 0) lru_remove(page);
+        wait_for_io(pager, page, F_PAGE_IS_LOADING);
         page->ref_count++;
+        pager->stats.hits++;
+
+        if (page->flags & F_PAGE_IS_PREFETCHED) {
+            page->flags &= ~F_PAGE_IS_PREFETCHED;
+        } else {
+            touch(pager, page);
+        }
     } else {
         page = get_empty_cache_slot(pager, id);
-        page_read_from_disk(pager, page);
+        page_load(pager, page);
+        pager->stats.misses++;
     }
 
     return (Page_Ref*)page;
@@ -243,67 +1305,479 @@ bool pager_make_page_mutable (Pager *pager, Page_Ref *ref) {
     Page *page = (Page*)ref;
     ASSERT(page->ref_count > 0);
     if (page->ref_count != 1) return false;
-    page->flags |= F_PAGE_HAS_MUTABLE_REF;
+    wait_for_write(pager, page);
+
+    if (page->flags & F_PAGE_IS_MAPPED) { // Copy on write:
+        memcpy(page->frame, page->ref.buf, PSIZE);
+        page->ref.buf = page->frame;
+        page->flags &= ~F_PAGE_IS_MAPPED;
+    }
+
+    page->flags |= F_PAGE_HAS_MUTABLE_REF | F_PAGE_IS_DIRTY;
     return true;
 }
 
 bool pager_is_page_mutable (Pager *pager, Page_Ref *ref) {
     Page *page = (Page*)ref;
-    return page->flags | F_PAGE_HAS_MUTABLE_REF;
+    return page->flags & F_PAGE_HAS_MUTABLE_REF;
 }
 
+// The lowest free page is handed out first in order to keep
+// the tree packed towards the start of the file. The content
+// of a free page is garbage, so it's never read from disk.
 Page_Ref *pager_alloc_page (Pager *pager) {
-    Page_Ref *page = NULL;
+    if (! pager->bitmap.is_loaded) bitmap_load(pager);
 
-    if (pager->header.free_page) {
-        page = (Page_Ref*)get_empty_cache_slot(pager, pager->header.free_page);
-        page_read_from_disk(pager, (Page*)page);
-        pager->header.free_page = read_u32_le(page->buf + NEXT_FREE_PAGE_OFFSET);
+    Page_Id id = bitmap_find_lowest_free(pager);
+
+    if (id) {
+        bitmap_set(pager, id, false);
     } else {
-        page = (Page_Ref*)get_empty_cache_slot(pager, pager->db_file_page_count++);
-        fs_append_to_file(pager->fs, pager->db_file, (String){ .data = (char*)page->buf, .count = PSIZE });
+        id = alloc_from_tail(pager);
     }
 
-    pager_make_page_mutable(pager, page);
+    Page *page = map_get(pager, id);
 
-    return page;
+    if (page) {
+        wait_for_io(pager, page, F_PAGE_IS_LOADING);
+        ASSERT(page->ref_count == 0);
+        page->ref_count = 1;
+    } else {
+        page = get_empty_cache_slot(pager, id);
+    }
+
+    pager_make_page_mutable(pager, (Page_Ref*)page);
+    memset(page->ref.buf, 0, PSIZE);
+
+    return (Page_Ref*)page;
 }
 
+// The page is marked free in the bitmap and dropped from the
+// cache without being written back.
 bool pager_delete_page (Pager *pager, Page_Ref *ref) {
     Page *page = (Page*)ref;
 
     if (page->ref_count != 1) return false;
+    if (! pager->bitmap.is_loaded) bitmap_load(pager);
+    wait_for_write(pager, page);
 
-    // Add page to free list:
-    write_u32_le(ref->buf + NEXT_FREE_PAGE_OFFSET, pager->header.free_page);
-    pager->header.free_page = ref->id;
-    page_write_to_disk(pager, page);
-    header_write_to_disk(pager);
+    Page_Id id = ref->id;
+    page->ref_count = 0;
+    page->flags &= ~(F_PAGE_HAS_MUTABLE_REF | F_PAGE_IS_DIRTY);
+    slot_unlink(pager, page);
+    array_find_remove_fast(&pager->cache.slots, page);
+    MEM_FREE(pager->mem, page, slot_size(pager));
 
-    decrement_ref_count(pager, page);
+    bitmap_set(pager, id, true);
 
     return true;
 }
 
 void pager_unref_page (Pager *pager, Page_Ref *ref) {
     Page *page = (Page*)ref;
-
+    page->flags &= ~F_PAGE_HAS_MUTABLE_REF;
     decrement_ref_count(pager, page);
+}
 
-    if (page->flags & F_PAGE_HAS_MUTABLE_REF) {
-        page->flags &= ~F_PAGE_HAS_MUTABLE_REF;
-        page_write_to_disk(pager, page);
+// The priority belongs to the cached page. Once the page is
+// evicted it comes back with normal priority, so callers set
+// it again whenever they get the page. Raising the priority
+// makes the page hot. Lowering it moves the page to the front
+// of the lru list.
+void pager_set_priority (Pager *pager, Page_Ref *ref, Pager_Priority priority) {
+    Page *page = (Page*)ref;
+    u32 mask   = F_PAGE_IS_HIGH | F_PAGE_IS_PINNED;
+    u32 flags  = (priority == PAGER_PRIORITY_PINNED) ? F_PAGE_IS_PINNED :
+                 (priority == PAGER_PRIORITY_HIGH)   ? F_PAGE_IS_HIGH :
+                                                       0;
+
+    if ((page->flags & mask) == flags) return;
+
+    if (! (page->flags & F_PAGE_IS_HOT)) pager->cache.hot_count++;
+    if (! (page->flags & mask)) pager->cache.priority_count++;
+    if (! flags) pager->cache.priority_count--;
+
+    page->flags = (page->flags & ~mask) | flags | F_PAGE_IS_HOT;
+    lru_remove(page);
+    lru_add(hot_list(pager, page), page);
+}
+
+static int cmp_ids (const void *a, const void *b) {
+    Page_Id A = *(Page_Id*)a;
+    Page_Id B = *(Page_Id*)b;
+    return (A > B) - (A < B);
+}
+
+// The dirty pages are appended to the log followed by the
+// header, which is logged as page 0 and serves as the commit
+// frame. With PAGER_SYNC_FULL all of it is made durable with
+// a single sync.
+static void wal_commit (Pager *pager, Page **dirty, u32 count) {
+    if (!count && !pager->header.is_dirty && !pager->wal.has_uncommitted) return;
+
+    Array(Page_Id) ids;
+    Array(u8*) bufs;
+    array_init_cap(&ids, pager->mem, count + 1);
+    array_init_cap(&bufs, pager->mem, count + 1);
+
+    for (u32 i = 0; i < count; ++i) {
+        array_add(&ids, dirty[i]->ref.id);
+        array_add(&bufs, dirty[i]->ref.buf);
+        dirty[i]->flags &= ~F_PAGE_IS_DIRTY;
+    }
+
+    memset(pager->wal.scratch, 0, PSIZE);
+    header_encode(pager, pager->wal.scratch);
+    array_add(&ids, 0);
+    array_add(&bufs, pager->wal.scratch);
+
+    wal_write_pages(pager->wal.log, (Page_Id*)ids.data, (u8**)bufs.data, ids.count, true);
+    if (pager->sync == PAGER_SYNC_FULL) wal_sync(pager->wal.log);
+    pager->header.is_dirty = false;
+    pager->wal.has_uncommitted = false;
+
+    array_free(&ids);
+    array_free(&bufs);
+
+    if (wal_frame_count(pager->wal.log) >= WAL_CHECKPOINT_PAGES) checkpoint(pager);
+}
+
+// Without the wal every flush counts as a checkpoint.
+static void sync_db_file (Pager *pager) {
+    if ((pager->sync == PAGER_SYNC_OFF) || !pager->has_unsynced_writes) return;
+    fs_sync(pager->fs, pager->db_file);
+    pager->has_unsynced_writes = false;
+}
+
+// Write all dirty pages back to disk in file order. Pages
+// that currently have a mutable ref are skipped since they
+// are still being modified. In wal mode this is a commit.
+// During a transaction this does nothing.
+void pager_flush (Pager *pager) {
+    if (pager->txn.active) return;
+
+    Array(Page*) dirty;
+    array_init(&dirty, pager->mem);
+
+    array_iter (page, pager->cache.slots) {
+        if ((page->flags & F_PAGE_IS_DIRTY) && !(page->flags & F_PAGE_HAS_MUTABLE_REF)) array_add(&dirty, page);
+    }
+
+    if (dirty.count) qsort(dirty.data, dirty.count, sizeof(Page*), cmp_page_ids);
+    array_iter (page, dirty) checksum_stamp(pager, page->ref.buf);
+
+    if (pager->wal.log) {
+        wal_commit(pager, (Page**)dirty.data, dirty.count);
+        array_free(&dirty);
+        return;
+    }
+
+    if (pager->header.is_dirty) header_write_to_disk(pager);
+    if (dirty.count) pager->has_unsynced_writes = true;
+
+    if (fs_async_enabled(pager->fs) && !pager->header.page_compression) {
+        // All writes are in flight at once.
+        array_iter (page, dirty) {
+            page->flags &= ~F_PAGE_IS_DIRTY;
+            fs_async_write(pager->fs, pager->db_file, page_id_to_file_offset(pager, page->ref.id), PSIZE, page->ref.buf, page);
+            pager->writes_in_flight++;
+        }
+
+        while (pager->writes_in_flight) reap(pager);
+        sync_db_file(pager);
+        array_free(&dirty);
+        return;
+    }
+
+    write_pages(pager, (Page**)dirty.data, dirty.count);
+    while (pager->writes_in_flight) reap(pager); // The cleaner's writes must be in the sync too.
+    sync_db_file(pager);
+    array_free(&dirty);
+}
+
+// Returns false if a transaction is already active. All
+// changes made so far are flushed first.
+bool pager_begin (Pager *pager) {
+    if (pager->txn.active) return false;
+    pager_flush(pager);
+
+    if (! pager->wal.log) {
+        wal_init(pager, fs_get_file_path(pager->fs, pager->db_file));
+        pager->txn.owns_log = true;
+    }
+
+    pager->txn.active       = true;
+    pager->txn.page_count   = pager->db_file_page_count;
+    pager->txn.free_page    = pager->header.free_page;
+    pager->txn.first_bitmap = pager->header.first_bitmap;
+
+    return true;
+}
+
+// Returns false if no transaction is active.
+bool pager_commit (Pager *pager) {
+    if (! pager->txn.active) return false;
+    pager->txn.active = false;
+    pager_flush(pager);
+
+    if (pager->txn.owns_log) {
+        checkpoint(pager);
+        wal_deinit_and_delete(pager);
+        pager->txn.owns_log = false;
+    }
+
+    shrink_to_capacity(pager);
+    return true;
+}
+
+// Returns false if no transaction is active. There must be
+// no refs to pages that were modified. Cached pages that were
+// read back from an uncommitted frame are dropped along with
+// the dirty ones.
+bool pager_rollback (Pager *pager) {
+    if (! pager->txn.active) return false;
+    pager->txn.active = false;
+
+    while (reap(pager));
+
+    for (u32 i = 0; i < pager->cache.slots.count;) {
+        Page *page = array_get(&pager->cache.slots, i);
+
+        if ((page->flags & F_PAGE_IS_DIRTY) || wal_is_uncommitted(pager->wal.log, page->ref.id)) {
+            slot_unlink(pager, page);
+            array_remove_fast(&pager->cache.slots, i);
+            MEM_FREE(pager->mem, page, slot_size(pager));
+        } else {
+            i++;
+        }
+    }
+
+    pager->db_file_page_count  = pager->txn.page_count;
+    pager->header.free_page    = pager->txn.free_page;
+    pager->header.first_bitmap = pager->txn.first_bitmap;
+    pager->header.is_dirty     = false;
+
+    wal_rollback(pager->wal.log);
+    pager->wal.has_uncommitted = false;
+
+    if (pager->txn.owns_log) {
+        wal_deinit_and_delete(pager);
+        pager->txn.owns_log = false;
+    }
+
+    // The bitmap chain is read again on first use.
+    if (pager->bitmap.is_loaded) array_free(&pager->bitmap.pages);
+    pager->bitmap.is_loaded   = false;
+    pager->bitmap.lowest_free = 0;
+
+    shrink_to_capacity(pager);
+    return true;
+}
+
+// With async I/O the pages are read into free cache slots
+// while the caller goes on. We never prefetch more than half
+// of cache.a1in so that prefetched pages don't push each
+// other out before they get used.
+static void prefetch_async (Pager *pager, Page_Id *ids, u32 count) {
+    u32 budget = MAX(pager->cache.a1in_capacity / 2, 1);
+
+    for (u32 i = 0; (i < count) && budget; ++i) {
+        Page_Id id = ids[i];
+        if ((id == 0) || (id >= pager->db_file_page_count) || map_get(pager, id) || in_wal(pager, id)) continue;
+        if ((pager->cache.slots.count >= pager->cache.capacity) && !find_victim(pager)) break;
+
+        Page *page = get_empty_cache_slot(pager, id);
+        page->ref_count = 0;
+        page->flags |= F_PAGE_IS_LOADING | F_PAGE_IS_PREFETCHED;
+        fs_async_read(pager->fs, pager->db_file, page_id_to_file_offset(pager, id), PSIZE, page->frame, page);
+        budget--;
+    }
+
+    fs_async_submit(pager->fs);
+}
+
+// Hint that the given pages will be requested soon. Pages
+// that are already cached are skipped. Without async I/O
+// runs of adjacent pages are requested from the kernel as
+// a single range.
+void pager_prefetch (Pager *pager, Page_Id *ids, u32 count) {
+    if (fs_async_enabled(pager->fs) && !pager->mmap.base) {
+        prefetch_async(pager, ids, count);
+        return;
+    }
+
+    u32 run_start = 0;
+    u32 run_count = 0;
+
+    for (u32 i = 0; i <= count; ++i) {
+        Page_Id id = (i < count) ? ids[i] : 0;
+        bool skip  = (id == 0) || (id >= pager->db_file_page_count) || map_get(pager, id) || in_wal(pager, id);
+
+        if (run_count && (skip || (id != run_start + run_count))) {
+            fs_prefetch(pager->fs, pager->db_file, page_id_to_file_offset(pager, run_start), (u64)run_count * PSIZE);
+            run_count = 0;
+        }
+
+        if (skip) continue;
+        if (run_count == 0) run_start = id;
+        run_count++;
+    }
+}
+
+static String warm_up_file_path (Pager *pager, DString *ds) {
+    String db_file_path = fs_get_file_path(pager->fs, pager->db_file);
+    ds_add_fmt(ds, "%.*s-hot", db_file_path.count, db_file_path.data);
+    return ds_to_str(ds);
+}
+
+static u32 warm_up_add_list (DString *buf, Page *list) {
+    u32 count = 0;
+
+    for (Page *page = list->lru_next; page != list; page = page->lru_next) {
+        u8 id[4];
+        write_u32_le(id, page->ref.id);
+        ds_add_str(buf, (String){ .data = (char*)id, .count = 4 });
+        count++;
+    }
+
+    return count;
+}
+
+// Warm up file byte layout:
+//   magic:     4
+//   hot_count: 4 (the first hot_count ids are from the hot lists)
+//   count:     4
+//   ids:       4 * count
+//
+// The ids are in the order of the lru lists with the most
+// recently used page first. Pages of the priority lists come
+// first and are reloaded as plain hot pages.
+static void warm_up_save (Pager *pager) {
+    DString buf = ds_new(pager->mem);
+    u8 header[WARM_UP_HEADER_SIZE] = {0};
+    ds_add_str(&buf, (String){ .data = (char*)header, .count = WARM_UP_HEADER_SIZE });
+
+    u32 hot_count = warm_up_add_list(&buf, &pager->cache.pinned);
+    hot_count    += warm_up_add_list(&buf, &pager->cache.high);
+    hot_count    += warm_up_add_list(&buf, &pager->cache.lru);
+    u32 count     = hot_count + warm_up_add_list(&buf, &pager->cache.a1in);
+
+    write_u32_le((u8*)buf.data + 0, WARM_UP_MAGIC);
+    write_u32_le((u8*)buf.data + 4, hot_count);
+    write_u32_le((u8*)buf.data + 8, count);
+
+    DString path = ds_new(pager->mem);
+    File file = fs_open_file(pager->fs, warm_up_file_path(pager, &path));
+    fs_overwrite_file(pager->fs, file, ds_to_str(&buf));
+    fs_close_file(pager->fs, file);
+
+    ds_free(&path);
+    ds_free(&buf);
+}
+
+// Load the pages that were cached when the db was closed the
+// last time. They are read in file order in a single sweep
+// and the ones that were hot go back into the lru list in the
+// same order. Ids that are out of range or free by now are
+// skipped. This must be called before any other page is
+// requested.
+void pager_warm_up (Pager *pager) {
+    if (! pager->warm_up) return;
+
+    DString path  = ds_new(pager->mem);
+    File file     = fs_open_file(pager->fs, warm_up_file_path(pager, &path));
+    u64 file_size = fs_get_file_size(pager->fs, file);
+    String data   = {0};
+    u32 count     = 0;
+    u32 hot_count = 0;
+
+    if ((file_size >= WARM_UP_HEADER_SIZE) && (file_size <= UINT32_MAX)) data = fs_read_entire_file(pager->fs, file, pager->mem);
+    fs_close_file(pager->fs, file);
+    u8 *bytes = (u8*)data.data;
+
+    if (data.count && (read_u32_le(bytes) == WARM_UP_MAGIC)) {
+        hot_count = read_u32_le(bytes + 4);
+        count     = read_u32_le(bytes + 8);
+        if (((u64)count * 4 + WARM_UP_HEADER_SIZE != data.count) || (hot_count > count)) count = hot_count = 0;
+    }
+
+    count     = MIN(count, pager->cache.capacity);
+    hot_count = MIN(hot_count, count);
+
+    if (count && !pager->bitmap.is_loaded) bitmap_load(pager);
+
+    Array(Page_Id) ids;
+    array_init(&ids, pager->mem);
+
+    for (u32 i = 0; i < count; ++i) {
+        Page_Id id = read_u32_le(bytes + WARM_UP_HEADER_SIZE + 4 * i);
+        if ((id == 0) || (id >= pager->db_file_page_count) || bitmap_get(pager, id)) continue;
+        array_add(&ids, id);
     }
+
+    if (ids.count) qsort(ids.data, ids.count, sizeof(Page_Id), cmp_ids);
+    pager_prefetch(pager, (Page_Id*)ids.data, ids.count);
+
+    array_iter (id, ids) {
+        Page_Ref *ref = pager_get_page(pager, id);
+        if (ref) pager_unref_page(pager, ref);
+    }
+
+    // Touching the hot pages from the least recently used one
+    // on restores their order in the lru list.
+    for (u32 i = hot_count; i > 0; --i) {
+        Page *page = map_get(pager, read_u32_le(bytes + WARM_UP_HEADER_SIZE + 4 * (i - 1)));
+        if (page) touch(pager, page);
+    }
+
+    pager->stats = (Pager_Stats){0}; // Only count what happens after the warm up.
+
+    array_free(&ids);
+    ds_free(&path);
+    if (data.count) MEM_FREE(pager->mem, data.data, data.count);
 }
 
+// This must be called before any page is requested.
 void pager_init_user_buffers (Pager *pager, u32 buf_size) {
+    ASSERT(pager->cache.slots.count == 0);
     if (buf_size < 8) buf_size = 8;
+    buf_size += PADDING_TO_ALIGN(buf_size, 8);
     pager->cache.user_buffer_size = buf_size;
-    pager->cache.user_buffers = MEM_ALLOC_Z(pager->mem, pager->cache.capacity * buf_size);
 }
 
+// Set the max number of pages held by the cache. Shrinking
+// the cache writes back and frees unreferenced pages in the
+// order they would have been evicted.
+void pager_set_cache_size (Pager *pager, u32 page_count) {
+    page_count = MAX(page_count, MIN_CACHE_SIZE);
+    pager->cache.capacity = page_count;
+    pager->cache.a1in_capacity = page_count / 4;
+
+    shrink_to_capacity(pager);
+
+    map_resize(pager, MAX(page_count, pager->cache.slots.count));
+
+    { // The ghost history is dropped:
+        MEM_FREE(pager->mem, pager->cache.ghosts.ring, pager->cache.ghosts.capacity * sizeof(Ghost));
+        MEM_FREE(pager->mem, pager->cache.ghosts.map, pager->cache.ghosts.capacity * sizeof(Ghost*));
+        pager->cache.ghosts.capacity = page_count / 2;
+        pager->cache.ghosts.head = 0;
+        pager->cache.ghosts.ring = MEM_ALLOC_Z(pager->mem, pager->cache.ghosts.capacity * sizeof(Ghost));
+        pager->cache.ghosts.map = MEM_ALLOC_Z(pager->mem, pager->cache.ghosts.capacity * sizeof(Ghost*));
+    }
+}
+
+u32 pager_get_cache_size (Pager *pager) {
+    return pager->cache.capacity;
+}
+
+Pager_Stats pager_get_stats (Pager *pager) {
+    return pager->stats;
+}
+
+// The number of bytes per page that the user can use.
 u16 pager_get_page_size (Pager *pager) {
-    return PSIZE;
+    return USABLE_SIZE;
 }
 
 u32 pager_get_ref_count (Page_Ref *ref) {
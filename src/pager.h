@@ -5,21 +5,124 @@
 typedef u32 Page_Id;
 typedef struct Pager Pager;
 
+typedef enum {
+    PAGER_CACHE_2Q,  // Scan resistant. Pages must be missed twice to become hot.
+    PAGER_CACHE_LRU, // Plain least recently used.
+} Pager_Cache_Policy;
+
+// Pages of a higher class are only evicted once there are no
+// unreferenced pages of the lower classes left. Within a class
+// pages are evicted in lru order. See pager_set_priority().
+typedef enum {
+    PAGER_PRIORITY_NORMAL,
+    PAGER_PRIORITY_HIGH,
+    PAGER_PRIORITY_PINNED,
+} Pager_Priority;
+
+typedef enum {
+    PAGER_SYNC_NORMAL, // Sync at checkpoints. Without the wal every flush is one.
+    PAGER_SYNC_OFF,    // Never sync.
+    PAGER_SYNC_FULL,   // Also sync the wal at every commit.
+} Pager_Sync;
+
+typedef enum {
+    PAGER_VERIFY_ALWAYS,     // Every time a page is loaded.
+    PAGER_VERIFY_FIRST_LOAD, // Only the first time a page is loaded.
+    PAGER_VERIFY_SAMPLED,    // Every CHECKSUM_SAMPLE_RATE-th load.
+} Pager_Verify;
+
+typedef struct {
+    // Serve page reads straight out of a read only memory
+    // mapping of the db file instead of copying them into
+    // the cache. Pages are copied on write.
+    bool mmap;
+
+    // Page size used when creating a new db file. Existing files
+    // keep the page size they were created with. (0 = default)
+    u32 page_size;
+
+    // Max number of pages in the cache. If this is 0, then the
+    // cache_size_bytes is used. If that is 0 too, we use the
+    // default size.
+    u32 cache_size;
+    u64 cache_size_bytes;
+
+    Pager_Cache_Policy cache_policy;
+
+    // The db file grows by at least this many bytes at a time.
+    // The space is preallocated on disk, except for compressed
+    // files which only take the space of the compressed pages.
+    // (0 = default)
+    u64 extent_size;
+
+    // Append modified pages to a write-ahead log next to the db
+    // file instead of writing them in place. See wal.h.
+    bool wal;
+
+    Pager_Sync sync;
+
+    // Give every page of a new db file a checksum. Existing files
+    // keep the setting they were created with. The verify mode
+    // only matters for files with checksums.
+    bool checksums;
+    Pager_Verify verify;
+
+    // Compress the pages of a new db file when they are written
+    // into it. Existing files keep the setting they were created
+    // with. Pages in the cache and in the log are not compressed.
+    // Ignored for pages of 4KB or less, which can't get smaller
+    // on disk than one block.
+    bool compression;
+
+    // Remember which pages were cached when the pager is closed
+    // and load them again with pager_warm_up(). The page ids are
+    // kept in a file next to the db file.
+    bool warm_up;
+
+    // Keep this percentage of the tail of the cache lists clean
+    // by writing dirty pages back ahead of eviction. The writes
+    // are done by a background thread and limited to
+    // clean_ahead_rate bytes per second. Has no effect in wal mode,
+    // during a transaction, or with page compression.
+    // (0 = off/unlimited)
+    u32 clean_ahead;
+    u64 clean_ahead_rate;
+} Pager_Options;
+
+typedef struct {
+    u64 hits;
+    u64 misses;
+    u64 evictions;
+    u64 dirty_evictions; // Evictions that had to write the page back first.
+} Pager_Stats;
+
 typedef struct {
     Page_Id id;
     u8 *buf;
     void *user_buf;
 } Page_Ref;
 
-Pager    *pager_new               (Files *, Mem *, String db_file_path);
-Page_Ref *pager_alloc_page        (Pager *);
-void      pager_unref_page        (Pager *, Page_Ref *);
-bool      pager_delete_page       (Pager *, Page_Ref *);
-Page_Ref *pager_get_page          (Pager *, Page_Id);
-Page_Ref *pager_get_page_mutable  (Pager *, Page_Id);
-bool      pager_is_page_mutable   (Pager *, Page_Ref *);
-bool      pager_make_page_mutable (Pager *, Page_Ref *);
-void      pager_init_user_buffers (Pager *, u32 buf_size);
-u16       pager_get_page_size     (Pager *);
-bool      pager_file_is_empty     (Pager *);
-u32       pager_get_ref_count     (Page_Ref *);
+Pager      *pager_new                (Files *, Mem *, String db_file_path, Pager_Options *);
+void        pager_close              (Pager *);
+Page_Ref   *pager_alloc_page         (Pager *);
+void        pager_unref_page         (Pager *, Page_Ref *);
+void        pager_set_priority       (Pager *, Page_Ref *, Pager_Priority);
+void        pager_flush              (Pager *);
+bool        pager_begin              (Pager *);
+bool        pager_commit             (Pager *);
+bool        pager_rollback           (Pager *);
+void        pager_prefetch           (Pager *, Page_Id *ids, u32 count);
+bool        pager_delete_page        (Pager *, Page_Ref *);
+Page_Ref   *pager_get_page           (Pager *, Page_Id);
+Page_Ref   *pager_get_page_mutable   (Pager *, Page_Id);
+bool        pager_is_page_mutable    (Pager *, Page_Ref *);
+bool        pager_make_page_mutable  (Pager *, Page_Ref *);
+void        pager_init_user_buffers  (Pager *, u32 buf_size);
+void        pager_warm_up            (Pager *);
+u16         pager_get_page_size      (Pager *);
+void        pager_set_cache_size     (Pager *, u32 page_count);
+u32         pager_get_cache_size     (Pager *);
+Pager_Stats pager_get_stats          (Pager *);
+bool        pager_is_valid_page_size (u32);
+bool        pager_file_is_empty      (Pager *);
+u32         pager_get_ref_count      (Page_Ref *);
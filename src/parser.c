@@ -920,6 +920,13 @@ static Plan *parse_drop (Parser *P) {
     return finish_node(P, node);
 }
 
+// begin | commit | rollback
+static Plan *parse_transaction (Parser *P, Plan_Tag tag) {
+    Plan *node = start_node(P, tag);
+    lex_eat_token(L);
+    return finish_node(P, node);
+}
+
 static Plan *parse_explain (Parser *P) {
     bool run = lex_try_peek_nth_token(L, 2, TOKEN_RUN);
 
@@ -940,15 +947,18 @@ static Plan *parse_statement_by_tag (Parser *P, Token_Tag tag) {
     eat_semicolons(P, false);
 
     switch (tag) {
-    case TOKEN_DROP:    return parse_drop(P);
-    case TOKEN_INSERT:  return parse_insert(P);
-    case TOKEN_DELETE:  return parse_delete(P);
-    case TOKEN_UPDATE:  return parse_update(P);
-    case TOKEN_SELECT:  return parse_select(P);
-    case TOKEN_CREATE:  return parse_def_table(P);
-    case TOKEN_EXPLAIN: return parse_explain(P);
-    case TOKEN_EOF:     return NULL;
-    default:            error(P, "Invalid statement.");
+    case TOKEN_DROP:     return parse_drop(P);
+    case TOKEN_INSERT:   return parse_insert(P);
+    case TOKEN_DELETE:   return parse_delete(P);
+    case TOKEN_UPDATE:   return parse_update(P);
+    case TOKEN_SELECT:   return parse_select(P);
+    case TOKEN_CREATE:   return parse_def_table(P);
+    case TOKEN_EXPLAIN:  return parse_explain(P);
+    case TOKEN_BEGIN:    return parse_transaction(P, PLAN_BEGIN);
+    case TOKEN_COMMIT:   return parse_transaction(P, PLAN_COMMIT);
+    case TOKEN_ROLLBACK: return parse_transaction(P, PLAN_ROLLBACK);
+    case TOKEN_EOF:      return NULL;
+    default:             error(P, "Invalid statement.");
     }
 }
 
@@ -262,6 +262,12 @@ static void print (DString *ds, Plan *plan, u32 depth) {
         ds_add_str(ds, ((Plan_Drop*)plan)->table);
     } break;
 
+    case PLAN_BEGIN:
+    case PLAN_COMMIT:
+    case PLAN_ROLLBACK: {
+        print_tag(ds, plan);
+    } break;
+
     default: {
         print_expr(ds, plan, false);
     } break;
@@ -42,6 +42,9 @@ struct Type;
     X(PLAN_DELETE, Plan_Delete, "delete", 0, 0)\
     X(PLAN_UPDATE, Plan_Update, "update", 0, 0)\
     X(PLAN_DROP, Plan_Drop, "drop", 0, 0)\
+    X(PLAN_BEGIN, Plan_Begin, "begin", 0, 0)\
+    X(PLAN_COMMIT, Plan_Commit, "commit", 0, 0)\
+    X(PLAN_ROLLBACK, Plan_Rollback, "rollback", 0, 0)\
     X(PLAN_SCAN, Plan_Scan, "scan", 0, 0)\
     X(PLAN_SCAN_DUMMY, Plan_Scan_Dummy, "scan dummy table", F_PLAN_WITHOUT_SOURCE, 0)\
     X(PLAN_AS, Plan_As, "as", 0, PLAN_OP1)\
@@ -135,6 +138,9 @@ struct Plan_Column_Def     { Plan base; String name; };
 struct Plan_Column_Ref     { Plan base; String qualifier, name; u32 idx; String agg_expr; };
 struct Plan_Insert         { Plan base; String table; Array_Plan values; };
 struct Plan_Drop           { Plan base; String table; };
+struct Plan_Begin          { Plan base; };
+struct Plan_Commit         { Plan base; };
+struct Plan_Rollback       { Plan base; };
 struct Plan_Scan           { Plan base; String table, alias; u32 cur; bool done; };
 struct Plan_Scan_Dummy     { Plan base; bool done; };
 struct Plan_Delete         { Plan base; String table; Plan *filter; };
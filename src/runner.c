@@ -463,6 +463,22 @@ static Db_Row *next (Runner *run, Plan *plan) {
         return NULL;
     }
 
+    case PLAN_BEGIN: {
+        if (! bengine_begin(run->engine)) error(run, plan->src, "A transaction is already active.");
+        return NULL;
+    }
+
+    case PLAN_COMMIT: {
+        if (! bengine_commit(run->engine)) error(run, plan->src, "No transaction is active.");
+        return NULL;
+    }
+
+    case PLAN_ROLLBACK: {
+        if (! bengine_rollback(run->engine)) error(run, plan->src, "No transaction is active.");
+        typer_reload_catalog(run->typer);
+        return NULL;
+    }
+
     case PLAN_DELETE: {
         Plan_Delete *P    = (Plan_Delete*)plan;
         Type_Table *table = typer_get_table(run->typer, P->table);
@@ -551,11 +567,14 @@ static Db_Row *next (Runner *run, Plan *plan) {
         }
 
         BTree *tree = table->engine_specific_info;
-        BCursor *cursor = bcursor_new(tree);
+        Val val = { serialize_row(run, &row) };
 
-        bcursor_goto_ukey(cursor, ukey);
-        bcursor_insert(cursor, ukey, (Val){ serialize_row(run, &row) });
-        bcursor_close(cursor);
+        if (! btree_append(tree, ukey, val)) {
+            BCursor *cursor = bcursor_new(tree);
+            bcursor_goto_ukey(cursor, ukey);
+            bcursor_insert(cursor, ukey, val);
+            bcursor_close(cursor);
+        }
 
         return NULL;
     }
@@ -777,7 +796,7 @@ static Db_Row *next (Runner *run, Plan *plan) {
 
         if (P->cur == 0) {
             BTree *tree = table->engine_specific_info;
-            BCursor *cursor = bcursor_new(tree);
+            BCursor *cursor = bcursor_new_read_only(tree);
             array_add(&run->cursors, cursor);
             P->cur = run->cursors.count;
             if (! bcursor_goto_first(cursor)) { P->done = true; return NULL; }
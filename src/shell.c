@@ -3,6 +3,7 @@
 #include <string.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <inttypes.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -24,6 +25,7 @@ typedef struct {
     String prog_name;
     String db_file_path;
     String query_file_path;
+    Db_Options db_options;
 
     struct {
         jmp_buf jmp;
@@ -34,10 +36,41 @@ typedef struct {
 static void print_available_cli_flags (void) {
     printf(
         "Command line options:\n\n"
-        "    -h           Print command line usage.\n"
-        "    -d <path>    Database file path. Cannot be omitted.\n"
-        "    -i <path>    If this flag is omitted, the shell starts.\n"
-        "                 Otherwise, the input file will be run as a query.\n"
+        "    -h                  Print command line usage.\n"
+        "    -d <path>           Database file path. Cannot be omitted. With the\n"
+        "                        path :memory: the database only lives in memory.\n"
+        "    -i <path>           If this flag is omitted, the shell starts.\n"
+        "                        Otherwise, the input file will be run as a query.\n"
+        "    -mmap               Read pages straight out of a memory mapping of\n"
+        "                        the database file.\n"
+        "    -page-size <n>      Page size in bytes for a new database file.\n"
+        "    -cache-pages <n>    Capacity of the page cache in pages.\n"
+        "    -cache-size <size>  Capacity of the page cache in bytes. The\n"
+        "                        size can have a KB, MB or GB suffix.\n"
+        "    -cache-policy <p>   Page replacement policy: 2q (default) or lru.\n"
+        "    -extent-size <size> The db file grows by at least this many bytes\n"
+        "                        at a time. The default is 1MB.\n"
+        "    -io-uring           Do asynchronous page I/O through io_uring if\n"
+        "                        the system supports it.\n"
+        "    -wal                Write modified pages to a write-ahead log\n"
+        "                        that is copied into the database file at\n"
+        "                        checkpoints.\n"
+        "    -durability <d>     When to sync: off, normal (default, at\n"
+        "                        checkpoints) or full (also at every commit).\n"
+        "    -checksums          Store a checksum in every page of a new\n"
+        "                        database file.\n"
+        "    -verify <v>         When to verify page checksums: always\n"
+        "                        (default), first (first load of a page) or\n"
+        "                        sampled (every 16th load).\n"
+        "    -compression        Compress the pages of a new database file\n"
+        "                        on disk. Needs a page size above 4KB.\n"
+        "    -warm-up            Save the set of cached pages on exit and\n"
+        "                        load it back into the cache on startup.\n"
+        "    -clean-ahead <n>    Write dirty pages in the last <n> percent of\n"
+        "                        the cache back ahead of eviction, from a\n"
+        "                        background thread. Not with -wal.\n"
+        "    -clean-ahead-rate <size>\n"
+        "                        Max bytes per second written by -clean-ahead.\n"
         "\n"
     );
 }
@@ -84,6 +117,22 @@ static char *plex_eat_token (Prompt_Lexer *lex, char *msg) {
     return tok;
 }
 
+// Parses a number with an optional KB, MB or GB suffix.
+static u64 parse_size (Shell *sh, char *tok) {
+    char *end;
+    u64 result = strtoull(tok, &end, 10);
+
+    if (end == tok) error(sh, "Expected a number instead of '%s'.", tok);
+
+    if      (! strcmp(end, ""))   {}
+    else if (! strcmp(end, "KB")) result *= KB;
+    else if (! strcmp(end, "MB")) result *= MB;
+    else if (! strcmp(end, "GB")) result *= GB;
+    else error(sh, "Invalid size suffix in '%s'.", tok);
+
+    return result;
+}
+
 static void cli_parse (Shell *sh, int argc, char **argv) {
     Prompt_Lexer lex = plex_new(sh, argv);
 
@@ -101,6 +150,47 @@ static void cli_parse (Shell *sh, int argc, char **argv) {
             sh->query_file_path = str(plex_eat_token(&lex, "Missing argument for '-i' flag."));
         } else if (! strcmp(tok, "-d")) {
             sh->db_file_path = str(plex_eat_token(&lex, "Missing argument for '-d' flag."));
+        } else if (! strcmp(tok, "-mmap")) {
+            sh->db_options.mmap = true;
+        } else if (! strcmp(tok, "-extent-size")) {
+            sh->db_options.extent_size = parse_size(sh, plex_eat_token(&lex, "Missing argument for '-extent-size' flag."));
+        } else if (! strcmp(tok, "-io-uring")) {
+            sh->db_options.io_uring = true;
+        } else if (! strcmp(tok, "-wal")) {
+            sh->db_options.wal = true;
+        } else if (! strcmp(tok, "-page-size")) {
+            sh->db_options.page_size = (u32)parse_size(sh, plex_eat_token(&lex, "Missing argument for '-page-size' flag."));
+        } else if (! strcmp(tok, "-cache-pages")) {
+            sh->db_options.cache_pages = (u32)parse_size(sh, plex_eat_token(&lex, "Missing argument for '-cache-pages' flag."));
+        } else if (! strcmp(tok, "-cache-size")) {
+            sh->db_options.cache_bytes = parse_size(sh, plex_eat_token(&lex, "Missing argument for '-cache-size' flag."));
+        } else if (! strcmp(tok, "-cache-policy")) {
+            char *policy = plex_eat_token(&lex, "Missing argument for '-cache-policy' flag.");
+            if      (! strcmp(policy, "2q"))  sh->db_options.cache_policy = DB_CACHE_2Q;
+            else if (! strcmp(policy, "lru")) sh->db_options.cache_policy = DB_CACHE_LRU;
+            else error(sh, "Unknown cache policy '%s'.", policy);
+        } else if (! strcmp(tok, "-durability")) {
+            char *durability = plex_eat_token(&lex, "Missing argument for '-durability' flag.");
+            if      (! strcmp(durability, "off"))    sh->db_options.durability = DB_DURABILITY_OFF;
+            else if (! strcmp(durability, "normal")) sh->db_options.durability = DB_DURABILITY_NORMAL;
+            else if (! strcmp(durability, "full"))   sh->db_options.durability = DB_DURABILITY_FULL;
+            else error(sh, "Unknown durability level '%s'.", durability);
+        } else if (! strcmp(tok, "-checksums")) {
+            sh->db_options.checksums = true;
+        } else if (! strcmp(tok, "-verify")) {
+            char *verify = plex_eat_token(&lex, "Missing argument for '-verify' flag.");
+            if      (! strcmp(verify, "always"))  sh->db_options.verify = DB_VERIFY_ALWAYS;
+            else if (! strcmp(verify, "first"))   sh->db_options.verify = DB_VERIFY_FIRST_LOAD;
+            else if (! strcmp(verify, "sampled")) sh->db_options.verify = DB_VERIFY_SAMPLED;
+            else error(sh, "Unknown verify mode '%s'.", verify);
+        } else if (! strcmp(tok, "-compression")) {
+            sh->db_options.compression = true;
+        } else if (! strcmp(tok, "-warm-up")) {
+            sh->db_options.warm_up = true;
+        } else if (! strcmp(tok, "-clean-ahead")) {
+            sh->db_options.clean_ahead = (u32)parse_size(sh, plex_eat_token(&lex, "Missing argument for '-clean-ahead' flag."));
+        } else if (! strcmp(tok, "-clean-ahead-rate")) {
+            sh->db_options.clean_ahead_rate = parse_size(sh, plex_eat_token(&lex, "Missing argument for '-clean-ahead-rate' flag."));
         } else {
             error(sh, "Unknown command line argument: %s", tok);
         }
@@ -108,6 +198,14 @@ static void cli_parse (Shell *sh, int argc, char **argv) {
 
     if (help_flag_set) print_available_cli_flags();
 
+    if (sh->db_options.compression && sh->db_options.page_size && (sh->db_options.page_size <= 4*KB)) {
+        error(sh, "The '-compression' flag needs a page size above 4KB.");
+    }
+
+    if (sh->db_options.clean_ahead && sh->db_options.wal) {
+        error(sh, "The '-clean-ahead' flag can't be combined with '-wal'.");
+    }
+
     if (! sh->db_file_path.data) {
         if (help_flag_set) longjmp(sh->error.jmp, 1);
         error(sh, "The '-d' flag is missing.");
@@ -117,8 +215,14 @@ static void cli_parse (Shell *sh, int argc, char **argv) {
 static void print_available_commands (void) {
     printf(
         "Available commands:\n\n"
-        "    -h             Print available commands.\n"
-        "    -run <path>    Run the file at <path> as a query.\n"
+        "    -h                    Print available commands.\n"
+        "    -run <path>           Run the file at <path> as a query.\n"
+        "    -cache-pages <n>      Resize the page cache to <n> pages.\n"
+        "    -cache-size <size>    Resize the page cache to <size> bytes.\n"
+        "    -pin <table>          Load <table> into the page cache and keep it there.\n"
+        "    -unpin <table>        Let the pages of <table> be evicted as usual again.\n"
+        "    -stats                Print page cache hit, miss and eviction counts\n"
+        "                          and the number and latency of file syncs.\n"
         "\n"
     );
 }
@@ -146,6 +250,23 @@ static void eval_command (Shell *sh, char *line, Mem_Arena *arena) {
             char *path = plex_eat_token(&lex, "Missing argument for '-run' command.");
             String query = fs_read_entire_file_p(sh->fs, str(path), (Mem*)arena);
             run_query(sh, query, (Mem*)arena);
+        } else if (! strcmp(tok, "-cache-pages")) {
+            char *size = plex_eat_token(&lex, "Missing argument for '-cache-pages' command.");
+            db_set_cache_pages(sh->db, (u32)parse_size(sh, size));
+        } else if (! strcmp(tok, "-cache-size")) {
+            char *size = plex_eat_token(&lex, "Missing argument for '-cache-size' command.");
+            db_set_cache_size(sh->db, parse_size(sh, size));
+        } else if (! strcmp(tok, "-pin") || ! strcmp(tok, "-unpin")) {
+            bool pin = ! strcmp(tok, "-pin");
+            char *table = plex_eat_token(&lex, pin ? "Missing argument for '-pin' command." : "Missing argument for '-unpin' command.");
+            if (db_pin_table(sh->db, str(table), pin) != DB_OK) error(sh, "The table '%s' doesn't exist.", table);
+        } else if (! strcmp(tok, "-stats")) {
+            Db_Cache_Stats stats = db_get_cache_stats(sh->db);
+            printf("hits: %" PRIu64 ", misses: %" PRIu64 ", evictions: %" PRIu64 " (dirty: %" PRIu64 ")\n", stats.hits, stats.misses, stats.evictions, stats.dirty_evictions);
+
+            Db_Sync_Stats syncs = db_get_sync_stats(sh->db);
+            double avg_ms = syncs.count ? (double)syncs.total_ns / (double)syncs.count / 1e6 : 0;
+            printf("syncs: %" PRIu64 ", avg: %.3fms, max: %.3fms\n", syncs.count, avg_ms, (double)syncs.max_ns / 1e6);
         } else {
             error(sh, "The command '%s' is unknown.", tok);
         }
@@ -228,7 +349,9 @@ int main (int argc, char **argv) {
 
     cli_parse(&sh, argc, argv);
 
-    db_init(&sh.db, sh.db_file_path, NULL);
+    if (db_init(&sh.db, sh.db_file_path, NULL, &sh.db_options) != DB_OK) {
+        error(&sh, "Could not open the database. Either the file is corrupt or larger than 2^32 pages, or the page size is not a power of two between 512 and 32KB.");
+    }
 
     if (sh.query_file_path.data) {
         String query = fs_read_entire_file_p(sh.fs, sh.query_file_path, (Mem*)sh.mem_root);
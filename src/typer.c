@@ -23,6 +23,7 @@ struct Typer {
 
     Mem *mem;
     Array(Type_Table*) tables;
+    Array(String) pinned_tables; // See typer_pin_table().
 
     Type *type_int;
     Type *type_bool;
@@ -63,6 +64,7 @@ Typer *typer_new (Database *db, Mem *mem) {
     typer->db = db;
     typer->mem = mem;
     array_init(&typer->tables, mem);
+    array_init(&typer->pinned_tables, mem);
 
     typer->type_int      = type_new(TYPE_INT, mem);
     typer->type_bool     = type_new(TYPE_BOOL, mem);
@@ -123,11 +125,35 @@ static Type_Table *create_table_from_plan (Typer *typer, Plan_Table_Def *plan) {
     return table;
 }
 
+// The CATALOG is kept in the cache ahead of the user tables
+// since the schema of the whole db depends on it.
+static Pager_Priority get_table_priority (Typer *typer, String name) {
+    array_iter (pinned, typer->pinned_tables) if (str_match(pinned, name)) return PAGER_PRIORITY_PINNED;
+    if (str_match(name, str("CATALOG"))) return PAGER_PRIORITY_HIGH;
+    return PAGER_PRIORITY_NORMAL;
+}
+
+static void load_table_priority (Typer *typer, Type_Table *table) {
+    Pager_Priority priority = get_table_priority(typer, array_get_first(&table->row->scopes)->name);
+    if (priority != PAGER_PRIORITY_NORMAL) btree_set_priority(table->engine_specific_info, priority);
+}
+
+static void forget_pinned_table (Typer *typer, String name) {
+    array_iter (pinned, typer->pinned_tables) {
+        if (str_match(pinned, name)) {
+            MEM_FREE(typer->mem, pinned.data, pinned.count);
+            array_remove_fast(&typer->pinned_tables, ARRAY_IDX);
+            break;
+        }
+    }
+}
+
 static void create_table_from_sql (Typer *typer, Mem *mem, String sql, s64 engine_tag) {
     Plan *plan = parse_the_statement(sql, mem, TOKEN_CREATE, NULL);
     Type_Table *table_type = create_table_from_plan(typer, (Plan_Table_Def*)plan);
     BEngine *engine = db_get_engine(typer->db);
     table_type->engine_specific_info = btree_load(engine, table_type, engine_tag);
+    load_table_priority(typer, table_type);
 }
 
 bool typer_add_table (Typer *typer, Plan_Table_Def *plan) {
@@ -137,6 +163,7 @@ bool typer_add_table (Typer *typer, Plan_Table_Def *plan) {
 
     { // Create on-disk table:
         table_type->engine_specific_info = btree_new(db_get_engine(typer->db), table_type);
+        load_table_priority(typer, table_type);
     }
 
     { // Create on-disk schema:
@@ -175,6 +202,7 @@ void typer_del_table (Typer *typer, String table_name) {
     }
 
     { // Delete in-memory schema:
+        forget_pinned_table(typer, table_name);
         array_find_remove_fast(&typer->tables, table);
         mem_arena_destroy(table->mem);
     }
@@ -212,6 +240,30 @@ void typer_init_catalog (Typer *typer, bool db_is_empty) {
     mem_arena_destroy(arena);
 }
 
+// Drop the in-memory schema and load it again from the
+// CATALOG table. This is used after a rollback.
+void typer_reload_catalog (Typer *typer) {
+    array_iter (table, typer->tables) mem_arena_destroy(table->mem);
+    array_clear(&typer->tables);
+    typer_init_catalog(typer, false);
+}
+
+// A pinned table is loaded into the cache entirely and it's
+// pages are only evicted if nothing else can be. Pins are not
+// saved in the db file. They survive a reload of the catalog
+// and get dropped together with the table. Returns false if
+// there is no such table.
+bool typer_pin_table (Typer *typer, String name, bool pin) {
+    Type_Table *table = typer_get_table(typer, name);
+    if (! table) return false;
+
+    forget_pinned_table(typer, name);
+    if (pin) array_add(&typer->pinned_tables, str_copy(typer->mem, name));
+    btree_set_priority(table->engine_specific_info, get_table_priority(typer, name));
+
+    return true;
+}
+
 Type_Table *typer_get_table (Typer *typer, String name) {
     array_iter (table, typer->tables) {
         String table_name = array_get_first(&table->row->scopes)->name;
@@ -285,6 +337,12 @@ static void check (Typer *typer, Plan *plan) {
         plan->type = typer->type_void;
     } break;
 
+    case PLAN_BEGIN:
+    case PLAN_COMMIT:
+    case PLAN_ROLLBACK: {
+        plan->type = typer->type_void;
+    } break;
+
     case PLAN_TABLE_DEF: {
         Plan_Table_Def *P = (Plan_Table_Def*)plan;
 
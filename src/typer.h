@@ -62,10 +62,12 @@ struct Type_Table {
 
 typedef struct Typer Typer;
 
-Typer       *typer_new          (struct Database *, Mem *);
-void         typer_init_catalog (Typer *, bool db_is_empty);
-bool         typer_check        (Typer *, Plan *, String, Mem *, DString *, bool user_is_admin);
-bool         typer_add_table    (Typer *, Plan_Table_Def *);
-void         typer_del_table    (Typer *, String);
-Type_Table  *typer_get_table    (Typer *, String);
-Type_Column *typer_get_col_type (Type_Row *, u32 column_idx);
+Typer       *typer_new            (struct Database *, Mem *);
+void         typer_init_catalog   (Typer *, bool db_is_empty);
+void         typer_reload_catalog (Typer *);
+bool         typer_check          (Typer *, Plan *, String, Mem *, DString *, bool user_is_admin);
+bool         typer_add_table      (Typer *, Plan_Table_Def *);
+void         typer_del_table      (Typer *, String);
+Type_Table  *typer_get_table      (Typer *, String);
+bool         typer_pin_table      (Typer *, String, bool pin);
+Type_Column *typer_get_col_type   (Type_Row *, u32 column_idx);
@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "error.h"
+
+// The ring buffers are shared with the kernel. We are the
+// only producer of the submission queue and the only
+// consumer of the completion queue, so we only need to
+// synchronize on the indices that the kernel writes to.
+#define LOAD_ACQUIRE(PTR)       __atomic_load_n(PTR, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(PTR, VAL) __atomic_store_n(PTR, VAL, __ATOMIC_RELEASE)
+
+struct Uring {
+    Mem *mem;
+    int fd;
+    u32 in_flight; // Queued or submitted but not yet reaped.
+
+    struct {
+        u32 *head;
+        u32 *tail;
+        u32 *mask;
+        u32 *array;
+        u32 entries;
+        u32 unsubmitted;
+        struct io_uring_sqe *sqes;
+    } sq;
+
+    struct {
+        u32 *head;
+        u32 *tail;
+        u32 *mask;
+        struct io_uring_cqe *cqes;
+    } cq;
+
+    u8 *sq_ring;
+    u8 *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static int sys_setup (u32 entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter (int fd, u32 to_submit, u32 min_complete, u32 flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void unmap_rings (Uring *ring) {
+    if (ring->sq.sqes) munmap(ring->sq.sqes, ring->sqes_size);
+    if (ring->cq_ring && (ring->cq_ring != ring->sq_ring)) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+}
+
+static void *map_ring (int fd, size_t size, off_t offset) {
+    void *result = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return (result == MAP_FAILED) ? NULL : result;
+}
+
+// Returns NULL if io_uring is not available (old kernel,
+// seccomp filter, ...) in which case the caller should fall
+// back to blocking I/O.
+Uring *uring_new (Mem *mem, u32 entries) {
+    struct io_uring_params params = {0};
+    int fd = sys_setup(entries, &params);
+    if (fd < 0) return NULL;
+
+    Uring *ring = MEM_ALLOC_Z(mem, sizeof(Uring));
+    ring->mem = mem;
+    ring->fd  = fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+        ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->sq_ring = map_ring(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+        ring->cq_ring = map_ring(fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    }
+
+    ring->sq.sqes = map_ring(fd, ring->sqes_size, IORING_OFF_SQES);
+
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sq.sqes) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq.head    = (u32*)(ring->sq_ring + params.sq_off.head);
+    ring->sq.tail    = (u32*)(ring->sq_ring + params.sq_off.tail);
+    ring->sq.mask    = (u32*)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq.array   = (u32*)(ring->sq_ring + params.sq_off.array);
+    ring->sq.entries = params.sq_entries;
+    ring->cq.head    = (u32*)(ring->cq_ring + params.cq_off.head);
+    ring->cq.tail    = (u32*)(ring->cq_ring + params.cq_off.tail);
+    ring->cq.mask    = (u32*)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cq.cqes    = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+
+    return ring;
+}
+
+// Requests that are still in flight must be reaped first.
+void uring_destroy (Uring *ring) {
+    ASSERT(ring->in_flight == 0);
+    unmap_rings(ring);
+    close(ring->fd);
+    MEM_FREE(ring->mem, ring, sizeof(Uring));
+}
+
+// Returns false if the ring is full. In that case at least
+// one completion has to be reaped with uring_wait() first.
+static bool queue (Uring *ring, u8 opcode, int fd, u8 *buf, u32 amount, u64 offset, u64 user_data) {
+    if (ring->in_flight == ring->sq.entries) return false;
+
+    u32 tail = *ring->sq.tail;
+    u32 idx  = tail & *ring->sq.mask;
+    struct io_uring_sqe *sqe = &ring->sq.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (u64)(uintptr_t)buf;
+    sqe->len       = amount;
+    sqe->off       = offset;
+    sqe->user_data = user_data;
+
+    ring->sq.array[idx] = idx;
+    STORE_RELEASE(ring->sq.tail, tail + 1);
+    ring->sq.unsubmitted++;
+    ring->in_flight++;
+
+    return true;
+}
+
+bool uring_queue_read (Uring *ring, int fd, u8 *buf, u32 amount, u64 offset, u64 user_data) {
+    return queue(ring, IORING_OP_READ, fd, buf, amount, offset, user_data);
+}
+
+bool uring_queue_write (Uring *ring, int fd, u8 *buf, u32 amount, u64 offset, u64 user_data) {
+    return queue(ring, IORING_OP_WRITE, fd, buf, amount, offset, user_data);
+}
+
+void uring_submit (Uring *ring) {
+    while (ring->sq.unsubmitted) {
+        int n = sys_enter(ring->fd, ring->sq.unsubmitted, 0, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) panic_fmt("io_uring submission failed.");
+        ring->sq.unsubmitted -= (u32)n;
+    }
+}
+
+// Block until a request completes. The result is the same
+// as the return value of the corresponding pread/pwrite
+// except that errors are reported as -errno.
+void uring_wait (Uring *ring, u64 *out_user_data, s32 *out_result) {
+    ASSERT(ring->in_flight);
+    uring_submit(ring);
+
+    while (! uring_peek(ring, out_user_data, out_result)) {
+        int n = sys_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if (n < 0 && errno != EINTR) panic_fmt("io_uring wait failed.");
+    }
+}
+
+// Like uring_wait() but returns false instead of blocking
+// if no request has completed yet.
+bool uring_peek (Uring *ring, u64 *out_user_data, s32 *out_result) {
+    u32 head = *ring->cq.head;
+    if (head == LOAD_ACQUIRE(ring->cq.tail)) return false;
+
+    struct io_uring_cqe *cqe = &ring->cq.cqes[head & *ring->cq.mask];
+    *out_user_data = cqe->user_data;
+    *out_result    = cqe->res;
+    STORE_RELEASE(ring->cq.head, head + 1);
+    ring->in_flight--;
+    return true;
+}
+
+u32 uring_in_flight (Uring *ring) {
+    return ring->in_flight;
+}
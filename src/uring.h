@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.h"
+#include "memory.h"
+
+// =============================================================================
+// A minimal io_uring wrapper built on the raw syscalls.
+//
+// Requests are queued with uring_queue_read/write() and are
+// submitted to the kernel in batches either by uring_submit()
+// or by uring_wait(). Every request carries a user_data value
+// that is handed back together with the result on completion.
+// =============================================================================
+typedef struct Uring Uring;
+
+Uring *uring_new         (Mem *, u32 entries);
+void   uring_destroy     (Uring *);
+bool   uring_queue_read  (Uring *, int fd, u8 *buf, u32 amount, u64 offset, u64 user_data);
+bool   uring_queue_write (Uring *, int fd, u8 *buf, u32 amount, u64 offset, u64 user_data);
+void   uring_submit      (Uring *);
+void   uring_wait        (Uring *, u64 *out_user_data, s32 *out_result);
+bool   uring_peek        (Uring *, u64 *out_user_data, s32 *out_result);
+u32    uring_in_flight   (Uring *);
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+
+#include "wal.h"
+#include "map.h"
+#include "array.h"
+#include "error.h"
+
+#define WAL_MAGIC             0x4c415744
+#define WAL_HEADER_SIZE       16
+#define FRAME_HEADER_SIZE     16
+#define MAX_FRAMES_PER_WRITE  64
+
+// Log header byte layout:
+//   magic:      4
+//   page_size:  4
+//   salt:       4
+//   reserved:   4
+//
+// Frame header byte layout:
+//   page_id:    4
+//   commit:     4 (1 if this is the last frame of a commit)
+//   salt:       4 (must match the log header)
+//   checksum:   4 (over the frame header fields above and the page)
+//
+// The salt changes every time the log starts over, so frames
+// left over from an earlier round are not mistaken for new ones.
+struct Wal {
+    Mem *mem;
+    Files *fs;
+    File file;
+    u32 page_size;
+    u32 salt;
+    u8 *buffer; // Room for MAX_FRAMES_PER_WRITE frames.
+
+    // If sync is false, the log and the db file are never synced.
+    // Otherwise a checkpoint syncs both of them. Commits are only
+    // synced if the caller asks for it with wal_sync().
+    bool sync;
+    bool is_synced; // No frames were written since the last sync.
+
+    u32 frame_count; // Frames written in the current round.
+    u32 commit_frame_count; // Frames up to and including the last commit frame.
+
+    // Maps a Page_Id to the index of the frame with the latest
+    // version of that page. The index includes frames of the
+    // current uncommitted batch, but after a crash only frames
+    // up to the last commit frame are recovered.
+    Map_u32_u32 index;
+};
+
+static u32 frame_size (Wal *wal) {
+    return FRAME_HEADER_SIZE + wal->page_size;
+}
+
+static u64 frame_offset (Wal *wal, u32 frame) {
+    return WAL_HEADER_SIZE + (u64)frame * frame_size(wal);
+}
+
+// FNV-1a
+static u32 checksum (u8 *data, u32 count, u32 hash) {
+    for (u32 i = 0; i < count; ++i) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+static u32 frame_checksum (Wal *wal, u8 *frame) {
+    u32 hash = checksum(frame, 12, 2166136261u);
+    return checksum(frame + FRAME_HEADER_SIZE, wal->page_size, hash);
+}
+
+static void write_header (Wal *wal) {
+    u8 buf[WAL_HEADER_SIZE] = {0};
+    write_u32_le(buf + 0, WAL_MAGIC);
+    write_u32_le(buf + 4, wal->page_size);
+    write_u32_le(buf + 8, wal->salt);
+    fs_write_to_file(wal->fs, wal->file, (String){ .data = (char*)buf, .count = WAL_HEADER_SIZE }, 0);
+}
+
+// Drop all frames and start the log over. The new header is
+// synced right away. Otherwise the frames of the new round could
+// overwrite old ones while the old salt is still on disk, and a
+// recovery would apply stale page versions.
+void wal_reset (Wal *wal) {
+    wal->salt++;
+    wal->frame_count = 0;
+    wal->commit_frame_count = 0;
+    map_free(&wal->index);
+    map_init(&wal->index, wal->mem);
+    write_header(wal);
+    wal->is_synced = false;
+    wal_sync(wal);
+}
+
+// Rebuild the index from the frames in the log. We stop at
+// the first frame that is torn or left over from an earlier
+// round. Frames after the last commit frame are dropped.
+static void recover (Wal *wal) {
+    u64 file_size = fs_get_file_size(wal->fs, wal->file);
+    u8 header[WAL_HEADER_SIZE];
+
+    if (file_size >= WAL_HEADER_SIZE) {
+        fs_read_from_file(wal->fs, wal->file, 0, WAL_HEADER_SIZE, header);
+    }
+
+    if ((file_size < WAL_HEADER_SIZE) || (read_u32_le(header) != WAL_MAGIC) || (read_u32_le(header + 4) != wal->page_size)) {
+        wal->salt = (u32)rand();
+        wal_reset(wal);
+        return;
+    }
+
+    wal->salt = read_u32_le(header + 8);
+
+    Array(u32) pending;
+    array_init(&pending, wal->mem);
+
+    u8 *frame = wal->buffer;
+    u32 committed_frames = 0;
+
+    for (u32 i = 0; frame_offset(wal, i + 1) <= file_size; ++i) {
+        fs_read_from_file(wal->fs, wal->file, frame_offset(wal, i), frame_size(wal), frame);
+
+        if (read_u32_le(frame + 8) != wal->salt) break;
+        if (read_u32_le(frame + 12) != frame_checksum(wal, frame)) break;
+
+        array_add(&pending, i);
+
+        if (read_u32_le(frame + 4)) {
+            array_iter (idx, pending) {
+                fs_read_from_file(wal->fs, wal->file, frame_offset(wal, idx), 4, frame);
+                map_add(&wal->index, read_u32_le(frame), idx);
+            }
+
+            array_clear(&pending);
+            committed_frames = i + 1;
+        }
+    }
+
+    array_free(&pending);
+    wal->frame_count = committed_frames;
+    wal->commit_frame_count = committed_frames;
+}
+
+static String log_file_path (String db_file_path, DString *ds) {
+    ds_add_fmt(ds, "%.*s-wal", db_file_path.count, db_file_path.data);
+    return ds_to_str(ds);
+}
+
+// Returns true if a log was left next to the db file. It may
+// hold commits that never made it into the db file.
+bool wal_exists (Files *fs, Mem *mem, String db_file_path) {
+    DString path = ds_new(mem);
+    bool exists = fs_file_exists(fs, log_file_path(db_file_path, &path));
+    ds_free(&path);
+    return exists;
+}
+
+// The log must be closed.
+void wal_delete (Files *fs, Mem *mem, String db_file_path) {
+    DString path = ds_new(mem);
+    fs_delete_file(fs, log_file_path(db_file_path, &path));
+    ds_free(&path);
+}
+
+Wal *wal_open (Files *fs, Mem *mem, String db_file_path, u32 page_size, bool sync) {
+    Wal *wal       = MEM_ALLOC_Z(mem, sizeof(Wal));
+    wal->mem       = mem;
+    wal->fs        = fs;
+    wal->sync      = sync;
+    wal->is_synced = true;
+    wal->page_size = page_size;
+    wal->buffer    = MEM_ALLOC(mem, MAX_FRAMES_PER_WRITE * frame_size(wal));
+
+    DString path = ds_new(mem);
+    wal->file = fs_open_file(fs, log_file_path(db_file_path, &path));
+    ds_free(&path);
+
+    map_init(&wal->index, mem);
+    recover(wal);
+
+    return wal;
+}
+
+// The log must have been checkpointed if the caller wants
+// the db file to be complete without it.
+void wal_close (Wal *wal) {
+    fs_close_file(wal->fs, wal->file);
+    map_free(&wal->index);
+    MEM_FREE(wal->mem, wal->buffer, MAX_FRAMES_PER_WRITE * frame_size(wal));
+    MEM_FREE(wal->mem, wal, sizeof(Wal));
+}
+
+bool wal_has_page (Wal *wal, Page_Id id) {
+    u32 frame;
+    return map_get(&wal->index, id, &frame);
+}
+
+// Returns false if the page is not in the log.
+bool wal_read_page (Wal *wal, Page_Id id, u8 *out) {
+    u32 frame;
+    if (! map_get(&wal->index, id, &frame)) return false;
+    fs_read_from_file(wal->fs, wal->file, frame_offset(wal, frame) + FRAME_HEADER_SIZE, wal->page_size, out);
+    return true;
+}
+
+// Append the pages to the log. If commit is true, the last
+// page is written as a commit frame.
+void wal_write_pages (Wal *wal, Page_Id *ids, u8 **pages, u32 count, bool commit) {
+    while (count) {
+        u32 batch = MIN(count, MAX_FRAMES_PER_WRITE);
+        u64 offset = frame_offset(wal, wal->frame_count);
+
+        for (u32 i = 0; i < batch; ++i) {
+            u8 *frame = wal->buffer + i * frame_size(wal);
+            bool is_commit = commit && (batch == count) && (i == batch - 1);
+
+            write_u32_le(frame + 0, ids[i]);
+            write_u32_le(frame + 4, is_commit);
+            write_u32_le(frame + 8, wal->salt);
+            memcpy(frame + FRAME_HEADER_SIZE, pages[i], wal->page_size);
+            write_u32_le(frame + 12, frame_checksum(wal, frame));
+
+            map_add(&wal->index, ids[i], wal->frame_count + i);
+        }
+
+        fs_write_to_file(wal->fs, wal->file, (String){ .data = (char*)wal->buffer, .count = batch * frame_size(wal) }, offset);
+
+        wal->frame_count += batch;
+        if (commit && (batch == count)) wal->commit_frame_count = wal->frame_count;
+        ids   += batch;
+        pages += batch;
+        count -= batch;
+    }
+
+    wal->is_synced = false;
+}
+
+// Drop the frames written since the last commit. The index
+// is rebuilt from the committed frames, and the dropped frames
+// get overwritten by the next ones. Until then recovery skips
+// them like any other frames without a commit frame.
+void wal_rollback (Wal *wal) {
+    if (wal->frame_count == wal->commit_frame_count) return;
+
+    map_free(&wal->index);
+    map_init(&wal->index, wal->mem);
+
+    u8 *header = wal->buffer;
+
+    for (u32 i = 0; i < wal->commit_frame_count; ++i) {
+        fs_read_from_file(wal->fs, wal->file, frame_offset(wal, i), 4, header);
+        map_add(&wal->index, read_u32_le(header), i);
+    }
+
+    wal->frame_count = wal->commit_frame_count;
+}
+
+// Returns true if the latest version of the page in the log
+// was written after the last commit.
+bool wal_is_uncommitted (Wal *wal, Page_Id id) {
+    u32 frame;
+    return map_get(&wal->index, id, &frame) && (frame >= wal->commit_frame_count);
+}
+
+void wal_sync (Wal *wal) {
+    if (!wal->sync || wal->is_synced) return;
+    fs_sync(wal->fs, wal->file);
+    wal->is_synced = true;
+}
+
+static int cmp_slots_by_page (const void *a, const void *b) {
+    u32 A = ((Map_Slot_u32_u32*)a)->key;
+    u32 B = ((Map_Slot_u32_u32*)b)->key;
+    return (A > B) - (A < B);
+}
+
+// Copy the latest version of each page into the db file in
+// file order, make it durable and then start the log over.
+// This must only be called right after a commit. The log is
+// started over even if it's empty, which also gets rid of any
+// torn frames that recovery stopped at. If a writer is given
+// it's used instead of writing the pages directly.
+void wal_checkpoint (Wal *wal, File db_file, Wal_Page_Writer *writer, void *ctx) {
+    wal_sync(wal); // The frames must survive a crash in the middle of copying.
+
+    Array(Map_Slot_u32_u32) slots;
+    array_init(&slots, wal->mem);
+    map_iter_slot (slot, wal->index) array_add(&slots, *slot);
+    if (slots.count) qsort(slots.data, slots.count, sizeof(Map_Slot_u32_u32), cmp_slots_by_page);
+
+    u8 *page = wal->buffer;
+
+    array_iter (slot, slots) {
+        fs_read_from_file(wal->fs, wal->file, frame_offset(wal, slot.val) + FRAME_HEADER_SIZE, wal->page_size, page);
+
+        if (writer) {
+            writer(ctx, slot.key, page);
+        } else {
+            fs_write_to_file(wal->fs, db_file, (String){ .data = (char*)page, .count = wal->page_size }, (u64)slot.key * wal->page_size);
+        }
+    }
+
+    array_free(&slots);
+    if (wal->sync) fs_sync(wal->fs, db_file);
+    wal_reset(wal);
+}
+
+u32 wal_frame_count (Wal *wal) {
+    return wal->frame_count;
+}
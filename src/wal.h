@@ -0,0 +1,37 @@
+#pragma once
+
+#include "files.h"
+#include "pager.h"
+
+typedef struct Wal Wal;
+
+// Used by wal_checkpoint() to write a page into the db file
+// if the db file doesn't store pages as they are.
+typedef void Wal_Page_Writer (void *ctx, Page_Id, u8 *page);
+
+// =============================================================================
+// A write-ahead log kept in a file next to the db file.
+//
+// Modified pages are appended to the log as frames instead of
+// being written into the db file. A batch of frames is only
+// recovered after a crash if its last frame was written as a
+// commit frame, and it's durable once the log is synced. Readers
+// have to look into the log before the db file since the log
+// holds the latest version of a page. A checkpoint copies the
+// latest version of every page into the db file and then
+// starts the log over. Frames written since the last commit
+// can be dropped again with wal_rollback().
+// =============================================================================
+bool  wal_exists         (Files *, Mem *, String db_file_path);
+void  wal_delete         (Files *, Mem *, String db_file_path);
+Wal  *wal_open           (Files *, Mem *, String db_file_path, u32 page_size, bool sync);
+void  wal_close          (Wal *);
+bool  wal_has_page       (Wal *, Page_Id);
+bool  wal_read_page      (Wal *, Page_Id, u8 *out);
+void  wal_write_pages    (Wal *, Page_Id *ids, u8 **pages, u32 count, bool commit);
+void  wal_rollback       (Wal *);
+bool  wal_is_uncommitted (Wal *, Page_Id);
+void  wal_sync           (Wal *);
+void  wal_checkpoint     (Wal *, File db_file, Wal_Page_Writer *, void *ctx);
+void  wal_reset          (Wal *);
+u32   wal_frame_count    (Wal *);
@@ -0,0 +1,213 @@
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "writer.h"
+#include "error.h"
+
+// Linux only, so glibc hides it behind _GNU_SOURCE.
+#ifndef SCHED_IDLE
+    #define SCHED_IDLE 5
+#endif
+
+typedef struct {
+    u64 offset;
+    u8 *buf;
+    u32 amount;
+    void *tag;
+} Write;
+
+// Everything below the lock is shared with the thread. The
+// thread sleeps on has_work while the queue is empty, and the
+// owner sleeps on has_done in writer_wait(). Both rings hold
+// WRITER_QUEUE_DEPTH entries, which is enough since pending
+// never goes above that.
+struct Writer {
+    Mem *mem;
+    Files *fs;
+    File file;
+    u64 bytes_per_sec;
+    u64 next_ns; // The rate limit allows no write to start before this. Only used by the thread.
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    pthread_cond_t has_done;
+    bool stop;
+    u32 pending; // Writes that are queued, being written, or done but not handed back.
+
+    Write queue [WRITER_QUEUE_DEPTH];
+    u32 queue_head;
+    u32 queue_count;
+
+    void *done [WRITER_QUEUE_DEPTH];
+    u32 done_head;
+    u32 done_count;
+};
+
+static u64 now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+// Each write takes it's share of a second. Time spent idle
+// doesn't turn into a budget for a burst later on.
+static void throttle (Writer *writer, u32 amount) {
+    if (! writer->bytes_per_sec) return;
+
+    u64 now = now_ns();
+
+    if (writer->next_ns > now) {
+        u64 wait = writer->next_ns - now;
+        nanosleep(&(struct timespec){ .tv_sec = (time_t)(wait / 1000000000ull), .tv_nsec = (long)(wait % 1000000000ull) }, NULL);
+    } else {
+        writer->next_ns = now;
+    }
+
+    writer->next_ns += (u64)amount * 1000000000ull / writer->bytes_per_sec;
+}
+
+// The thread only gets the cpu when nothing else wants it, so
+// it never takes it from the thread that queues the writes. On
+// Linux a pid of 0 is the calling thread. If that fails the
+// thread runs at the normal priority. The queue is drained
+// before the thread stops.
+static void *writer_main (void *arg) {
+    Writer *writer = arg;
+    sched_setscheduler(0, SCHED_IDLE, &(struct sched_param){ 0 });
+    pthread_mutex_lock(&writer->lock);
+
+    while (true) {
+        while (!writer->queue_count && !writer->stop) pthread_cond_wait(&writer->has_work, &writer->lock);
+        if (! writer->queue_count) break;
+
+        Write write = writer->queue[writer->queue_head];
+        writer->queue_head = (writer->queue_head + 1) % WRITER_QUEUE_DEPTH;
+        writer->queue_count--;
+        pthread_mutex_unlock(&writer->lock);
+
+        throttle(writer, write.amount);
+        fs_write_to_file(writer->fs, writer->file, (String){ .data = (char*)write.buf, .count = write.amount }, write.offset);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->done[(writer->done_head + writer->done_count) % WRITER_QUEUE_DEPTH] = write.tag;
+        writer->done_count++;
+        pthread_cond_signal(&writer->has_done);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Returns NULL if the thread can't be started.
+Writer *writer_new (Files *fs, Mem *mem, File file, u64 bytes_per_sec) {
+    Writer *writer        = MEM_ALLOC_Z(mem, sizeof(Writer));
+    writer->mem           = mem;
+    writer->fs            = fs;
+    writer->file          = file;
+    writer->bytes_per_sec = bytes_per_sec;
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->has_work, NULL);
+    pthread_cond_init(&writer->has_done, NULL);
+
+    if (pthread_create(&writer->thread, NULL, writer_main, writer)) {
+        pthread_cond_destroy(&writer->has_done);
+        pthread_cond_destroy(&writer->has_work);
+        pthread_mutex_destroy(&writer->lock);
+        MEM_FREE(mem, writer, sizeof(Writer));
+        return NULL;
+    }
+
+    return writer;
+}
+
+// Queued writes are still done, but their tags are dropped.
+void writer_destroy (Writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = true;
+    pthread_cond_signal(&writer->has_work);
+    pthread_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    pthread_cond_destroy(&writer->has_done);
+    pthread_cond_destroy(&writer->has_work);
+    pthread_mutex_destroy(&writer->lock);
+    MEM_FREE(writer->mem, writer, sizeof(Writer));
+}
+
+// Returns false if the queue is full.
+bool writer_write (Writer *writer, u64 offset, u8 *buf, u32 amount, void *tag) {
+    pthread_mutex_lock(&writer->lock);
+    bool queued = writer->pending < WRITER_QUEUE_DEPTH;
+
+    if (queued) {
+        writer->queue[(writer->queue_head + writer->queue_count) % WRITER_QUEUE_DEPTH] = (Write){ .offset = offset, .buf = buf, .amount = amount, .tag = tag };
+        writer->queue_count++;
+        writer->pending++;
+        if (writer->queue_count == 1) pthread_cond_signal(&writer->has_work); // Otherwise the thread is awake already.
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return queued;
+}
+
+// Take a write back out of the queue if the thread hasn't
+// started it yet. Returns false if it has.
+bool writer_cancel (Writer *writer, void *tag) {
+    pthread_mutex_lock(&writer->lock);
+    bool found = false;
+
+    for (u32 i = 0; i < writer->queue_count; ++i) {
+        u32 idx = (writer->queue_head + i) % WRITER_QUEUE_DEPTH;
+        if (writer->queue[idx].tag != tag) continue;
+
+        for (; i + 1 < writer->queue_count; ++i) {
+            u32 next = (writer->queue_head + i + 1) % WRITER_QUEUE_DEPTH;
+            writer->queue[idx] = writer->queue[next];
+            idx = next;
+        }
+
+        writer->queue_count--;
+        writer->pending--;
+        found = true;
+        break;
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return found;
+}
+
+// The lock must be held and a write must be done.
+static void *pop_done (Writer *writer) {
+    void *tag = writer->done[writer->done_head];
+    writer->done_head = (writer->done_head + 1) % WRITER_QUEUE_DEPTH;
+    writer->done_count--;
+    writer->pending--;
+    return tag;
+}
+
+// Returns the tag of a write that is done, or NULL if none is
+// done yet. Doesn't block.
+void *writer_poll (Writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    void *tag = writer->done_count ? pop_done(writer) : NULL;
+    pthread_mutex_unlock(&writer->lock);
+    return tag;
+}
+
+// Blocks until a write is done and returns it's tag. Returns
+// NULL if there are no writes left to wait for.
+void *writer_wait (Writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    void *tag = NULL;
+
+    if (writer->pending) {
+        while (! writer->done_count) pthread_cond_wait(&writer->has_done, &writer->lock);
+        tag = pop_done(writer);
+    }
+
+    pthread_mutex_unlock(&writer->lock);
+    return tag;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "files.h"
+#include "common.h"
+#include "memory.h"
+
+// =============================================================================
+// A background thread that writes buffers into one file.
+//
+// Writes are queued with writer_write() and the thread does them
+// in the order they were queued, at no more than bytes_per_sec
+// (0 = no limit). A buffer must not change until its write has
+// been handed back by writer_poll() or writer_wait(), which return
+// the tag that came with it, or taken back with writer_cancel().
+// At most WRITER_QUEUE_DEPTH writes can be queued or done but not
+// yet handed back.
+// =============================================================================
+typedef struct Writer Writer;
+
+#define WRITER_QUEUE_DEPTH 64
+
+Writer *writer_new     (Files *, Mem *, File, u64 bytes_per_sec);
+void    writer_destroy (Writer *);
+bool    writer_write   (Writer *, u64 offset, u8 *buf, u32 amount, void *tag);
+bool    writer_cancel  (Writer *, void *tag);
+void   *writer_poll    (Writer *);
+void   *writer_wait    (Writer *);
@@ -0,0 +1,237 @@
+// Microbenchmark for point lookups with bcursor_goto_ukey() on
+// a table with int keys. The same keys are loaded into a tree
+// for each page size, so the node fan-out is the only thing
+// that changes. The db is kept in memory and the cache is big
+// enough to hold every page, so no lookup touches the disk.
+//
+// The second part does the same with long text keys that share
+// most of their bytes, like urls, and reports the shape of the
+// tree and the pages read per lookup.
+//
+// The last part loads the same rows with a bcursor_insert() per
+// row, in key order and shuffled, and with a BLoader, and compares
+// the load throughput and the shape of the resulting trees.
+//
+// Usage: tests/btree_bench [row count] [lookup count]
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "typer.h"
+#include "files.h"
+#include "memory.h"
+#include "string.h"
+
+#define VAL_SIZE 8 // Bytes of payload per row.
+
+static u64 now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static u32 xorshift (u32 *state) {
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Just enough of a schema for get_btype_for_table(): one
+// column that is the primary key.
+static Type_Table *table_new (Mem *mem, Type *key_type) {
+    Mem_Arena *arena = mem_arena_new(mem, 1*KB);
+
+    Type_Column *col = MEM_ALLOC_Z(arena, sizeof(Type_Column));
+    col->base.tag    = TYPE_COLUMN;
+    col->field       = key_type;
+
+    Row_Scope *scope = MEM_ALLOC_Z(arena, sizeof(Row_Scope));
+    array_init(&scope->cols, (Mem*)arena);
+    array_add(&scope->cols, col);
+
+    Type_Row *row = MEM_ALLOC_Z(arena, sizeof(Type_Row));
+    row->base.tag = TYPE_ROW;
+    array_init(&row->scopes, (Mem*)arena);
+    array_add(&row->scopes, scope);
+
+    Type_Table *table = MEM_ALLOC_Z(arena, sizeof(Type_Table));
+    table->base.tag   = TYPE_TABLE;
+    table->row        = row;
+    table->mem        = arena;
+
+    return table;
+}
+
+static void run (Mem *mem, u32 page_size, u32 row_count, u64 lookups) {
+    Files *fs = fs_new(mem);
+    Pager_Options options = { .page_size = page_size, .cache_size_bytes = (u64)row_count * 64 + 1*MB };
+    BEngine *engine = bengine_new(fs, mem, str(":memory:"), &options);
+    static Type type_int = { TYPE_INT };
+    Type_Table *table = table_new(mem, &type_int);
+    BTree *tree = btree_new(engine, table);
+
+    u8 val [4 + VAL_SIZE] = {0};
+    write_u32_le(val, VAL_SIZE);
+
+    BCursor *cursor = bcursor_new(tree);
+    for (u32 i = 0; i < row_count; ++i) {
+        s64 key = (s64)i * 2; // Every other key is missing.
+        bcursor_goto_ukey(cursor, (UKey){ &key });
+        bcursor_insert(cursor, (UKey){ &key }, (Val){ val });
+    }
+    bcursor_close(cursor);
+    bengine_flush(engine);
+
+    cursor = bcursor_new_read_only(tree);
+    u32 seed = 1;
+    u64 found = 0;
+
+    u64 start = now_ns();
+    for (u64 i = 0; i < lookups; ++i) {
+        s64 key = xorshift(&seed) % (2 * row_count);
+        found += bcursor_goto_ukey(cursor, (UKey){ &key });
+    }
+    u64 elapsed = now_ns() - start;
+    bcursor_close(cursor);
+
+    // Leaf cells are the key, the value and a cell pointer.
+    u32 max_fan_out = (page_size - 12) / (8 + 4 + VAL_SIZE + 2);
+    printf("page %5u  fan-out <= %4u  %7.1f ns/lookup  (found %llu)\n", page_size, max_fan_out, (double)elapsed / (double)lookups, (unsigned long long)found);
+
+    Pager_Stats stats = bengine_get_cache_stats(engine);
+    if (stats.evictions) printf("warning: %llu evictions, the cache is not hot\n", (unsigned long long)stats.evictions);
+
+    mem_arena_destroy(table->mem);
+    bengine_close(engine);
+    fs_destroy(fs);
+}
+
+// The url of the i-th row. Row ids are scattered with a
+// multiplicative hash so that the keys arrive in random order.
+static String url_key (char *buf, u32 i) {
+    static char *paths[] = { "catalog/electronics/audio", "catalog/electronics/video", "catalog/garden/tools", "blog/2024/posts" };
+    u32 id = i * 2654435761u;
+    int len = sprintf(buf, "https://www.example-store.com/%s/item-%010u.html", paths[id % 4], id);
+    return (String){ .count = len, .data = buf };
+}
+
+static void run_text (Mem *mem, u32 page_size, u32 row_count, u64 lookups) {
+    Files *fs = fs_new(mem);
+    Pager_Options options = { .page_size = page_size, .cache_size_bytes = (u64)row_count * 256 + 1*MB };
+    BEngine *engine = bengine_new(fs, mem, str(":memory:"), &options);
+    static Type type_text = { TYPE_TEXT };
+    Type_Table *table = table_new(mem, &type_text);
+    BTree *tree = btree_new(engine, table);
+
+    u8 val [4 + VAL_SIZE] = {0};
+    write_u32_le(val, VAL_SIZE);
+    char buf [128];
+
+    BCursor *cursor = bcursor_new(tree);
+    for (u32 i = 0; i < row_count; ++i) {
+        String key = url_key(buf, 2*i); // Every other key is missing.
+        bcursor_goto_ukey(cursor, (UKey){ &key });
+        bcursor_insert(cursor, (UKey){ &key }, (Val){ val });
+    }
+    bcursor_close(cursor);
+    bengine_flush(engine);
+
+    cursor = bcursor_new_read_only(tree);
+    u32 seed = 1;
+    u64 found = 0;
+    Pager_Stats before = bengine_get_cache_stats(engine);
+
+    u64 start = now_ns();
+    for (u64 i = 0; i < lookups; ++i) {
+        String key = url_key(buf, xorshift(&seed) % (2 * row_count));
+        found += bcursor_goto_ukey(cursor, (UKey){ &key });
+    }
+    u64 elapsed = now_ns() - start;
+    bcursor_close(cursor);
+
+    Pager_Stats after = bengine_get_cache_stats(engine);
+    u64 reads = (after.hits + after.misses) - (before.hits + before.misses);
+    BTree_Stats stats = btree_get_stats(tree);
+
+    printf("page %5u  height %u  leaves %6llu  fill %4.1f%%  %5.2f pages/lookup  %7.1f ns/lookup  (found %llu)\n",
+           page_size, stats.height, (unsigned long long)stats.leaves, 100 * stats.fill_factor,
+           (double)reads / (double)lookups, (double)elapsed / (double)lookups, (unsigned long long)found);
+
+    mem_arena_destroy(table->mem);
+    bengine_close(engine);
+    fs_destroy(fs);
+}
+
+typedef enum { LOAD_SORTED, LOAD_SHUFFLED, LOAD_BULK } Load_Mode;
+
+// Loads the keys 0 to row_count. Text keys are urls with the
+// number zero padded, so they sort the same way. The shuffled
+// order is a multiplicative permutation of the keys.
+static void run_load (Mem *mem, u32 page_size, u32 row_count, bool text, Load_Mode mode) {
+    Files *fs = fs_new(mem);
+    Pager_Options options = { .page_size = page_size, .cache_size_bytes = (u64)row_count * 256 + 1*MB };
+    BEngine *engine = bengine_new(fs, mem, str(":memory:"), &options);
+    static Type type_int  = { TYPE_INT };
+    static Type type_text = { TYPE_TEXT };
+    Type_Table *table = table_new(mem, text ? &type_text : &type_int);
+    BTree *tree = btree_new(engine, table);
+
+    u8 val [4 + VAL_SIZE] = {0};
+    write_u32_le(val, VAL_SIZE);
+    char buf [128];
+
+    bool bulk       = (mode == LOAD_BULK);
+    BCursor *cursor = bulk ? NULL : bcursor_new(tree);
+    BLoader *loader = bulk ? bloader_new(tree, 0) : NULL;
+
+    u64 start = now_ns();
+    for (u32 j = 0; j < row_count; ++j) {
+        u32 i = (mode == LOAD_SHUFFLED) ? (u32)((u64)j * 1000003 % row_count) : j;
+        s64 int_key = i;
+        String str_key = { .data = buf, .count = sprintf(buf, "https://www.example-store.com/catalog/item-%010u.html", i) };
+        UKey key = text ? (UKey){ &str_key } : (UKey){ &int_key };
+
+        if (bulk) {
+            bloader_add(loader, key, (Val){ val });
+        } else {
+            bcursor_goto_ukey(cursor, key);
+            bcursor_insert(cursor, key, (Val){ val });
+        }
+    }
+    if (bulk) bloader_finish(loader);
+    else      bcursor_close(cursor);
+    u64 elapsed = now_ns() - start;
+
+    BTree_Stats stats = btree_get_stats(tree);
+    printf("page %5u  %-4s  %-8s  %6.2f M rows/s  height %u  leaves %6llu  fill %4.1f%%\n",
+           page_size, text ? "text" : "int", (char*[]){ "sorted", "shuffled", "bulk" }[mode], (double)row_count * 1e3 / (double)elapsed,
+           stats.height, (unsigned long long)stats.leaves, 100 * stats.fill_factor);
+
+    mem_arena_destroy(table->mem);
+    bengine_close(engine);
+    fs_destroy(fs);
+}
+
+int main (int argc, char **argv) {
+    u32 row_count = (argc > 1) ? (u32)atol(argv[1]) : 200000;
+    u64 lookups   = (argc > 2) ? (u64)atoll(argv[2]) : 2000000;
+
+    Mem *mem = (Mem*)mem_clib_new();
+    for (u32 page_size = 512; page_size <= 32*KB; page_size *= 2) run(mem, page_size, row_count, lookups);
+
+    printf("\ntext keys:\n");
+    for (u32 page_size = 512; page_size <= 32*KB; page_size *= 2) run_text(mem, page_size, row_count, lookups);
+
+    printf("\nloads:\n");
+    for (u32 page_size = 1*KB; page_size <= 16*KB; page_size *= 4) {
+        for (u32 text = 0; text < 2; ++text) {
+            for (Load_Mode mode = LOAD_SORTED; mode <= LOAD_BULK; ++mode) run_load(mem, page_size, row_count, text, mode);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,269 @@
+// Regression tests for the btree. Each test runs a seeded random
+// workload of inserts, updates and removes against one tree and
+// compares the tree with a plain array of the keys that should be
+// in it. The comparison is a full scan in key order plus a lookup
+// of every key that was ever generated. Build with asserts enabled
+// so that the CHECK() calls in the engine run on every node.
+//
+// Usage: tests/btree_test
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "engine.h"
+#include "typer.h"
+#include "files.h"
+#include "memory.h"
+#include "string.h"
+
+#define MAX_KEY_LEN 100
+#define MAX_VAL_LEN 300
+
+typedef struct {
+    char *name;
+    u32 page_size;
+    u32 key_count;
+    u32 max_key_len; // Keys are 8 digits plus up to this many bytes.
+    u32 max_val_len;
+    u32 rounds;      // The tree is checked after every round.
+    u32 steps;       // Operations per round.
+    u32 seed;
+    u32 updates;     // Percent of the found keys that get a new value instead of being removed.
+    u32 appends;     // Keys that go in with btree_append() before the first round.
+    bool int_keys;   // The primary key is an int instead of text, which gives the tree dense nodes.
+} Workload;
+
+typedef struct {
+    char key [MAX_KEY_LEN];
+    s64 int_key;
+    u32 val_len;
+    bool alive;
+} Entry;
+
+static u32 xorshift (u32 *state) {
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Just enough of a schema for get_btype_for_table(): one text
+// or int column that is the primary key.
+static Type_Table *table_new (Mem *mem, bool int_key) {
+    static Type type_text = { TYPE_TEXT };
+    static Type type_int  = { TYPE_INT };
+    Mem_Arena *arena = mem_arena_new(mem, 1*KB);
+
+    Type_Column *col = MEM_ALLOC_Z(arena, sizeof(Type_Column));
+    col->base.tag    = TYPE_COLUMN;
+    col->field       = int_key ? &type_int : &type_text;
+
+    Row_Scope *scope = MEM_ALLOC_Z(arena, sizeof(Row_Scope));
+    array_init(&scope->cols, (Mem*)arena);
+    array_add(&scope->cols, col);
+
+    Type_Row *row = MEM_ALLOC_Z(arena, sizeof(Type_Row));
+    row->base.tag = TYPE_ROW;
+    array_init(&row->scopes, (Mem*)arena);
+    array_add(&row->scopes, scope);
+
+    Type_Table *table = MEM_ALLOC_Z(arena, sizeof(Type_Table));
+    table->base.tag   = TYPE_TABLE;
+    table->row        = row;
+    table->mem        = arena;
+
+    return table;
+}
+
+// The 8 leading digits are unique, so no key is a prefix of
+// another one and the order of two keys never depends on the
+// bytes after the digits.
+static void make_key (char *out, u32 idx, u32 max_len, u32 *seed) {
+    u32 len = (u32)sprintf(out, "%08u", idx);
+    u32 pad = xorshift(seed) % (max_len + 1);
+    for (u32 i = 0; i < pad; ++i) out[len++] = "abcdefgh/"[xorshift(seed) % 9];
+    out[len] = 0;
+}
+
+// Int keys are spread out over negative and positive numbers
+// but stay in the order of their indices, like the text keys.
+static s64 make_int_key (u32 idx) {
+    return (s64)idx * 1000003 - 1000000000;
+}
+
+static String key_string (Entry *entry) {
+    return (String){ .data = entry->key, .count = strlen(entry->key) };
+}
+
+// The string is only used for text keys.
+static UKey entry_ukey (Workload *w, Entry *entry, String *str) {
+    if (w->int_keys) return (UKey){ &entry->int_key };
+    *str = key_string(entry);
+    return (UKey){ str };
+}
+
+static bool check_tree (Workload *w, BTree *tree, Entry *entries, u32 count) {
+    BCursor *cursor = bcursor_new_read_only(tree);
+    bool ok = true;
+
+    // The keys are made in the order of their indices, so the
+    // expected scan order is the order of the array.
+    u32 idx = 0;
+    if (bcursor_goto_first(cursor)) do {
+        while (idx < count && !entries[idx].alive) idx++;
+        if (idx == count) { ok = false; break; }
+
+        Val val = bcursor_read(cursor);
+        if (read_u32_le(val.ptr) != entries[idx].val_len) { ok = false; break; }
+        idx++;
+    } while (bcursor_goto_next(cursor));
+
+    while (ok && idx < count) if (entries[idx++].alive) ok = false;
+
+    for (u32 i = 0; ok && i < count; ++i) {
+        String str;
+        if (bcursor_goto_ukey(cursor, entry_ukey(w, &entries[i], &str)) != entries[i].alive) ok = false;
+    }
+
+    bcursor_close(cursor);
+    return ok;
+}
+
+// Everything is allocated through a tracking allocator, so that
+// the memory the pager keeps until the process exits is freed
+// after each workload.
+static bool run (Mem *mem_root, Workload *w) {
+    printf("%-44s ", w->name);
+    fflush(stdout); // An assert in the engine aborts the process.
+
+    Mem_Track *track = mem_track_new(mem_root);
+    Mem *mem = (Mem*)track;
+    Files *fs = fs_new(mem);
+    Pager_Options options = { .page_size = w->page_size, .cache_size = 100000 };
+    BEngine *engine = bengine_new(fs, mem, str(":memory:"), &options);
+    Type_Table *table = table_new(mem, w->int_keys);
+    BTree *tree = btree_new(engine, table);
+
+    u32 seed = w->seed;
+    Entry *entries = MEM_ALLOC(mem, w->key_count * sizeof(Entry));
+    for (u32 i = 0; i < w->key_count; ++i) {
+        make_key(entries[i].key, i, w->max_key_len, &seed);
+        entries[i].int_key = make_int_key(i);
+        entries[i].alive = false;
+    }
+
+    u8 val [4 + MAX_VAL_LEN] = {0};
+    bool ok = true;
+
+    // The keys are in order, so each append has to be taken. The
+    // first key once more is out of order and must be refused.
+    for (u32 i = 0; ok && i < w->appends; ++i) {
+        Entry *entry = &entries[i];
+        String str;
+        entry->val_len = xorshift(&seed) % (w->max_val_len + 1);
+        write_u32_le(val, entry->val_len);
+        ok = entry->alive = btree_append(tree, entry_ukey(w, entry, &str), (Val){ val });
+    }
+
+    if (ok && w->appends) {
+        String str;
+        ok = !btree_append(tree, entry_ukey(w, &entries[0], &str), (Val){ val });
+    }
+
+    BCursor *cursor = bcursor_new(tree);
+
+    for (u32 round = 0; ok && round < w->rounds; ++round) {
+        for (u32 step = 0; step < w->steps; ++step) {
+            Entry *entry = &entries[xorshift(&seed) % w->key_count];
+            String str;
+            UKey key = entry_ukey(w, entry, &str);
+
+            if (bcursor_goto_ukey(cursor, key) != entry->alive) { ok = false; break; }
+
+            if (entry->alive && (xorshift(&seed) % 100) < w->updates) {
+                entry->val_len = xorshift(&seed) % (w->max_val_len + 1);
+                write_u32_le(val, entry->val_len);
+                bcursor_update(cursor, (Val){ val });
+            } else if (entry->alive) {
+                bcursor_remove(cursor);
+                entry->alive = false;
+            } else {
+                entry->val_len = xorshift(&seed) % (w->max_val_len + 1);
+                write_u32_le(val, entry->val_len);
+                bcursor_insert(cursor, key, (Val){ val });
+                entry->alive = true;
+            }
+        }
+
+        bcursor_reset(cursor);
+        if (ok) ok = check_tree(w, tree, entries, w->key_count);
+    }
+
+    bcursor_close(cursor);
+    MEM_FREE(mem, entries, w->key_count * sizeof(Entry));
+    mem_arena_destroy(table->mem);
+    bengine_close(engine);
+    fs_destroy(fs);
+    mem_track_destroy(track);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static Workload workloads[] = {
+    // node_move_cells_left() can defragment the left node
+    // between two cells, which must see the cells moved so far.
+    { "defragment while moving cells left", 512, 3000, 8, 20, 4, 6000, 4, 0, 0, false },
+
+    // A rotation of inner cells moves the parent's separator into
+    // the receiving node, which can be bigger than the cell that
+    // goes up in its place.
+    { "rotate inner cells with a bigger separator", 512, 3000, 8, 20, 4, 6000, 1, 0, 0, false },
+
+    // When a split leaves the cursor in the right half, the next
+    // pass through node_ensure_cell_space() must see the right
+    // node's siblings and not the left one's.
+    { "make room again after a split", 512, 3000, 8, 120, 4, 6000, 1, 0, 0, false },
+
+    // Removes can empty a node that still has a fragmented cell
+    // area, and the next allocation in it must start at the end
+    // of the page again.
+    { "allocate in an emptied node", 512, 3000, 8, 200, 4, 6000, 1, 0, 0, false },
+
+    // bcursor_update() must compare the new value with the old
+    // value and not with the whole cell, or it writes a value of
+    // the cell's size over the next cell.
+    { "update to the size of the old cell", 512, 3000, 8, 20, 4, 6000, 3, 50, 0, false },
+
+    // Making room for the new value can split the leaf and move
+    // the cursor to the other half.
+    { "update that splits the leaf", 512, 3000, 8, 60, 4, 6000, 1, 50, 0, false },
+
+    // Appends go into a BLoader that fills every page, and the
+    // cursor that comes after them must find the finished tree.
+    { "insert into an appended tree", 512, 3000, 80, 60, 4, 6000, 2, 30, 2000, false },
+
+    // Dense nodes keep the keys apart from the cells, and the
+    // array of cell offsets moves whenever a key is added or
+    // removed, so every path that moves cells gets run on them:
+    // splits, rotations, merges and defragmentation.
+    { "dense nodes with small values", 512, 3000, 0, 20, 4, 6000, 5, 0, 0, true },
+    { "dense nodes with big values", 512, 3000, 0, 200, 4, 6000, 6, 0, 0, true },
+    { "update cells of dense nodes", 512, 3000, 0, 60, 4, 6000, 7, 50, 0, true },
+    { "insert into an appended dense tree", 512, 3000, 0, 60, 4, 6000, 8, 30, 2000, true },
+
+    // With big pages the search goes through a few hundred keys
+    // per node before the last ones get counted together.
+    { "search big dense nodes", 8192, 20000, 0, 8, 4, 30000, 9, 20, 0, true },
+};
+
+int main (int argc, char **argv) {
+    Mem_Clib *mem = mem_clib_new();
+    u32 failed = 0;
+
+    for (u32 i = 0; i < sizeof(workloads)/sizeof(workloads[0]); ++i) failed += !run((Mem*)mem, &workloads[i]);
+
+    mem_clib_destroy(mem);
+    return failed ? 1 : 0;
+}
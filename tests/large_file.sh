@@ -0,0 +1,54 @@
+#!/bin/bash
+# Stress test for db files larger than 4GB. The db file is grown to
+# 5GB as a sparse file, so this only needs a file system that supports
+# sparse files. New pages then land at offsets above 4GB.
+#
+# Usage: tests/large_file.sh [path to shell binary]
+
+set -e
+
+shell=${1:-./shell}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+db=$dir/large.db
+page_size=8192
+big_size=$((5 * 1024 * 1024 * 1024))
+
+fail () {
+    echo "large_file: $1"
+    exit 1
+}
+
+write_u32_le () { # file offset value
+    printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' \
+        $(($3 & 255)) $((($3 >> 8) & 255)) $((($3 >> 16) & 255)) $((($3 >> 24) & 255)))" |
+        dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+echo "create table T (id int primary key, v int, s text)" > $dir/create.sql
+"$shell" -i $dir/create.sql -d $db -page-size $page_size > /dev/null
+
+# Grow the file and bump the page count in the header (offset 29)
+# so that every page allocated from now on is past the 4GB mark.
+truncate -s $big_size $db
+write_u32_le $db 29 $((big_size / page_size))
+
+for i in $(seq 0 19999); do
+    echo "insert into T ($i, $((i % 100)), \"row $i with some padding to fill the pages up faster\")"
+done > $dir/insert.sql
+"$shell" -i $dir/insert.sql -d $db > /dev/null
+
+echo "select count(*), sum(v) from T" > $dir/select.sql
+result=$("$shell" -i $dir/select.sql -d $db)
+
+echo "$result" | grep -q "20000 *│ 990000" || fail "wrong result after reopening: $result"
+[ $(stat -c %s $db) -gt $big_size ] || fail "the file did not grow past $big_size bytes"
+
+# A file whose size is not a multiple of the page size must be
+# rejected with an error instead of an assert.
+truncate -s $((big_size + 100)) $db
+if "$shell" -i $dir/select.sql -d $db > $dir/out.txt 2>&1; then :; fi
+grep -q "Could not open the database" $dir/out.txt || fail "a corrupt file was not rejected"
+
+echo "large_file: OK"
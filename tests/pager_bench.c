@@ -0,0 +1,233 @@
+// Microbenchmark for pager_get_page() on a hot cache. A db file
+// is filled with empty pages and the cache is made big enough to
+// hold all of them, so every lookup in the timed loops is a hit
+// and the time is spent in the page table and the ref counting.
+//
+// The second part measures what each checksum verify mode adds
+// to a page load. The db is kept in memory and the cache is tiny,
+// so nearly every lookup is a miss and a load is a copy out of
+// the memory file (or just a pointer with mmap) plus the check.
+// Every mode runs once per round and the best round is reported,
+// which keeps the noise of a single run out of the comparison.
+//
+// The third part shows the latency of single page updates with
+// and without clean ahead. A db file many times the size of the
+// cache gets random updates, so nearly every update evicts a
+// dirty page. The updates are timed one by one. The cleaner's
+// writer thread only gets the cpu when the updates leave it idle,
+// so the runs are repeated with a short pause after every burst
+// of CLEAN_BURST updates, the way requests come in to a server.
+//
+// Usage: tests/pager_bench [page count] [lookup count]
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pager.h"
+#include "crc.h"
+#include "files.h"
+#include "memory.h"
+#include "string.h"
+
+static u64 now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static u32 xorshift (u32 *state) {
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void report (char *name, u64 lookups, u64 elapsed_ns) {
+    printf("%-10s %6.1f ns/lookup  %7.2f M lookups/s\n", name, (double)elapsed_ns / (double)lookups, (double)lookups * 1000.0 / (double)elapsed_ns);
+}
+
+#define VERIFY_PAGE_COUNT  20000
+#define VERIFY_CACHE_PAGES 64
+#define VERIFY_LOADS       200000
+#define VERIFY_ROUNDS      7
+
+typedef struct {
+    char *name;
+    bool checksums;
+    Pager_Verify verify;
+} Verify_Mode;
+
+static Verify_Mode verify_modes[] = {
+    { "off",        false, PAGER_VERIFY_ALWAYS },
+    { "always",     true,  PAGER_VERIFY_ALWAYS },
+    { "first load", true,  PAGER_VERIFY_FIRST_LOAD },
+    { "sampled",    true,  PAGER_VERIFY_SAMPLED },
+};
+
+#define VERIFY_MODE_COUNT (sizeof(verify_modes) / sizeof(verify_modes[0]))
+
+// Returns the time per page load in ns.
+static double time_page_loads (Mem *mem, Verify_Mode *mode, bool mmap) {
+    Files *fs = fs_new(mem);
+    Pager_Options options = { .page_size = 4*KB, .cache_size = VERIFY_CACHE_PAGES, .checksums = mode->checksums, .verify = mode->verify, .mmap = mmap };
+    Pager *pager = pager_new(fs, mem, str(":memory:"), &options);
+
+    for (u32 i = 0; i < VERIFY_PAGE_COUNT; ++i) pager_unref_page(pager, pager_alloc_page(pager));
+    pager_flush(pager);
+
+    u32 seed = 1;
+    u64 misses = pager_get_stats(pager).misses;
+
+    u64 start = now_ns();
+    for (u32 i = 0; i < VERIFY_LOADS; ++i) pager_unref_page(pager, pager_get_page(pager, 1 + xorshift(&seed) % VERIFY_PAGE_COUNT));
+    u64 elapsed = now_ns() - start;
+
+    misses = pager_get_stats(pager).misses - misses;
+
+    pager_close(pager);
+    fs_destroy(fs);
+    return (double)elapsed / (double)misses;
+}
+
+static void bench_verify (Mem *mem) {
+    u8 page [4*KB] = {0};
+    u32 crc = 0;
+
+    u64 start = now_ns();
+    for (u32 i = 0; i < VERIFY_LOADS; ++i) { page[0] = (u8)i; crc ^= crc32c(page, sizeof(page) - 4); }
+    double crc_ns = (double)(now_ns() - start) / VERIFY_LOADS;
+
+    double best [VERIFY_MODE_COUNT][2];
+    for (u32 i = 0; i < VERIFY_MODE_COUNT; ++i) best[i][0] = best[i][1] = 1e18;
+
+    for (u32 round = 0; round < VERIFY_ROUNDS; ++round) {
+        for (u32 i = 0; i < VERIFY_MODE_COUNT; ++i) {
+            for (u32 mmap = 0; mmap < 2; ++mmap) {
+                double ns = time_page_loads(mem, &verify_modes[i], mmap);
+                if (ns < best[i][mmap]) best[i][mmap] = ns;
+            }
+        }
+    }
+
+    printf("\nverify      pread ns/load      mmap ns/load   (4K pages, best of %u)\n", VERIFY_ROUNDS);
+    for (u32 i = 0; i < VERIFY_MODE_COUNT; ++i) {
+        printf("%-10s %6.0f (%+5.0f)     %6.0f (%+5.0f)\n", verify_modes[i].name,
+               best[i][0], best[i][0] - best[0][0],
+               best[i][1], best[i][1] - best[0][1]);
+    }
+    printf("crc32c of one page alone: %.0f ns\n", crc_ns);
+    if (! crc) printf("\n"); // Keeps the crc loop from being optimized out.
+}
+
+#define CLEAN_PAGE_COUNT  16000
+#define CLEAN_CACHE_PAGES 1024
+#define CLEAN_UPDATES     200000
+#define CLEAN_PERCENT     25
+#define CLEAN_BURST       16
+#define CLEAN_IDLE_US     200
+
+static int cmp_u64 (const void *a, const void *b) {
+    u64 A = *(u64*)a;
+    u64 B = *(u64*)b;
+    return (A > B) - (A < B);
+}
+
+static void time_updates (Mem *mem, char *name, u32 clean_ahead, u32 idle_us) {
+    char *path = "/tmp/pager_bench_clean.db";
+    remove(path);
+
+    Files *fs = fs_new(mem);
+
+    Pager_Options options = { .page_size = 4*KB, .cache_size = CLEAN_CACHE_PAGES, .sync = PAGER_SYNC_OFF, .clean_ahead = clean_ahead };
+    Pager *pager = pager_new(fs, mem, str(path), &options);
+    for (u32 i = 0; i < CLEAN_PAGE_COUNT; ++i) pager_unref_page(pager, pager_alloc_page(pager));
+    pager_flush(pager);
+
+    u64 *latency = malloc(CLEAN_UPDATES * sizeof(u64));
+    u32 seed = 1;
+    u64 dirty_evictions = pager_get_stats(pager).dirty_evictions;
+    u64 total = 0;
+
+    for (u32 i = 0; i < CLEAN_UPDATES; ++i) {
+        u64 start = now_ns();
+        Page_Ref *ref = pager_get_page_mutable(pager, 1 + xorshift(&seed) % CLEAN_PAGE_COUNT);
+        ref->buf[0]++;
+        pager_unref_page(pager, ref);
+        latency[i] = now_ns() - start;
+        total += latency[i];
+        if (idle_us && (i % CLEAN_BURST == CLEAN_BURST - 1)) usleep(idle_us);
+    }
+
+    dirty_evictions = pager_get_stats(pager).dirty_evictions - dirty_evictions;
+    qsort(latency, CLEAN_UPDATES, sizeof(u64), cmp_u64);
+
+    printf("%-14s %6.0f %7llu %7llu %7llu %8llu   %6.2f%%\n", name, (double)total / CLEAN_UPDATES,
+           (unsigned long long)latency[CLEAN_UPDATES / 2],
+           (unsigned long long)latency[CLEAN_UPDATES * 99 / 100],
+           (unsigned long long)latency[CLEAN_UPDATES * 999 / 1000],
+           (unsigned long long)latency[CLEAN_UPDATES - 1],
+           100.0 * (double)dirty_evictions / CLEAN_UPDATES);
+
+    free(latency);
+    pager_close(pager);
+    fs_destroy(fs);
+    remove(path);
+}
+
+static void bench_clean (Mem *mem) {
+    printf("\nclean ahead    ns/update (mean, p50, p99, p99.9, max)   dirty evictions\n");
+    time_updates(mem, "off", 0, 0);
+    time_updates(mem, "writer thread", CLEAN_PERCENT, 0);
+    time_updates(mem, "off idle", 0, CLEAN_IDLE_US);
+    time_updates(mem, "writer idle", CLEAN_PERCENT, CLEAN_IDLE_US);
+}
+
+int main (int argc, char **argv) {
+    u32 page_count = (argc > 1) ? (u32)atol(argv[1]) : 10000;
+    u64 lookups    = (argc > 2) ? (u64)atoll(argv[2]) : 20000000;
+
+    char *path = "/tmp/pager_bench.db";
+    remove(path);
+
+    Mem *mem   = (Mem*)mem_clib_new();
+    Files *fs  = fs_new(mem);
+    Pager_Options options = { .page_size = 4*KB, .cache_size = page_count + 1 };
+    Pager *pager = pager_new(fs, mem, str(path), &options);
+
+    for (u32 i = 0; i < page_count; ++i) pager_unref_page(pager, pager_alloc_page(pager));
+    pager_flush(pager);
+
+    u32 seed = 1;
+    u64 checksum = 0;
+
+    u64 start = now_ns();
+    for (u64 i = 0; i < lookups; ++i) {
+        Page_Ref *ref = pager_get_page(pager, 1 + (Page_Id)(i % page_count));
+        checksum += ref->id;
+        pager_unref_page(pager, ref);
+    }
+    report("sequential", lookups, now_ns() - start);
+
+    start = now_ns();
+    for (u64 i = 0; i < lookups; ++i) {
+        Page_Ref *ref = pager_get_page(pager, 1 + xorshift(&seed) % page_count);
+        checksum += ref->id;
+        pager_unref_page(pager, ref);
+    }
+    report("random", lookups, now_ns() - start);
+
+    Pager_Stats stats = pager_get_stats(pager);
+    if (stats.misses) printf("warning: %llu misses, the cache is not hot\n", (unsigned long long)stats.misses);
+    if (! checksum) printf("\n"); // Keeps the loops from being optimized out.
+
+    pager_close(pager);
+    fs_destroy(fs);
+    remove(path);
+
+    bench_verify(mem);
+    bench_clean(mem);
+    return 0;
+}